@@ -0,0 +1,483 @@
+/*******************************************************
+ HIDAPI - Multi-Platform library for
+ communication with HID devices.
+
+ libusb/hidapi Team
+
+ Copyright 2024, All Rights Reserved.
+
+ At the discretion of the user of this library,
+ this software may be licensed under the terms of the
+ GNU General Public License v3, a BSD-Style license, or the
+ original HIDAPI license as outlined in the LICENSE.txt,
+ LICENSE-gpl3.txt, LICENSE-bsd.txt, and LICENSE-orig.txt
+ files located at the root of the source distribution.
+ These files may also be found in the public source
+ code repository located at:
+        https://github.com/libusb/hidapi .
+********************************************************/
+
+/* hidapi-decodegen: write a C/C++ header of accessors for the fields of
+   the reports of a device.
+
+   The report descriptor is compiled by the library itself, with
+   hid_get_report_fields() or hid_parse_report_descriptor(); this tool
+   only turns each field into a
+   static inline function, with its offset and size as constants, so
+   that the compiler can reduce it to a few loads and shifts. */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include <hidapi.h>
+
+#define MAX_NAME 128
+
+/* wDescriptorLength of the HID descriptor is 16 bits */
+#define MAX_DESCRIPTOR_SIZE 65535
+
+static const char *report_type_names[] = { "input", "output", "feature" };
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"Usage: %s [-p prefix] [-o file] <vid:pid | path | -d file>\n"
+		"\n"
+		"Write a header of accessors for the fields of the reports of a\n"
+		"HID device, compiled from its report descriptor.\n"
+		"\n"
+		"  -p prefix  Prefix of the generated names (default: report)\n"
+		"  -o file    Write the header to file instead of stdout\n"
+		"  vid:pid    Open the first device with this Vendor ID and\n"
+		"             Product ID, in hexadecimal\n"
+		"  path       Open the device with this path, as returned by\n"
+		"             hid_enumerate()\n"
+		"  -d file    Read the raw report descriptor from file instead\n"
+		"             of a device, e.g. from the report_descriptor file\n"
+		"             of a hidraw device in sysfs\n",
+		argv0);
+}
+
+static int is_identifier(const char *s)
+{
+	if (!*s || (!isalpha((unsigned char) *s) && *s != '_'))
+		return 0;
+	for (; *s; s++) {
+		if (!isalnum((unsigned char) *s) && *s != '_')
+			return 0;
+	}
+	return 1;
+}
+
+/* Parse "vid:pid", with 1 to 4 hexadecimal digits each */
+static int parse_vid_pid(const char *s, unsigned short *vid, unsigned short *pid)
+{
+	unsigned long value[2];
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		const char *start = s;
+		while (isxdigit((unsigned char) *s))
+			s++;
+		if (s == start || s - start > 4)
+			return -1;
+		value[i] = strtoul(start, NULL, 16);
+		if (*s != (i == 0 ? ':' : '\0'))
+			return -1;
+		s++;
+	}
+
+	*vid = (unsigned short) value[0];
+	*pid = (unsigned short) value[1];
+	return 0;
+}
+
+static void upper(char *dst, const char *src, size_t size)
+{
+	size_t i;
+	for (i = 0; i + 1 < size && src[i]; i++)
+		dst[i] = (char) toupper((unsigned char) src[i]);
+	dst[i] = '\0';
+}
+
+/* Get the size in bytes of the report of a field, including the
+   report ID byte of numbered reports */
+static unsigned int get_report_size(const struct hid_report_field *fields, int num_fields, const struct hid_report_field *report)
+{
+	unsigned int bits = report->report_id ? 8 : 0;
+	int i;
+
+	for (i = 0; i < num_fields; i++) {
+		const struct hid_report_field *f = &fields[i];
+		unsigned int end;
+		if (f->report_type != report->report_type || f->report_id != report->report_id)
+			continue;
+		end = f->bit_offset + f->count * f->bit_size;
+		if (end > bits)
+			bits = end;
+	}
+
+	return (bits + 7) / 8;
+}
+
+/* Make the name of each field unique, by appending _2, _3, ... to the
+   names which are already taken */
+static void make_field_names(const char *prefix, const struct hid_report_field *fields, int num_fields, char (*names)[MAX_NAME])
+{
+	int i, j;
+
+	for (i = 0; i < num_fields; i++) {
+		const struct hid_report_field *f = &fields[i];
+		char base[MAX_NAME - 12];
+		int n = 1;
+
+		snprintf(base, sizeof(base), "%s_%s_%u_%04hx_%04hx", prefix,
+			report_type_names[f->report_type], f->report_id,
+			f->usage_page, f->usage);
+		snprintf(names[i], MAX_NAME, "%s", base);
+
+		for (j = 0; j < i; j++) {
+			if (strcmp(names[i], names[j]) == 0) {
+				snprintf(names[i], MAX_NAME, "%s_%d", base, ++n);
+				j = -1;
+			}
+		}
+	}
+}
+
+static void write_header_start(FILE *out, const char *prefix, const char *guard, const char *source)
+{
+	fprintf(out,
+		"/* Generated by hidapi-decodegen from the report descriptor of\n"
+		"   %s. Do not edit. */\n"
+		"\n"
+		"#ifndef %s\n"
+		"#define %s\n"
+		"\n"
+		"#include <stdint.h>\n"
+		"\n"
+		"/* Each accessor takes a report as returned by hid_read(), which\n"
+		"   must be at least <REPORT>_SIZE bytes long. */\n"
+		"\n"
+		"/* Extract size bits from bit of the report, little-endian */\n"
+		"static inline uint32_t %s_get_bits(const unsigned char *report, unsigned int bit, unsigned int size)\n"
+		"{\n"
+		"\tuint32_t value = 0;\n"
+		"\tunsigned int n = 0;\n"
+		"\twhile (n < size) {\n"
+		"\t\tunsigned int shift = bit %% 8;\n"
+		"\t\tunsigned int bits = 8 - shift;\n"
+		"\t\tif (bits > size - n)\n"
+		"\t\t\tbits = size - n;\n"
+		"\t\tvalue |= (uint32_t) ((report[bit / 8] >> shift) & ((1u << bits) - 1)) << n;\n"
+		"\t\tn += bits;\n"
+		"\t\tbit += bits;\n"
+		"\t}\n"
+		"\treturn value;\n"
+		"}\n"
+		"\n"
+		"/* Sign-extend a value of size bits */\n"
+		"static inline int32_t %s_sign_extend(uint32_t value, unsigned int size)\n"
+		"{\n"
+		"\tuint32_t sign = 1u << (size - 1);\n"
+		"\treturn (int32_t) ((value ^ sign) - sign);\n"
+		"}\n",
+		source, guard, guard, prefix, prefix);
+}
+
+static void write_report(FILE *out, const char *prefix, const struct hid_report_field *fields, int num_fields, const struct hid_report_field *report)
+{
+	char name[MAX_NAME];
+	char upper_name[MAX_NAME];
+
+	snprintf(name, sizeof(name), "%s_%s_%u", prefix,
+		report_type_names[report->report_type], report->report_id);
+	upper(upper_name, name, sizeof(upper_name));
+
+	fprintf(out,
+		"\n"
+		"/* %c%s report %u */\n"
+		"#define %s_REPORT_ID %u\n"
+		"#define %s_SIZE %u\n",
+		toupper((unsigned char) report_type_names[report->report_type][0]),
+		report_type_names[report->report_type] + 1, report->report_id,
+		upper_name, report->report_id,
+		upper_name, get_report_size(fields, num_fields, report));
+}
+
+/* Write the expression of the raw (unsigned) value of a field, with
+   byte for the offset in bytes of an aligned value, and bit for the
+   offset in bits otherwise */
+static void write_raw_value(FILE *out, const char *prefix, const struct hid_report_field *f, const char *byte, const char *bit)
+{
+	if (f->bit_offset % 8 == 0 && f->bit_size == 8) {
+		fprintf(out, "(uint32_t) report[%s]", byte);
+	}
+	else if (f->bit_offset % 8 == 0 && f->bit_size == 16) {
+		fprintf(out, "((uint32_t) report[%s] | (uint32_t) report[%s + 1] << 8)", byte, byte);
+	}
+	else if (f->bit_offset % 8 == 0 && f->bit_size == 32) {
+		fprintf(out,
+			"((uint32_t) report[%s] | (uint32_t) report[%s + 1] << 8 | "
+			"(uint32_t) report[%s + 2] << 16 | (uint32_t) report[%s + 3] << 24)",
+			byte, byte, byte, byte);
+	}
+	else {
+		fprintf(out, "%s_get_bits(report, %s, %u)", prefix, bit, f->bit_size);
+	}
+}
+
+static void write_field(FILE *out, const char *prefix, const struct hid_report_field *f, const char *name)
+{
+	char upper_name[MAX_NAME];
+	int is_signed = f->logical_minimum < 0;
+	const char *type = is_signed ? "int32_t" : "uint32_t";
+
+	upper(upper_name, name, sizeof(upper_name));
+
+	fprintf(out,
+		"\n"
+		"/* Usage Page 0x%04hx, Usage 0x%04hx, %s%s, %u value(s) of %u bits,\n"
+		"   Logical Minimum %d, Logical Maximum %d */\n"
+		"#define %s_BIT_OFFSET %u\n"
+		"#define %s_BIT_SIZE %u\n"
+		"#define %s_COUNT %u\n",
+		f->usage_page, f->usage,
+		(f->flags & 0x02) ? "Variable" : "Array",
+		(f->flags & 0x04) ? ", Relative" : "",
+		f->count, f->bit_size,
+		f->logical_minimum, f->logical_maximum,
+		upper_name, f->bit_offset,
+		upper_name, f->bit_size,
+		upper_name, f->count);
+
+	if (f->count == 1) {
+		char byte[32];
+		char bit[32];
+
+		snprintf(byte, sizeof(byte), "%u", f->bit_offset / 8);
+		snprintf(bit, sizeof(bit), "%u", f->bit_offset);
+		fprintf(out, "static inline %s %s(const unsigned char *report)\n{\n", type, name);
+		fprintf(out, "\tuint32_t value = ");
+		write_raw_value(out, prefix, f, byte, bit);
+		fprintf(out, ";\n");
+	}
+	else {
+		char byte[64];
+		char bit[64];
+
+		snprintf(byte, sizeof(byte), "%u + index * %u", f->bit_offset / 8, f->bit_size / 8);
+		snprintf(bit, sizeof(bit), "%u + index * %u", f->bit_offset, f->bit_size);
+		fprintf(out, "static inline %s %s(const unsigned char *report, unsigned int index)\n{\n", type, name);
+		fprintf(out, "\tuint32_t value = ");
+		write_raw_value(out, prefix, f, byte, bit);
+		fprintf(out, ";\n");
+	}
+
+	if (is_signed && f->bit_size < 32)
+		fprintf(out, "\treturn %s_sign_extend(value, %u);\n}\n", prefix, f->bit_size);
+	else if (is_signed)
+		fprintf(out, "\treturn (int32_t) value;\n}\n");
+	else
+		fprintf(out, "\treturn value;\n}\n");
+}
+
+static int write_header(FILE *out, const char *prefix, const struct hid_report_field *fields, int num_fields, const char *source)
+{
+	char (*names)[MAX_NAME];
+	char guard[MAX_NAME];
+	int i, j;
+
+	names = calloc(num_fields ? num_fields : 1, sizeof(*names));
+	if (!names) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	make_field_names(prefix, fields, num_fields, names);
+
+	upper(guard, prefix, sizeof(guard) - 9);
+	strcat(guard, "_DECODE_H");
+
+	write_header_start(out, prefix, guard, source);
+
+	for (i = 0; i < num_fields; i++) {
+		const struct hid_report_field *f = &fields[i];
+
+		/* Start each report with its constants, on its first field */
+		for (j = 0; j < i; j++) {
+			if (fields[j].report_type == f->report_type && fields[j].report_id == f->report_id)
+				break;
+		}
+		if (j == i)
+			write_report(out, prefix, fields, num_fields, f);
+	}
+
+	for (i = 0; i < num_fields; i++)
+		write_field(out, prefix, &fields[i], names[i]);
+
+	fprintf(out, "\n#endif /* %s */\n", guard);
+
+	free(names);
+	return 0;
+}
+
+static int write_device_header(FILE *out, const char *prefix, hid_device *dev)
+{
+	const struct hid_report_field *fields;
+	wchar_t manufacturer[128] = L"";
+	wchar_t product[128] = L"";
+	char source[512];
+	int num_fields;
+
+	num_fields = hid_get_report_fields(dev, &fields);
+	if (num_fields < 0) {
+		fprintf(stderr, "Unable to get the report fields: %ls\n", hid_error(dev));
+		return -1;
+	}
+
+	hid_get_manufacturer_string(dev, manufacturer, 128);
+	hid_get_product_string(dev, product, 128);
+	/* A string which can't be converted just leaves the comment empty */
+	if (snprintf(source, sizeof(source), "%ls %ls", manufacturer, product) < 0)
+		source[0] = '\0';
+
+	return write_header(out, prefix, fields, num_fields, source);
+}
+
+static int write_file_header(FILE *out, const char *prefix, const char *path)
+{
+	struct hid_report_field *fields;
+	unsigned char *descriptor;
+	FILE *in;
+	size_t size;
+	int num_fields;
+	int res;
+
+	in = fopen(path, "rb");
+	if (!in) {
+		perror(path);
+		return -1;
+	}
+
+	/* One byte more, to tell a file which is too large */
+	descriptor = malloc(MAX_DESCRIPTOR_SIZE + 1);
+	if (!descriptor) {
+		fprintf(stderr, "Out of memory\n");
+		fclose(in);
+		return -1;
+	}
+	size = fread(descriptor, 1, MAX_DESCRIPTOR_SIZE + 1, in);
+	res = ferror(in);
+	fclose(in);
+	if (res) {
+		perror(path);
+		free(descriptor);
+		return -1;
+	}
+	if (size > MAX_DESCRIPTOR_SIZE) {
+		fprintf(stderr, "%s: too large for a report descriptor\n", path);
+		free(descriptor);
+		return -1;
+	}
+
+	num_fields = hid_parse_report_descriptor(descriptor, size, &fields);
+	free(descriptor);
+	if (num_fields < 0) {
+		fprintf(stderr, "Unable to compile the report descriptor of %s\n", path);
+		return -1;
+	}
+
+	res = write_header(out, prefix, fields, num_fields, path);
+	hid_free_report_fields(fields);
+	return res;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *prefix = "report";
+	const char *output = NULL;
+	const char *device = NULL;
+	const char *descriptor = NULL;
+	unsigned short vid, pid;
+	hid_device *dev = NULL;
+	FILE *out = stdout;
+	int res;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+			prefix = argv[++i];
+		}
+		else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			output = argv[++i];
+		}
+		else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc && !descriptor) {
+			descriptor = argv[++i];
+		}
+		else if (argv[i][0] != '-' && !device) {
+			device = argv[i];
+		}
+		else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	/* Either a device or a descriptor file */
+	if (!device == !descriptor) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (!is_identifier(prefix) || strlen(prefix) > 32) {
+		fprintf(stderr, "Invalid prefix: %s\n", prefix);
+		return 1;
+	}
+
+	if (device) {
+		if (hid_init())
+			return 1;
+
+		if (parse_vid_pid(device, &vid, &pid) == 0)
+			dev = hid_open(vid, pid, NULL);
+		else
+			dev = hid_open_path(device);
+		if (!dev) {
+			fprintf(stderr, "Unable to open %s: %ls\n", device, hid_error(NULL));
+			hid_exit();
+			return 1;
+		}
+	}
+
+	if (output) {
+		out = fopen(output, "w");
+		if (!out) {
+			perror(output);
+			if (dev) {
+				hid_close(dev);
+				hid_exit();
+			}
+			return 1;
+		}
+	}
+
+	if (dev)
+		res = write_device_header(out, prefix, dev);
+	else
+		res = write_file_header(out, prefix, descriptor);
+
+	if (output && fclose(out) != 0) {
+		perror(output);
+		res = -1;
+	}
+
+	if (dev) {
+		hid_close(dev);
+		hid_exit();
+	}
+
+	return res ? 1 : 0;
+}
@@ -0,0 +1,1138 @@
+/*******************************************************
+ HIDAPI - Multi-Platform library for
+ communication with HID devices.
+
+ libusb/hidapi Team
+
+ Copyright 2022, All Rights Reserved.
+
+ At the discretion of the user of this library,
+ this software may be licensed under the terms of the
+ GNU General Public License v3, a BSD-Style license, or the
+ original HIDAPI license as outlined in the LICENSE.txt,
+ LICENSE-gpl3.txt, LICENSE-bsd.txt, and LICENSE-orig.txt
+ files located at the root of the source distribution.
+ These files may also be found in the public source
+ code repository located at:
+        https://github.com/libusb/hidapi .
+********************************************************/
+
+/* Code shared by the backends: the report descriptor compiler, the
+   decoding of the fields of reports, the matching of the filters of
+   hid_enumerate_ex(), and helpers of the backends.
+
+   This file is not compiled on its own: each <backend>/hid.c includes
+   it, so that a backend still builds from a single source file (see
+   BUILD.md). A backend defines, before including it:
+   - HID_REPORT_ENUM_HELPERS if it implements hid_enumerate_ex() by
+     filtering the records of hid_enumerate();
+   - HID_REPORT_POLL_HELPERS if it implements hid_poll() with poll();
+   - HID_REPORT_STATS_HELPERS if it implements hid_get_stats();
+   - HID_REPORT_INPUT_HELPERS if it also queues the Input reports
+     itself.
+   The last two sections use pthreads, clock_gettime() and the __atomic
+   builtins of GCC and Clang, as the libusb and hidraw backends do. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "hidapi.h"
+
+int HID_API_EXPORT_CALL hid_report_get_field(const struct hid_report_field *field, unsigned int index, const unsigned char *data, size_t length, int *value)
+{
+	uint64_t bit;
+	unsigned int n = 0;
+	unsigned int result = 0;
+
+	if (!field || !data || !value || index >= field->count ||
+	    field->bit_size == 0 || field->bit_size > 32)
+		return -1;
+
+	bit = field->bit_offset + (uint64_t) index * field->bit_size;
+	if (bit + field->bit_size > (uint64_t) length * 8)
+		return -1;
+
+	/* Values are little-endian, starting at the least significant bit */
+	while (n < field->bit_size) {
+		unsigned int shift = (unsigned int) (bit % 8);
+		unsigned int bits = 8 - shift;
+		if (bits > field->bit_size - n)
+			bits = field->bit_size - n;
+		result |= ((data[bit / 8] >> shift) & ((1u << bits) - 1)) << n;
+		n += bits;
+		bit += bits;
+	}
+
+	if (field->logical_minimum < 0 && field->bit_size < 32 &&
+	    (result & (1u << (field->bit_size - 1))))
+		result |= ~0u << field->bit_size;
+
+	*value = (int) result;
+	return 0;
+}
+
+/* Shapes of fields with a specialized decoding loop, see
+   hid_report_decode_batch() */
+enum field_shape {
+	FIELD_SHAPE_GENERIC,
+	FIELD_SHAPE_8,     /* Byte-aligned, 8 bits */
+	FIELD_SHAPE_16,    /* Byte-aligned, 16 bits */
+	FIELD_SHAPE_32,    /* Byte-aligned, 32 bits */
+	FIELD_SHAPE_SUBBYTE, /* 1, 2 or 4 bits, never crossing a byte */
+};
+
+static enum field_shape get_field_shape(const struct hid_report_field *field)
+{
+	if (field->bit_offset % 8 == 0) {
+		switch (field->bit_size) {
+		case 8: return FIELD_SHAPE_8;
+		case 16: return FIELD_SHAPE_16;
+		case 32: return FIELD_SHAPE_32;
+		}
+	}
+	if ((field->bit_size == 1 || field->bit_size == 2 || field->bit_size == 4) &&
+	    field->bit_offset % field->bit_size == 0)
+		return FIELD_SHAPE_SUBBYTE;
+	return FIELD_SHAPE_GENERIC;
+}
+
+/* Whether a report of a batch holds all the values of a field */
+static int report_has_field(const struct hid_report_field *field, uint64_t min_length, const unsigned char *report, size_t length)
+{
+	return length >= min_length && (!field->report_id || report[0] == field->report_id);
+}
+
+/* Decode a field for all the reports of a batch. The shape is chosen
+   once per field, and the loop over the reports is the innermost one:
+   it reads the same bytes of each report, stride bytes apart. Signed
+   values are sign-extended with (value ^ sign) - sign, where sign is 0
+   for unsigned fields. */
+static void decode_field_column(const struct hid_report_field *field, const unsigned char *data, size_t stride, const size_t *lengths, size_t num_reports, int *column)
+{
+	enum field_shape shape = get_field_shape(field);
+	uint64_t min_length = (field->bit_offset + (uint64_t) field->count * field->bit_size + 7) / 8;
+	size_t first = field->bit_offset / 8;
+	int is_signed = field->logical_minimum < 0;
+	unsigned int count = field->count;
+	unsigned int i;
+	size_t r;
+
+	switch (shape) {
+	case FIELD_SHAPE_8: {
+		unsigned int sign = is_signed? 0x80u: 0;
+		for (i = 0; i < count; i++) {
+			size_t at = first + i;
+			for (r = 0; r < num_reports; r++) {
+				const unsigned char *report = data + r * stride;
+				if (report_has_field(field, min_length, report, lengths[r]))
+					column[r * count + i] = (int) (report[at] ^ sign) - (int) sign;
+			}
+		}
+		break;
+	}
+	case FIELD_SHAPE_16: {
+		unsigned int sign = is_signed? 0x8000u: 0;
+		for (i = 0; i < count; i++) {
+			size_t at = first + 2 * i;
+			for (r = 0; r < num_reports; r++) {
+				const unsigned char *report = data + r * stride;
+				if (report_has_field(field, min_length, report, lengths[r]))
+					column[r * count + i] = (int) ((report[at] | (unsigned int) report[at + 1] << 8) ^ sign) - (int) sign;
+			}
+		}
+		break;
+	}
+	case FIELD_SHAPE_32:
+		for (i = 0; i < count; i++) {
+			size_t at = first + 4 * i;
+			for (r = 0; r < num_reports; r++) {
+				const unsigned char *report = data + r * stride;
+				if (report_has_field(field, min_length, report, lengths[r]))
+					column[r * count + i] = (int) ((unsigned int) report[at] |
+						(unsigned int) report[at + 1] << 8 |
+						(unsigned int) report[at + 2] << 16 |
+						(unsigned int) report[at + 3] << 24);
+			}
+		}
+		break;
+	case FIELD_SHAPE_SUBBYTE: {
+		unsigned int bits = field->bit_size;
+		unsigned int mask = (1u << bits) - 1;
+		unsigned int sign = is_signed? 1u << (bits - 1): 0;
+		for (i = 0; i < count; i++) {
+			unsigned int bit = field->bit_offset % 8 + i * bits;
+			size_t at = first + bit / 8;
+			unsigned int shift = bit % 8;
+			for (r = 0; r < num_reports; r++) {
+				const unsigned char *report = data + r * stride;
+				if (report_has_field(field, min_length, report, lengths[r]))
+					column[r * count + i] = (int) (((report[at] >> shift) & mask) ^ sign) - (int) sign;
+			}
+		}
+		break;
+	}
+	case FIELD_SHAPE_GENERIC:
+	default:
+		for (i = 0; i < count; i++) {
+			for (r = 0; r < num_reports; r++) {
+				const unsigned char *report = data + r * stride;
+				if (report_has_field(field, min_length, report, lengths[r]))
+					hid_report_get_field(field, i, report, lengths[r], &column[r * count + i]);
+			}
+		}
+		break;
+	}
+}
+
+int HID_API_EXPORT_CALL hid_report_decode_batch(const struct hid_report_field *fields, size_t num_fields, const unsigned char *data, size_t stride, const size_t *lengths, size_t num_reports, int **columns)
+{
+	size_t k;
+
+	if ((!fields && num_fields) || (!data && num_reports) || (!lengths && num_reports) || (!columns && num_fields))
+		return -1;
+
+	for (k = 0; k < num_fields; k++) {
+		if (!columns[k] || fields[k].count == 0)
+			continue;
+		if (fields[k].bit_size == 0 || fields[k].bit_size > 32)
+			return -1;
+		decode_field_column(&fields[k], data, stride, lengths, num_reports, columns[k]);
+	}
+
+	return 0;
+}
+
+/* Maximum number of usages kept for a main item. The elements past the
+   last usage get the last usage, as per the HID specification. */
+#define MAX_ITEM_USAGES 256
+
+/* Maximum depth of the Push/Pop stack of the global items */
+#define MAX_GLOBAL_STACK 8
+
+/* Limits past which a report descriptor is rejected, as the Linux
+   kernel does: the Report Count of a main item, and the length of a
+   report in bits. */
+#define MAX_REPORT_COUNT 12288
+#define MAX_REPORT_BITS (16384 * 8)
+
+/* Maximum number of fields of a report descriptor */
+#define MAX_REPORT_FIELDS 65536
+
+/* Global items of the report descriptor parser */
+struct report_globals {
+	uint32_t usage_page;
+	int32_t logical_minimum;
+	int32_t logical_maximum;
+	uint32_t logical_maximum_unsigned;
+	uint32_t report_size;
+	uint32_t report_count;
+	uint8_t report_id;
+};
+
+/* Local usages of the report descriptor parser: single usages have
+   usage_minimum[i] == usage_maximum[i]. Usages without their own
+   page get the Usage Page in effect at the main item. */
+struct report_usages {
+	uint32_t usage_minimum[MAX_ITEM_USAGES];
+	uint32_t usage_maximum[MAX_ITEM_USAGES];
+	uint8_t has_page[MAX_ITEM_USAGES];
+	int num_usages;
+	uint32_t pending_minimum;
+	int pending_minimum_set;
+	int pending_minimum_has_page;
+};
+
+static int32_t sign_extend(uint32_t value, int size)
+{
+	if (size == 1)
+		return (int8_t) value;
+	if (size == 2)
+		return (int16_t) value;
+	return (int32_t) value;
+}
+
+static void add_report_usage(struct report_usages *usages, uint32_t minimum, uint32_t maximum, int has_page)
+{
+	if (usages->num_usages == MAX_ITEM_USAGES)
+		return;
+	usages->usage_minimum[usages->num_usages] = minimum;
+	usages->usage_maximum[usages->num_usages] = maximum;
+	usages->has_page[usages->num_usages] = (uint8_t) has_page;
+	usages->num_usages++;
+}
+
+/* Usage (page in the upper 16 bits) of the next element of a main item.
+   item and offset hold the position in the usages, and start at 0. */
+static uint32_t next_report_usage(const struct report_usages *usages, uint32_t usage_page, int *item, uint32_t *offset)
+{
+	uint32_t usage = 0;
+	int has_page = 0;
+
+	if (*item < usages->num_usages) {
+		uint32_t minimum = usages->usage_minimum[*item];
+		uint32_t maximum = usages->usage_maximum[*item];
+
+		has_page = usages->has_page[*item];
+		usage = minimum + *offset;
+		if (maximum > minimum && *offset < maximum - minimum)
+			(*offset)++;
+		else {
+			(*item)++;
+			*offset = 0;
+		}
+	}
+	else if (usages->num_usages > 0) {
+		/* Past the last usage, the last one is repeated */
+		int last = usages->num_usages - 1;
+		uint32_t minimum = usages->usage_minimum[last];
+		uint32_t maximum = usages->usage_maximum[last];
+
+		has_page = usages->has_page[last];
+		usage = (maximum >= minimum)? maximum: minimum;
+	}
+
+	return has_page? usage: (usage_page << 16) | (usage & 0xffff);
+}
+
+static int append_report_field(struct hid_report_field **fields, int *num_fields, int *capacity, const struct hid_report_field *field)
+{
+	if (*num_fields == *capacity) {
+		int new_capacity = *capacity? *capacity * 2: 16;
+		struct hid_report_field *new_fields;
+
+		if (*capacity >= MAX_REPORT_FIELDS)
+			return -1;
+		new_fields = (struct hid_report_field*) realloc(*fields, new_capacity * sizeof(struct hid_report_field));
+		if (!new_fields)
+			return -1;
+		*fields = new_fields;
+		*capacity = new_capacity;
+	}
+	(*fields)[(*num_fields)++] = *field;
+	return 0;
+}
+
+/* Compile the report descriptor into a table of fields, see
+   hid_get_report_fields(). The table is returned in fields, and must be
+   freed with free(). Returns the number of fields, or -1 on error or if
+   the descriptor is past the limits above. */
+static int compile_report_descriptor(const uint8_t *desc, size_t size, struct hid_report_field **fields)
+{
+	struct report_globals globals, stack[MAX_GLOBAL_STACK];
+	struct report_usages *usages;
+	uint64_t *bit_offsets; /* Per report type and ID */
+	int depth = 0;
+	int uses_report_ids = 0;
+	int num_fields = 0, capacity = 0;
+	size_t pos = 0;
+
+	*fields = NULL;
+
+	usages = (struct report_usages*) calloc(1, sizeof(struct report_usages));
+	bit_offsets = (uint64_t*) calloc(3 * 256, sizeof(uint64_t));
+	if (!usages || !bit_offsets)
+		goto err;
+
+	memset(&globals, 0, sizeof(globals));
+
+	while (pos < size) {
+		uint8_t key = desc[pos];
+		uint32_t data = 0;
+		int data_len, i;
+
+		/* Long items are not used by any defined item */
+		if (key == 0xfe) {
+			if (pos + 1 >= size)
+				break;
+			pos += 3 + desc[pos + 1];
+			continue;
+		}
+
+		data_len = key & 0x3;
+		if (data_len == 3)
+			data_len = 4;
+		if (pos + 1 + data_len > size)
+			break;
+		for (i = 0; i < data_len; i++)
+			data |= (uint32_t) desc[pos + 1 + i] << (8 * i);
+		pos += 1 + data_len;
+
+		switch (key & 0xfc) {
+		/* Main items */
+		case 0x80: /* Input */
+		case 0x90: /* Output */
+		case 0xb0: { /* Feature */
+			hid_report_type type = (key & 0xfc) == 0x80? HID_API_REPORT_INPUT:
+				(key & 0xfc) == 0x90? HID_API_REPORT_OUTPUT: HID_API_REPORT_FEATURE;
+			uint64_t *bit_offset = &bit_offsets[type * 256 + globals.report_id];
+			struct hid_report_field field;
+			int item = 0;
+			uint32_t offset = 0;
+			uint32_t n;
+
+			if (globals.report_count > MAX_REPORT_COUNT)
+				goto err;
+			if (uses_report_ids && *bit_offset == 0)
+				*bit_offset = 8; /* The report ID byte */
+			if (*bit_offset + (uint64_t) globals.report_size * globals.report_count > MAX_REPORT_BITS)
+				goto err;
+
+			memset(&field, 0, sizeof(field));
+			field.report_type = type;
+			field.report_id = globals.report_id;
+			field.flags = data;
+			field.bit_size = globals.report_size;
+			field.logical_minimum = globals.logical_minimum;
+			/* A Logical Maximum which only fits unsigned is often
+			   encoded without its sign byte */
+			field.logical_maximum = (globals.logical_minimum >= 0 && globals.logical_maximum < globals.logical_minimum)?
+				(int32_t) globals.logical_maximum_unsigned: globals.logical_maximum;
+
+			/* No field for padding, nor for values we can't return */
+			if ((data & 0x1) || globals.report_size == 0 || globals.report_size > 32) {
+				/* Constant */
+			}
+			else if (data & 0x2) {
+				/* Variable: a field per element, or per run of
+				   elements with the same usage */
+				for (n = 0; n < globals.report_count; n++) {
+					uint32_t usage = next_report_usage(usages, globals.usage_page, &item, &offset);
+					struct hid_report_field *last = num_fields? &(*fields)[num_fields - 1]: NULL;
+
+					if (n > 0 && last && ((uint32_t) last->usage_page << 16 | last->usage) == usage) {
+						last->count++;
+						continue;
+					}
+					field.usage_page = (unsigned short) (usage >> 16);
+					field.usage = (unsigned short) usage;
+					field.bit_offset = (unsigned int) (*bit_offset + n * globals.report_size);
+					field.count = 1;
+					if (append_report_field(fields, &num_fields, &capacity, &field) < 0)
+						goto err;
+				}
+			}
+			else if (globals.report_count > 0) {
+				/* Array: the values are usages */
+				uint32_t usage = next_report_usage(usages, globals.usage_page, &item, &offset);
+
+				field.usage_page = (unsigned short) (usage >> 16);
+				field.usage = (unsigned short) usage;
+				field.bit_offset = (unsigned int) *bit_offset;
+				field.count = globals.report_count;
+				if (append_report_field(fields, &num_fields, &capacity, &field) < 0)
+					goto err;
+			}
+
+			*bit_offset += (uint64_t) globals.report_size * globals.report_count;
+			memset(usages, 0, sizeof(*usages));
+			break;
+		}
+		case 0xa0: /* Collection */
+		case 0xc0: /* End Collection */
+			memset(usages, 0, sizeof(*usages));
+			break;
+
+		/* Global items */
+		case 0x04: /* Usage Page */
+			globals.usage_page = data & 0xffff;
+			break;
+		case 0x14: /* Logical Minimum */
+			globals.logical_minimum = sign_extend(data, data_len);
+			break;
+		case 0x24: /* Logical Maximum */
+			globals.logical_maximum = sign_extend(data, data_len);
+			globals.logical_maximum_unsigned = data;
+			break;
+		case 0x74: /* Report Size */
+			globals.report_size = data;
+			break;
+		case 0x84: /* Report ID */
+			globals.report_id = (uint8_t) data;
+			uses_report_ids = 1;
+			break;
+		case 0x94: /* Report Count */
+			globals.report_count = data;
+			break;
+		case 0xa4: /* Push */
+			if (depth < MAX_GLOBAL_STACK)
+				stack[depth] = globals;
+			depth++;
+			break;
+		case 0xb4: /* Pop */
+			if (depth > 0 && --depth < MAX_GLOBAL_STACK)
+				globals = stack[depth];
+			break;
+
+		/* Local items */
+		case 0x08: /* Usage */
+			add_report_usage(usages, data, data, data_len == 4);
+			break;
+		case 0x18: /* Usage Minimum */
+			usages->pending_minimum = data;
+			usages->pending_minimum_set = 1;
+			usages->pending_minimum_has_page = (data_len == 4);
+			break;
+		case 0x28: /* Usage Maximum */
+			if (usages->pending_minimum_set) {
+				/* A page of the minimum applies to the range */
+				if (usages->pending_minimum_has_page && data_len < 4)
+					data |= usages->pending_minimum & 0xffff0000;
+				add_report_usage(usages, usages->pending_minimum, data, usages->pending_minimum_has_page);
+				usages->pending_minimum_set = 0;
+			}
+			break;
+
+		default:
+			/* Physical extents, units, designators, strings and
+			   delimiters don't change the layout */
+			break;
+		}
+	}
+
+	free(usages);
+	free(bit_offsets);
+	return num_fields;
+
+err:
+	free(usages);
+	free(bit_offsets);
+	free(*fields);
+	*fields = NULL;
+	return -1;
+}
+
+int HID_API_EXPORT_CALL hid_parse_report_descriptor(const unsigned char *descriptor, size_t size, struct hid_report_field **fields)
+{
+	if (!fields)
+		return -1;
+	*fields = NULL;
+	if (!descriptor && size)
+		return -1;
+
+	return compile_report_descriptor(descriptor, size, fields);
+}
+
+void HID_API_EXPORT_CALL hid_free_report_fields(struct hid_report_field *fields)
+{
+	free(fields);
+}
+
+/* Whether a serial number matches the filter (NULL to match any) */
+static int serial_number_matches(const wchar_t *serial_number, const struct hid_enum_filter *filter)
+{
+	if (!filter || !(filter->match & HID_API_MATCH_SERIAL_NUMBER))
+		return 1;
+	if (!serial_number || !filter->serial_number)
+		return serial_number == filter->serial_number;
+	return wcscmp(serial_number, filter->serial_number) == 0;
+}
+
+/* Whether a usage matches the filter (NULL to match any) */
+static int usage_matches(unsigned short usage_page, unsigned short usage, const struct hid_enum_filter *filter)
+{
+	if (!filter)
+		return 1;
+	if ((filter->match & HID_API_MATCH_USAGE_PAGE) && filter->usage_page != usage_page)
+		return 0;
+	if ((filter->match & HID_API_MATCH_USAGE) && filter->usage != usage)
+		return 0;
+	return 1;
+}
+
+/* Whether the record matches the filter (NULL to match any) */
+static int device_info_matches(const struct hid_device_info *info, const struct hid_enum_filter *filter)
+{
+	if (!filter)
+		return 1;
+	if ((filter->match & HID_API_MATCH_VENDOR_ID) && filter->vendor_id != info->vendor_id)
+		return 0;
+	if ((filter->match & HID_API_MATCH_PRODUCT_ID) && filter->product_id != info->product_id)
+		return 0;
+	if ((filter->match & HID_API_MATCH_INTERFACE_NUMBER) && filter->interface_number != info->interface_number)
+		return 0;
+	if ((filter->match & HID_API_MATCH_BUS_TYPE) && filter->bus_type != info->bus_type)
+		return 0;
+	return usage_matches(info->usage_page, info->usage, filter) &&
+		serial_number_matches(info->serial_number, filter);
+}
+
+#ifdef HID_REPORT_ENUM_HELPERS
+
+struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate_ex(const struct hid_enum_filter *filter)
+{
+	struct hid_device_info *root, **cur;
+	unsigned short vendor_id = 0, product_id = 0;
+
+	/* The VID/PID are matched by the enumeration itself, the other
+	   criteria once the records are created. */
+	if (filter && (filter->match & HID_API_MATCH_VENDOR_ID))
+		vendor_id = filter->vendor_id;
+	if (filter && (filter->match & HID_API_MATCH_PRODUCT_ID))
+		product_id = filter->product_id;
+
+	root = hid_enumerate(vendor_id, product_id);
+
+	cur = &root;
+	while (*cur) {
+		struct hid_device_info *dev = *cur;
+		if (device_info_matches(dev, filter)) {
+			cur = &dev->next;
+			continue;
+		}
+		*cur = dev->next;
+		dev->next = NULL;
+		hid_free_enumeration(dev);
+	}
+
+	return root;
+}
+
+#endif /* HID_REPORT_ENUM_HELPERS */
+
+#ifdef HID_REPORT_POLL_HELPERS
+
+#include <errno.h>
+#include <poll.h>
+
+/* Number of devices hid_poll() can wait on without allocating */
+#define HID_POLL_STACK_FDS 32
+
+/* Waits for any of the devices to have a report, see hid_poll(). Each
+   device has a file descriptor which is readable while a report can be
+   read from it (see hid_get_poll_fd()), so a single poll() waits on all
+   of them. On error, error is set to a message for the global error of
+   the backend, or to NULL if hid_get_poll_fd() failed, which sets the
+   error of its device. */
+static int poll_devices(hid_device **devs, int n, int *ready, int timeout_ms, const char **error)
+{
+	struct pollfd stack_fds[HID_POLL_STACK_FDS];
+	struct pollfd *fds = stack_fds;
+	int res, i;
+
+	*error = NULL;
+
+	if (!devs || !ready || n <= 0) {
+		errno = EINVAL;
+		*error = strerror(errno);
+		return -1;
+	}
+
+	if (n > HID_POLL_STACK_FDS) {
+		fds = (struct pollfd*) malloc(n * sizeof(struct pollfd));
+		if (!fds) {
+			*error = "Couldn't allocate memory";
+			return -1;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		fds[i].fd = hid_get_poll_fd(devs[i]);
+		fds[i].events = POLLIN;
+		fds[i].revents = 0;
+		if (fds[i].fd < 0) {
+			res = -1;
+			goto end;
+		}
+	}
+
+	res = poll(fds, n, timeout_ms);
+	if (res < 0) {
+		*error = strerror(errno);
+		goto end;
+	}
+
+	for (i = 0; i < n; i++)
+		ready[i] = fds[i].revents != 0;
+
+end:
+	if (fds != stack_fds)
+		free(fds);
+
+	return res;
+}
+
+#endif /* HID_REPORT_POLL_HELPERS */
+
+#ifdef HID_REPORT_STATS_HELPERS
+
+#include <time.h>
+
+/* Counters of hid_get_stats(). They are updated with relaxed atomic
+   operations by whichever thread sees the event, so that they cost
+   next to nothing, and read one at a time. They are 64 bits wide on
+   every platform, so that they don't wrap in a long session. */
+struct device_stats {
+	uint64_t input_reports;
+	uint64_t input_bytes;
+	uint64_t input_reports_dropped;
+	uint64_t input_queue_high_water;
+	uint64_t input_errors;
+	uint64_t output_reports;
+	uint64_t output_bytes;
+	uint64_t output_errors;
+	uint64_t read_latency[HID_API_STATS_BUCKETS];
+	uint64_t write_latency[HID_API_STATS_BUCKETS];
+	/* Counted by libusb only */
+	uint64_t input_idle_timeouts;
+	uint64_t input_stalls;
+	uint64_t input_overflows;
+};
+
+/* Returns the CLOCK_MONOTONIC time in nanoseconds. */
+static uint64_t monotonic_time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static void stats_add(uint64_t *counter, uint64_t n)
+{
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+/* Bucket of a latency in the histograms of struct hid_stats: bucket i
+   holds the latencies from 2^(i-1) up to 2^i microseconds, and the last
+   one all the longer ones. */
+static int get_latency_bucket(uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	int bucket = 0;
+
+	while (us > 0 && bucket < HID_API_STATS_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+/* Counts a latency into a histogram of struct device_stats */
+static void stats_add_latency(uint64_t *histogram, uint64_t ns)
+{
+	__atomic_fetch_add(&histogram[get_latency_bucket(ns)], 1, __ATOMIC_RELAXED);
+}
+
+/* Raises a high-water mark to count, if it is below. */
+static void stats_update_high_water(uint64_t *high_water, uint64_t count)
+{
+	uint64_t old = __atomic_load_n(high_water, __ATOMIC_RELAXED);
+
+	while (count > old &&
+	       !__atomic_compare_exchange_n(high_water, &old, count, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* Copies the counters into the struct hid_stats of hid_get_stats(),
+   except input_reports_suppressed, which the backends keep aside. */
+static void read_device_stats(struct device_stats *counters, struct hid_stats *stats)
+{
+	int i;
+
+	stats->input_reports = __atomic_load_n(&counters->input_reports, __ATOMIC_RELAXED);
+	stats->input_bytes = __atomic_load_n(&counters->input_bytes, __ATOMIC_RELAXED);
+	stats->input_reports_dropped = __atomic_load_n(&counters->input_reports_dropped, __ATOMIC_RELAXED);
+	stats->input_queue_high_water = __atomic_load_n(&counters->input_queue_high_water, __ATOMIC_RELAXED);
+	stats->input_errors = __atomic_load_n(&counters->input_errors, __ATOMIC_RELAXED);
+	stats->input_idle_timeouts = __atomic_load_n(&counters->input_idle_timeouts, __ATOMIC_RELAXED);
+	stats->input_stalls = __atomic_load_n(&counters->input_stalls, __ATOMIC_RELAXED);
+	stats->input_overflows = __atomic_load_n(&counters->input_overflows, __ATOMIC_RELAXED);
+	stats->output_reports = __atomic_load_n(&counters->output_reports, __ATOMIC_RELAXED);
+	stats->output_bytes = __atomic_load_n(&counters->output_bytes, __ATOMIC_RELAXED);
+	stats->output_errors = __atomic_load_n(&counters->output_errors, __ATOMIC_RELAXED);
+	for (i = 0; i < HID_API_STATS_BUCKETS; i++) {
+		stats->read_latency[i] = __atomic_load_n(&counters->read_latency[i], __ATOMIC_RELAXED);
+		stats->write_latency[i] = __atomic_load_n(&counters->write_latency[i], __ATOMIC_RELAXED);
+	}
+}
+
+#endif /* HID_REPORT_STATS_HELPERS */
+
+#ifdef HID_REPORT_INPUT_HELPERS
+
+#ifndef HID_REPORT_STATS_HELPERS
+#error "HID_REPORT_INPUT_HELPERS needs HID_REPORT_STATS_HELPERS"
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+
+/* Number of reports each queue of hid_read_report_id() holds */
+#define REPORT_ID_QUEUE_DEPTH 32
+
+/* Queue of the Input reports of a report ID, see hid_read_report_id().
+   It has a single writer, the thread which receives the reports of the
+   device, and any number of readers; the mutex protects all of it. */
+struct report_id_queue {
+	pthread_mutex_t mutex;
+	pthread_cond_t condition;
+	size_t size; /* Size of each slot of data */
+	unsigned char *data;
+	size_t lens[REPORT_ID_QUEUE_DEPTH];
+	uint64_t timestamps[REPORT_ID_QUEUE_DEPTH]; /* Arrival, in monotonic ns */
+	size_t head;
+	size_t count;
+	int shutdown; /* The device is gone */
+};
+
+/* Previous Input report of each report ID, which the next one is
+   compared with, see hid_set_input_change_filter(). The reports of an
+   ID have previous_sizes[id] bytes at previous + previous_offsets[id]. */
+struct input_filter {
+	size_t previous_sizes[256];
+	size_t previous_offsets[256];
+	size_t previous_lens[256]; /* 0 until a report arrives */
+	unsigned char *previous;
+	unsigned char *mask; /* As long as the largest report */
+};
+
+/* Gets the size in bytes of the Input report of each report ID from
+   the fields of the report descriptor, 0 for the IDs it does not
+   declare. Returns 1 if the device uses numbered reports. */
+static int get_input_report_sizes(const struct hid_report_field *fields, int num_fields, size_t *sizes)
+{
+	int numbered = 0;
+	int i;
+
+	memset(sizes, 0, 256 * sizeof(size_t));
+	for (i = 0; i < num_fields; i++) {
+		const struct hid_report_field *f = &fields[i];
+		size_t end = f->bit_offset + (size_t) f->count * f->bit_size;
+
+		if (f->report_id)
+			numbered = 1;
+		if (f->report_type == HID_API_REPORT_INPUT && end > sizes[f->report_id])
+			sizes[f->report_id] = end;
+	}
+	for (i = 0; i < 256; i++)
+		sizes[i] = (sizes[i] + 7) / 8;
+
+	return numbered;
+}
+
+/* Allocates the filter of hid_set_input_change_filter(). The mask is
+   padded with 0xff, so that the bytes past its end are compared. */
+static struct input_filter *alloc_input_filter(const size_t *sizes, const unsigned char *mask, size_t mask_length)
+{
+	struct input_filter *filter;
+	size_t max_size = 0;
+	size_t total = 0;
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		total += sizes[i];
+		if (sizes[i] > max_size)
+			max_size = sizes[i];
+	}
+
+	filter = (struct input_filter*) calloc(1, sizeof(struct input_filter) + max_size + total);
+	if (!filter)
+		return NULL;
+
+	filter->mask = (unsigned char*) (filter + 1);
+	filter->previous = filter->mask + max_size;
+
+	if (!mask)
+		mask_length = 0;
+	if (mask_length > max_size)
+		mask_length = max_size;
+	if (mask_length)
+		memcpy(filter->mask, mask, mask_length);
+	memset(filter->mask + mask_length, 0xff, max_size - mask_length);
+
+	total = 0;
+	for (i = 0; i < 256; i++) {
+		filter->previous_sizes[i] = sizes[i];
+		filter->previous_offsets[i] = total;
+		total += sizes[i];
+	}
+
+	return filter;
+}
+
+/* Returns 1 if a report is the same as the previous report of its
+   report ID under the mask of the filter. Otherwise, the report becomes
+   the previous one and 0 is returned. */
+static int filter_input_report(struct input_filter *filter, int numbered, const unsigned char *data, size_t len)
+{
+	unsigned char id;
+	unsigned char *previous;
+	size_t diff = 0;
+	size_t i;
+
+	if (len == 0)
+		return 0;
+
+	id = numbered ? data[0] : 0;
+	if (len > filter->previous_sizes[id])
+		return 0; /* Longer than declared, or not declared at all */
+
+	previous = filter->previous + filter->previous_offsets[id];
+	if (filter->previous_lens[id] == len) {
+		/* A word at a time and without an early exit, so that the
+		   compiler can also vectorize the loop */
+		for (i = 0; i + sizeof(size_t) <= len; i += sizeof(size_t)) {
+			size_t a, b, m;
+			memcpy(&a, data + i, sizeof(a));
+			memcpy(&b, previous + i, sizeof(b));
+			memcpy(&m, filter->mask + i, sizeof(m));
+			diff |= (a ^ b) & m;
+		}
+		for (; i < len; i++)
+			diff |= (size_t) ((data[i] ^ previous[i]) & filter->mask[i]);
+		if (!diff)
+			return 1;
+	}
+
+	memcpy(previous, data, len);
+	filter->previous_lens[id] = len;
+	return 0;
+}
+
+static void free_report_id_queues(struct report_id_queue **queues)
+{
+	int i;
+
+	if (!queues)
+		return;
+
+	for (i = 0; i < 256; i++) {
+		if (queues[i]) {
+			pthread_cond_destroy(&queues[i]->condition);
+			pthread_mutex_destroy(&queues[i]->mutex);
+			free(queues[i]);
+		}
+	}
+	free(queues);
+}
+
+/* Allocates the queues of hid_read_report_id(), one per report ID
+   with a size. */
+static struct report_id_queue **alloc_report_id_queues(const size_t *sizes)
+{
+	struct report_id_queue **queues;
+	int i;
+
+	queues = (struct report_id_queue**) calloc(256, sizeof(struct report_id_queue*));
+	if (!queues)
+		return NULL;
+
+	for (i = 0; i < 256; i++) {
+		struct report_id_queue *q;
+
+		if (sizes[i] == 0)
+			continue;
+
+		q = (struct report_id_queue*) calloc(1, sizeof(struct report_id_queue) + REPORT_ID_QUEUE_DEPTH * sizes[i]);
+		if (!q) {
+			free_report_id_queues(queues);
+			return NULL;
+		}
+		pthread_mutex_init(&q->mutex, NULL);
+		pthread_cond_init(&q->condition, NULL);
+		q->size = sizes[i];
+		q->data = (unsigned char*) (q + 1);
+		queues[i] = q;
+	}
+
+	return queues;
+}
+
+/* Appends a received report to the queue of its report ID, dropping
+   the oldest report if the queue is full. This is called only by the
+   thread which receives the reports of the device. */
+static void queue_report_id_report(struct report_id_queue **queues, int numbered, const unsigned char *data, size_t len, uint64_t timestamp, struct device_stats *stats)
+{
+	struct report_id_queue *q;
+	size_t slot;
+
+	if (len == 0)
+		return;
+
+	q = queues[numbered ? data[0] : 0];
+	if (!q)
+		return; /* Not declared by the report descriptor */
+	if (len > q->size)
+		len = q->size;
+
+	pthread_mutex_lock(&q->mutex);
+	if (q->count == REPORT_ID_QUEUE_DEPTH) {
+		q->head = (q->head + 1) % REPORT_ID_QUEUE_DEPTH;
+		q->count--;
+		stats_add(&stats->input_reports_dropped, 1);
+	}
+	slot = (q->head + q->count) % REPORT_ID_QUEUE_DEPTH;
+	memcpy(q->data + slot * q->size, data, len);
+	q->lens[slot] = len;
+	q->timestamps[slot] = timestamp;
+	q->count++;
+	stats_update_high_water(&stats->input_queue_high_water, q->count);
+	/* Each report can be for another reader of this report ID */
+	pthread_cond_signal(&q->condition);
+	pthread_mutex_unlock(&q->mutex);
+}
+
+/* Wakes up the readers of hid_read_report_id(), once the device is
+   gone. */
+static void shutdown_report_id_queues(struct report_id_queue **queues)
+{
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		if (queues[i]) {
+			pthread_mutex_lock(&queues[i]->mutex);
+			queues[i]->shutdown = 1;
+			pthread_cond_broadcast(&queues[i]->condition);
+			pthread_mutex_unlock(&queues[i]->mutex);
+		}
+	}
+}
+
+/* Takes the oldest report out of a queue of hid_read_report_id(),
+   waiting for one as long as milliseconds (-1 for ever). */
+static int read_report_id_queue(struct report_id_queue *q, unsigned char *data, size_t length, int milliseconds, struct device_stats *stats)
+{
+	int res = 0;
+
+	pthread_mutex_lock(&q->mutex);
+
+	if (milliseconds == -1) {
+		while (q->count == 0 && !q->shutdown)
+			pthread_cond_wait(&q->condition, &q->mutex);
+	}
+	else if (milliseconds > 0) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += milliseconds / 1000;
+		ts.tv_nsec += (milliseconds % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+
+		while (q->count == 0 && !q->shutdown) {
+			res = pthread_cond_timedwait(&q->condition, &q->mutex, &ts);
+			if (res != 0)
+				break; /* Timed out, or error */
+		}
+	}
+
+	if (q->count > 0) {
+		size_t len = q->lens[q->head];
+		if (len > length)
+			len = length;
+		memcpy(data, q->data + q->head * q->size, len);
+		stats_add_latency(stats->read_latency, monotonic_time_ns() - q->timestamps[q->head]);
+		q->head = (q->head + 1) % REPORT_ID_QUEUE_DEPTH;
+		q->count--;
+		res = (int) len;
+	}
+	else if (q->shutdown || (res != 0 && res != ETIMEDOUT)) {
+		res = -1;
+	}
+	else {
+		res = 0;
+	}
+
+	pthread_mutex_unlock(&q->mutex);
+	return res;
+}
+
+/* Latest Input report of a report ID, see hid_get_latest_report().
+   It is a seqlock with a single writer, the thread which receives the
+   reports of the device: the sequence is odd while the report is being
+   written, and readers retry until they see the same even sequence
+   before and after their copy. */
+struct latest_report {
+	size_t sequence;
+	size_t size; /* Size of data, 0 if the report ID is not declared */
+	size_t len;
+	unsigned char *data;
+};
+
+/* Allocates the slots of hid_get_latest_report(). */
+static int alloc_latest_reports(const size_t *sizes, struct latest_report **reports, unsigned char **buffer)
+{
+	size_t total = 0;
+	int i;
+
+	for (i = 0; i < 256; i++)
+		total += sizes[i];
+
+	*reports = (struct latest_report*) calloc(256, sizeof(struct latest_report));
+	*buffer = (unsigned char*) malloc(total ? total : 1);
+	if (!*reports || !*buffer) {
+		free(*reports);
+		free(*buffer);
+		return -1;
+	}
+
+	total = 0;
+	for (i = 0; i < 256; i++) {
+		(*reports)[i].size = sizes[i];
+		(*reports)[i].data = *buffer + total;
+		total += sizes[i];
+	}
+
+	return 0;
+}
+
+/* Overwrites the latest report of the report ID of a received report.
+   This is called only by the thread which receives the reports of the
+   device, the single writer. The copy races with the readers by
+   design, so it is made of atomic stores; the sequence tells the
+   readers to retry. */
+static void store_latest_report(struct latest_report *reports, int numbered, const unsigned char *data, size_t len)
+{
+	struct latest_report *rpt;
+	size_t sequence;
+	size_t i;
+
+	if (len == 0)
+		return;
+
+	rpt = &reports[numbered ? data[0] : 0];
+	if (rpt->size == 0)
+		return; /* Not declared by the report descriptor */
+	if (len > rpt->size)
+		len = rpt->size;
+
+	sequence = rpt->sequence; /* Only written by this thread */
+	/* The release stores keep the odd sequence ahead of the data */
+	__atomic_store_n(&rpt->sequence, sequence + 1, __ATOMIC_RELAXED);
+	for (i = 0; i < len; i++)
+		__atomic_store_n(&rpt->data[i], data[i], __ATOMIC_RELEASE);
+	__atomic_store_n(&rpt->len, len, __ATOMIC_RELEASE);
+	__atomic_store_n(&rpt->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+/* Copies a latest report out, retrying while it is being written. */
+static int read_latest_report(struct latest_report *rpt, unsigned char *data, size_t length, size_t *sequence)
+{
+	size_t before, after, len, i;
+
+	for (;;) {
+		before = __atomic_load_n(&rpt->sequence, __ATOMIC_ACQUIRE);
+		if (before & 1)
+			continue; /* A report is being written */
+
+		/* The acquire loads keep the copy ahead of the second
+		   read of the sequence */
+		len = __atomic_load_n(&rpt->len, __ATOMIC_ACQUIRE);
+		if (len > length)
+			len = length;
+		for (i = 0; i < len; i++)
+			data[i] = __atomic_load_n(&rpt->data[i], __ATOMIC_ACQUIRE);
+
+		after = __atomic_load_n(&rpt->sequence, __ATOMIC_RELAXED);
+		if (after == before)
+			break;
+	}
+
+	if (sequence)
+		*sequence = before / 2;
+	return (int) len;
+}
+
+#endif /* HID_REPORT_INPUT_HELPERS */
@@ -27,6 +27,7 @@
 #ifndef HIDAPI_H__
 #define HIDAPI_H__
 
+#include <stdint.h>
 #include <wchar.h>
 
 #ifdef _WIN32
@@ -100,6 +101,20 @@ extern "C" {
 		struct hid_device_;
 		typedef struct hid_device_ hid_device; /**< opaque hidapi structure */
 
+		/** Underlying bus of a HID device */
+		typedef enum {
+			/** Unknown bus type */
+			HID_API_BUS_UNKNOWN = 0x00,
+			/** USB bus */
+			HID_API_BUS_USB = 0x01,
+			/** Bluetooth or Bluetooth LE bus */
+			HID_API_BUS_BLUETOOTH = 0x02,
+			/** I2C bus */
+			HID_API_BUS_I2C = 0x03,
+			/** SPI bus */
+			HID_API_BUS_SPI = 0x04,
+		} hid_bus_type;
+
 		/** hidapi info structure */
 		struct hid_device_info {
 			/** Platform-specific device path */
@@ -135,6 +150,11 @@ extern "C" {
 
 			/** Pointer to the next device */
 			struct hid_device_info *next;
+
+			/** Underlying bus type (always HID_API_BUS_UNKNOWN on
+			    Windows). It follows next, so that the layout of the
+			    fields above doesn't change. */
+			hid_bus_type bus_type;
 		};
 
 
@@ -200,6 +220,139 @@ extern "C" {
 		*/
 		void  HID_API_EXPORT HID_API_CALL hid_free_enumeration(struct hid_device_info *devs);
 
+		/** Fields of struct #hid_enum_filter to match, see hid_enumerate_ex() */
+		enum hid_enum_filter_match {
+			HID_API_MATCH_VENDOR_ID = (1 << 0),
+			HID_API_MATCH_PRODUCT_ID = (1 << 1),
+			HID_API_MATCH_USAGE_PAGE = (1 << 2),
+			HID_API_MATCH_USAGE = (1 << 3),
+			HID_API_MATCH_INTERFACE_NUMBER = (1 << 4),
+			HID_API_MATCH_BUS_TYPE = (1 << 5),
+			HID_API_MATCH_SERIAL_NUMBER = (1 << 6),
+		};
+
+		/** Filter of hid_enumerate_ex(). The fields have the meaning
+		    of the ones of struct #hid_device_info. */
+		struct hid_enum_filter {
+			/** Bitwise OR of the #hid_enum_filter_match values of the
+			    fields to match. The other fields are ignored. */
+			unsigned int match;
+			unsigned short vendor_id;
+			unsigned short product_id;
+			unsigned short usage_page;
+			unsigned short usage;
+			int interface_number;
+			hid_bus_type bus_type;
+			const wchar_t *serial_number;
+		};
+
+		/** @brief Enumerate the HID Devices which match a filter.
+
+			Same as hid_enumerate(), with more criteria. Each criterion
+			is checked as soon as the information it needs is
+			available, so that the devices which don't match cost as
+			little as possible: on hidraw, the VID/PID, bus type and
+			serial number are checked before the report descriptor
+			is read, and the usage before the strings are; on libusb,
+			the interface number is checked before the device is
+			opened. A device is returned only if all the criteria
+			match.
+
+			On libusb the Usage Page and Usage are not known (they are
+			0), and on Windows the bus type isn't.
+
+			@ingroup API
+			@param filter The criteria to match, or NULL to return all
+				the HID devices.
+
+		    @returns
+		    	This function returns a pointer to a linked list of type
+		    	struct #hid_device_info, or NULL if no device matches or
+		    	in the case of failure. Free this linked list by calling
+		    	hid_free_enumeration().
+		*/
+		struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate_ex(const struct hid_enum_filter *filter);
+
+		/** Hotplug events, see hid_hotplug_register_callback() */
+		typedef enum {
+			/** A device has been plugged in */
+			HID_API_HOTPLUG_EVENT_DEVICE_ARRIVED = (1 << 0),
+			/** A device has been unplugged */
+			HID_API_HOTPLUG_EVENT_DEVICE_LEFT = (1 << 1),
+		} hid_hotplug_event;
+
+		/** Handle of a hotplug callback, see hid_hotplug_register_callback() */
+		typedef int hid_hotplug_callback_handle;
+
+		/** @brief Hotplug callback, see hid_hotplug_register_callback().
+
+			@ingroup API
+			@param callback_handle The handle of this callback.
+			@param device The device which arrived or left. It is
+				owned by the library and is only valid until the
+				callback returns; its next pointer is NULL.
+			@param event The event which occurred.
+			@param user_data The pointer given to
+				hid_hotplug_register_callback().
+
+			@returns
+				The callback returns 0 to stay registered, or any other
+				value to be deregistered.
+		*/
+		typedef int (HID_API_CALL *hid_hotplug_callback_fn)(hid_hotplug_callback_handle callback_handle, struct hid_device_info *device, hid_hotplug_event event, void *user_data);
+
+		/** @brief Be notified when HID devices are plugged in or
+			unplugged.
+
+			The callback is called once for each record hid_enumerate()
+			would return for the device, as soon as it is plugged in,
+			and with the same records when it is unplugged. Devices
+			which are already present when the callback is registered
+			are not reported as arrived. On libusb, these devices are
+			not opened either, so the records they are reported with
+			when unplugged have no strings.
+
+			The callback is called from a thread of the library, which
+			is started by the first registration and stopped by
+			hid_exit(). It may call the other functions of the library,
+			except hid_exit(); it can also deregister itself by
+			returning a nonzero value.
+
+			This function is supported on hidraw and libusb only.
+
+			@ingroup API
+			@param vendor_id The Vendor ID (VID) of the devices to be
+				notified of, or 0 for any.
+			@param product_id The Product ID (PID) of the devices to be
+				notified of, or 0 for any.
+			@param events The events to be notified of, a bitwise OR of
+				#hid_hotplug_event values.
+			@param callback The function to call.
+			@param user_data A pointer passed to @p callback.
+			@param callback_handle The handle of the callback on return,
+				or NULL.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_hotplug_register_callback(unsigned short vendor_id, unsigned short product_id, int events, hid_hotplug_callback_fn callback, void *user_data, hid_hotplug_callback_handle *callback_handle);
+
+		/** @brief Deregister a callback registered with
+			hid_hotplug_register_callback().
+
+			Once this function returns, the callback is no longer
+			running and won't be called again, unless this function is
+			called from a hotplug callback: the callbacks are then
+			only guaranteed not to be called again.
+
+			@ingroup API
+			@param callback_handle The handle of the callback.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_hotplug_deregister_callback(hid_hotplug_callback_handle callback_handle);
+
 		/** @brief Open a HID device using a Vendor ID (VID), Product ID
 			(PID) and optionally a serial number.
 
@@ -312,6 +465,446 @@ extern "C" {
 		*/
 		int  HID_API_EXPORT HID_API_CALL hid_read(hid_device *dev, unsigned char *data, size_t length);
 
+		/** @brief Read all the queued Input reports from a HID device
+			in one call.
+
+			Waits (at most once) like hid_read_timeout() for a report
+			to arrive, then returns all the reports which are available
+			at that time, up to @p max_reports, without waiting again.
+			Report i is stored at @p data + i * @p stride, and its
+			length at @p lengths[i]. Reports longer than @p stride are
+			truncated, like with hid_read().
+
+			This function sets the return value of hid_error().
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param data A buffer of @p max_reports * @p stride bytes
+				to put the read reports into.
+			@param stride The number of bytes reserved for each report.
+				For devices with multiple reports, make sure to reserve
+				an extra byte for the report number.
+			@param max_reports The maximum number of reports to read.
+			@param lengths An array of @p max_reports elements to put the
+				length of each read report into.
+			@param milliseconds timeout in milliseconds or -1 for blocking wait.
+
+			@returns
+				This function returns the number of reports read and
+				-1 on error. If no report was available to be read within
+				the timeout period, this function returns 0.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_read_batch(hid_device *dev, unsigned char *data, size_t stride, size_t max_reports, size_t *lengths, int milliseconds);
+
+		/** @brief Read an Input report from a HID device with timeout,
+			along with the time it was received.
+
+			Same as hid_read_timeout(), but also returns the time at
+			which the report arrived. It is taken as early as the
+			backend can: when the transfer completed on libusb and
+			macOS, and right after the report was read from the
+			operating system on hidraw and Windows.
+
+			This function sets the return value of hid_error().
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param data A buffer to put the read data into.
+			@param length The number of bytes to read. For devices with
+				multiple reports, make sure to read an extra byte for
+				the report number.
+			@param timestamp_ns Set to the arrival time of the report, in
+				nanoseconds, if a report was read. The clock is
+				CLOCK_MONOTONIC on Linux, mach_absolute_time() on macOS
+				and QueryPerformanceCounter() on Windows, so only the
+				differences between timestamps are meaningful.
+			@param milliseconds timeout in milliseconds or -1 for blocking wait.
+
+			@returns
+				This function returns the actual number of bytes read and
+				-1 on error. If no packet was available to be read within
+				the timeout period, this function returns 0.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_read_timestamped(hid_device *dev, unsigned char *data, size_t length, uint64_t *timestamp_ns, int milliseconds);
+
+		/** @brief Borrow the next Input report of a HID device, without
+			copying it into a buffer of the caller.
+
+			Waits like hid_read_timeout() for a report, and sets
+			@p data to point to the report inside storage owned by
+			the library. The report stays valid (and keeps its place
+			in the input queue, where the backend has one) until it
+			is handed back with hid_read_release(). Only one report
+			can be borrowed at a time: release it before reading
+			from the device again.
+
+			This function sets the return value of hid_error().
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param data Set to the address of the report on success.
+				The first byte is the Report number if the device
+				uses numbered reports.
+			@param length Set to the length of the report in bytes on
+				success.
+			@param milliseconds timeout in milliseconds or -1 for blocking wait.
+
+			@returns
+				This function returns 1 if a report was borrowed and
+				-1 on error. If no report was available to be read
+				within the timeout period, this function returns 0.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_read_acquire(hid_device *dev, const unsigned char **data, size_t *length, int milliseconds);
+
+		/** @brief Hand back an Input report borrowed with hid_read_acquire().
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param data The address returned by hid_read_acquire().
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_read_release(hid_device *dev, const unsigned char *data);
+
+		/** @brief Get a file descriptor which can be waited on for
+			Input reports of a HID device.
+
+			The file descriptor becomes readable (POLLIN) when an
+			Input report can be read from the device, so that it can
+			be added to a poll(), select() or epoll based event loop
+			instead of blocking in hid_read_timeout(). It also becomes
+			readable (or reports POLLERR/POLLHUP) when the device is
+			disconnected, after which the read functions return -1.
+
+			Only wait on the file descriptor for readability. Don't
+			read from it or close it, and don't use it after
+			hid_close(). On hidraw it is the device node itself; on
+			libusb and macOS it is owned by the device handle, and
+			stays readable as long as Input reports are queued.
+
+			This function is not supported on Windows.
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+
+			@returns
+				This function returns the file descriptor on success
+				and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_get_poll_fd(hid_device *dev);
+
+		/** @brief Wait for Input reports on several HID devices at once.
+
+			Like poll(), waits until at least one of the devices has
+			an Input report to read (or is disconnected), or until
+			the timeout expires. The reports are then read with any
+			of the read functions, which won't block for the devices
+			marked as ready.
+
+			On Windows at most 64 (MAXIMUM_WAIT_OBJECTS) devices can
+			be waited on at once.
+
+			@ingroup API
+			@param devs An array of @p n device handles returned from
+				hid_open().
+			@param n The number of devices in @p devs.
+			@param ready An array of @p n elements, set to nonzero for the
+				devices which are ready and to 0 for the others.
+			@param timeout_ms timeout in milliseconds or -1 for blocking wait.
+
+			@returns
+				This function returns the number of ready devices,
+				0 if the timeout expired and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_poll(hid_device **devs, int n, int *ready, int timeout_ms);
+
+		/** @brief Input report callback, see hid_set_input_callback().
+
+			@ingroup API
+			@param dev The device the report was read from.
+			@param data The report, including the report number as the
+				first byte for numbered reports. Only valid until the
+				callback returns.
+			@param length The length in bytes of the report.
+			@param user_data The pointer given to hid_set_input_callback().
+		*/
+		typedef void (HID_API_CALL *hid_input_callback)(hid_device *dev, const unsigned char *data, size_t length, void *user_data);
+
+		/** @brief Have Input reports delivered to a callback.
+
+			Once a callback is set, each Input report is handed to it
+			as soon as it is read from the device, instead of being
+			queued for the read functions: there is no copy into the
+			queue, nor a wake-up of a reading thread. Reports queued
+			before the callback was set can still be read.
+
+			The callback is called from an internal thread of the
+			library: the event thread of the device with libusb (see
+			hid_libusb_set_event_threads()), the run loop thread on
+			macOS, or a thread started for the device on hidraw. It
+			must return quickly, and must not call
+			hid_set_input_callback() or hid_close() for the same
+			device.
+
+			Once this function returns, the previous callback is no
+			longer running and won't be called again.
+
+			This function is not supported on Windows.
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param callback The function to call for each Input report,
+				or NULL to queue the reports again.
+			@param user_data A pointer passed to @p callback.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_input_callback(hid_device *dev, hid_input_callback callback, void *user_data);
+
+		/** @brief Keep only the latest Input report of each report ID.
+
+			In this mode, each Input report overwrites the previous
+			report with the same report ID, instead of being queued
+			for the read functions, and is read with
+			hid_get_latest_report(). A reader which is slower than
+			the device only misses the intermediate reports: there
+			are no dropped reports, nor a wake-up per report. If an
+			input callback is set (see hid_set_input_callback()), it
+			takes the reports instead.
+
+			The reports are stored by the thread which would call
+			the input callback. Their slots are sized from the report
+			descriptor when the mode is first enabled; a longer report
+			is truncated, and a report with an ID the descriptor
+			does not declare is dropped.
+
+			This function is not supported on macOS and Windows.
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param enable 1 to keep the latest reports, 0 to queue the
+				reports again.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_latest_report_mode(hid_device *dev, int enable);
+
+		/** @brief Get the latest Input report with a report ID.
+
+			The report is copied out as it was received, never as a
+			mix of two reports: if a new report arrives during the
+			copy, the copy is retried. This function does not block
+			otherwise, and can be called from any number of threads.
+
+			@ingroup API
+			@param dev A device handle returned from hid_open(), in the
+				mode set by hid_set_latest_report_mode().
+			@param report_id The report ID, or 0 if the device does not
+				use numbered reports.
+			@param data A buffer to put the report into, including the
+				report number as the first byte for numbered reports.
+			@param length The size of the buffer in bytes. A longer
+				report is truncated.
+			@param sequence The number of reports with this report ID
+				received since the mode was first enabled, on return.
+				It only changes when a new report arrives, so it tells
+				whether the report was already seen. May be NULL.
+
+			@returns
+				This function returns the number of bytes copied, 0 if
+				no report with this ID was received yet, and -1 on
+				error, including a report ID the device does not
+				declare.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_get_latest_report(hid_device *dev, unsigned char report_id, unsigned char *data, size_t length, size_t *sequence);
+
+		/** @brief Queue the Input reports of each report ID separately.
+
+			In this mode, each Input report is queued for
+			hid_read_report_id() in a queue of its report ID, instead
+			of being queued for the read functions, so that a thread
+			reading one report ID is only woken up by the reports
+			with this ID. Each queue holds 32 reports; the oldest
+			report is dropped when a new one arrives while it is
+			full. If an input callback is set (see
+			hid_set_input_callback()) or the latest report mode is
+			enabled (see hid_set_latest_report_mode()), they take
+			the reports instead.
+
+			The reports are queued by the thread which would call
+			the input callback. The queues are sized from the report
+			descriptor when the mode is first enabled; a longer report
+			is truncated, and a report with an ID the descriptor
+			does not declare is dropped.
+
+			This function is not supported on macOS and Windows.
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param enable 1 to queue the reports per report ID, 0 to
+				queue the reports for the read functions again.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_report_id_queues(hid_device *dev, int enable);
+
+		/** @brief Read an Input report with a report ID from its queue,
+			with timeout.
+
+			Several threads can read at once, each from its own
+			report ID or from the same one.
+
+			@ingroup API
+			@param dev A device handle returned from hid_open(), in the
+				mode set by hid_set_report_id_queues().
+			@param report_id The report ID, or 0 if the device does not
+				use numbered reports.
+			@param data A buffer to put the report into, including the
+				report number as the first byte for numbered reports.
+			@param length The size of the buffer in bytes. A longer
+				report is truncated.
+			@param milliseconds timeout in milliseconds or -1 for blocking wait.
+
+			@returns
+				This function returns the actual number of bytes read,
+				0 if no report was available before the timeout, and
+				-1 on error, including a report ID the device does not
+				declare, or a disconnected device once its queue is
+				empty.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_read_report_id(hid_device *dev, unsigned char report_id, unsigned char *data, size_t length, int milliseconds);
+
+		/** @brief Drop the Input reports which are the same as the
+			previous report with their report ID.
+
+			Many devices send the same report again at every polling
+			interval while nothing changes. With this filter, such a
+			report is dropped as soon as it is received: it is neither
+			queued nor handed to a callback, and wakes no reader up.
+			The number of dropped reports is returned by
+			hid_get_input_reports_suppressed().
+
+			A report is compared with the previous report which was
+			let through. If @p mask is given, only the bits set in
+			the mask are compared, so that a changing timestamp or
+			counter can be ignored; byte i of the report (the report
+			ID being byte 0 of numbered reports) is compared under
+			byte i of the mask, and the bytes past the end of the
+			mask in full. The same mask applies to all report IDs.
+
+			The previous reports are sized from the report descriptor;
+			a report which is longer than declared, or has an ID the
+			descriptor does not declare, is always let through.
+
+			This function is not supported on macOS and Windows.
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param enable 1 to drop the unchanged reports, 0 to let all
+				the reports through. Enabling the filter again
+				replaces the mask and forgets the previous reports.
+			@param mask The bits to compare, or NULL to compare the
+				reports in full.
+			@param mask_length The length in bytes of @p mask.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_set_input_change_filter(hid_device *dev, int enable, const unsigned char *mask, size_t mask_length);
+
+		/** @brief Get the number of Input reports dropped by the filter
+			of hid_set_input_change_filter().
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param suppressed The number of dropped reports since the
+				device was opened, on return.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_get_input_reports_suppressed(hid_device *dev, size_t *suppressed);
+
+		/** Number of buckets of the latency histograms of struct #hid_stats */
+#define HID_API_STATS_BUCKETS 24
+
+		/** @brief Statistics of a device, see hid_get_stats().
+
+			All the counters start at 0 when the device is opened.
+			Bucket 0 of a latency histogram counts the latencies
+			under 1 microsecond, bucket i (from 1) the latencies from
+			2^(i-1) up to 2^i microseconds, and the last bucket all
+			the latencies from 2^22 microseconds (about 4 seconds).
+
+			@ingroup API
+		*/
+		struct hid_stats {
+			/** Input reports received from the device, including
+			    the ones which were dropped or suppressed */
+			uint64_t input_reports;
+			/** Bytes of the Input reports received */
+			uint64_t input_bytes;
+			/** Input reports dropped because a queue was full */
+			uint64_t input_reports_dropped;
+			/** Input reports dropped by the filter of
+			    hid_set_input_change_filter() */
+			uint64_t input_reports_suppressed;
+			/** Largest number of reports held at once by an input
+			    queue */
+			uint64_t input_queue_high_water;
+			/** Failed reads of Input reports, other than the stalls
+			    and overflows counted below */
+			uint64_t input_errors;
+			/** Interrupt IN transfers which ended after the 5 s idle
+			    timeout of the read thread without a report, and were
+			    resubmitted (libusb only). This is normal while the
+			    device has nothing to send, not an error. */
+			uint64_t input_idle_timeouts;
+			/** Interrupt IN transfers which stalled (libusb only) */
+			uint64_t input_stalls;
+			/** Interrupt IN transfers which overflowed (libusb only) */
+			uint64_t input_overflows;
+			/** Output reports written */
+			uint64_t output_reports;
+			/** Bytes of the Output reports written */
+			uint64_t output_bytes;
+			/** Failed writes of Output reports */
+			uint64_t output_errors;
+			/** Histogram of the time from the arrival of an Input
+			    report to its read from a queue */
+			uint64_t read_latency[HID_API_STATS_BUCKETS];
+			/** Histogram of the time to write an Output report */
+			uint64_t write_latency[HID_API_STATS_BUCKETS];
+		};
+
+		/** @brief Get the statistics of a device.
+
+			The counters are updated with relaxed atomic operations as
+			the reports are received and written, so that they can be
+			left enabled; they are read one at a time, so a snapshot
+			taken while reports flow is not exactly consistent.
+
+			The read latency is measured for the reports read from
+			the input queue of the libusb backend, and from the queues
+			of hid_read_report_id() on both backends. hidraw gives no
+			arrival time for the reports read directly from the device
+			node, so these are not measured.
+
+			This function is not supported on macOS and Windows.
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param stats The statistics, on return.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_get_stats(hid_device *dev, struct hid_stats *stats);
+
 		/** @brief Set the device handle to be non-blocking.
 
 			In non-blocking mode calls to hid_read() will return
@@ -474,6 +1067,164 @@ extern "C" {
 		*/
 		int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index, wchar_t *string, size_t maxlen);
 
+		/** Type of a HID report */
+		typedef enum {
+			/** Input report */
+			HID_API_REPORT_INPUT = 0,
+			/** Output report */
+			HID_API_REPORT_OUTPUT = 1,
+			/** Feature report */
+			HID_API_REPORT_FEATURE = 2,
+		} hid_report_type;
+
+		/** @brief A field of the reports of a device, compiled from its
+			report descriptor.
+
+			A field holds @p count values of @p bit_size bits each, one
+			after the other from @p bit_offset. The elements of a
+			Variable main item (such as the X and Y axes, or each button)
+			are separate fields, except consecutive elements with the
+			same usage, which share one. An Array main item (such as the
+			keys of a keyboard) is a single field, with the usage
+			minimum as its usage. Constant (padding) items have no
+			field.
+
+			@ingroup API
+			@see hid_get_report_fields, hid_report_get_field
+		*/
+		struct hid_report_field {
+			/** Type of the report the field belongs to */
+			hid_report_type report_type;
+			/** Report ID of the report, 0 if the device does not use
+			    numbered reports */
+			unsigned char report_id;
+			/** Usage Page */
+			unsigned short usage_page;
+			/** Usage */
+			unsigned short usage;
+			/** Data bits of the main item (bit 1 set for Variable,
+			    bit 2 for Relative, see the HID specification) */
+			unsigned int flags;
+			/** Offset of the first value in bits, from the start of the
+			    report as returned by hid_read(): it includes the report
+			    ID byte of numbered reports. */
+			unsigned int bit_offset;
+			/** Size of each value in bits, from 1 to 32 */
+			unsigned int bit_size;
+			/** Number of values */
+			unsigned int count;
+			/** Logical Minimum. The values are signed if it is
+			    negative. */
+			int logical_minimum;
+			/** Logical Maximum */
+			int logical_maximum;
+		};
+
+		/** @brief Get the fields of the reports of a device.
+
+			The report descriptor of the device is compiled into a table
+			of fields once per hid_open(), on the first call; later
+			calls return the same table. The table is owned by the
+			device and is valid until hid_close().
+
+			A descriptor with a Report Count over 12288, or a report
+			longer than 16384 bytes, is rejected.
+
+			This function is not supported on Windows.
+
+			This function sets the return value of hid_error().
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param fields The table of fields, on return.
+
+			@returns
+				This function returns the number of fields on success
+				and -1 on error.
+		*/
+		int HID_API_EXPORT_CALL hid_get_report_fields(hid_device *dev, const struct hid_report_field **fields);
+
+		/** @brief Compile a report descriptor into a table of fields.
+
+			The same as hid_get_report_fields(), but for a report
+			descriptor given by the caller, e.g. read from a file. It
+			doesn't need a device, and is supported on all platforms.
+
+			@ingroup API
+			@param descriptor The report descriptor.
+			@param size The size of @p descriptor in bytes.
+			@param fields The table of fields, on return. Free it with
+				hid_free_report_fields().
+
+			@returns
+				This function returns the number of fields on success
+				and -1 on error.
+		*/
+		int HID_API_EXPORT_CALL hid_parse_report_descriptor(const unsigned char *descriptor, size_t size, struct hid_report_field **fields);
+
+		/** @brief Free a table of fields.
+
+			@ingroup API
+			@param fields A table returned by
+				hid_parse_report_descriptor(), or NULL.
+		*/
+		void HID_API_EXPORT_CALL hid_free_report_fields(struct hid_report_field *fields);
+
+		/** @brief Extract a value of a field from a report.
+
+			@ingroup API
+			@param field A field returned by hid_get_report_fields().
+			@param index The index of the value in the field, from 0 to
+				@p field->count - 1.
+			@param data The report, as returned by hid_read(). For
+				a report of hid_get_feature_report() from a device
+				which does not use numbered reports, pass the data
+				after the first (0) byte.
+			@param length The length in bytes of the report.
+			@param value The value, sign-extended if the Logical Minimum
+				of the field is negative, on return.
+
+			@returns
+				This function returns 0 on success and -1 if @p index
+				is out of range or the report is too short.
+		*/
+		int HID_API_EXPORT_CALL hid_report_get_field(const struct hid_report_field *field, unsigned int index, const unsigned char *data, size_t length, int *value);
+
+		/** @brief Decode the values of fields from a batch of reports.
+
+			The reports are laid out as hid_read_batch() returns them:
+			report i is at @p data + i * @p stride, and is
+			@p lengths[i] bytes long. The values of each field are
+			written to an array of their own: value j of field k in
+			report i is stored at @p columns[k][i * fields[k].count + j].
+
+			The values are the same as hid_report_get_field() would
+			return, but each field is decoded for all the reports in
+			one pass, with loops specialized for byte-aligned fields of
+			8, 16 and 32 bits and for fields of 1, 2 and 4 bits which
+			don't cross a byte boundary.
+
+			A report which is too short for a field, or which has
+			another Report ID than the field, leaves the values of the
+			field for that report unchanged.
+
+			@ingroup API
+			@param fields Fields returned by hid_get_report_fields().
+			@param num_fields The number of fields in @p fields.
+			@param data The reports.
+			@param stride The number of bytes between the start of two
+				consecutive reports.
+			@param lengths The length in bytes of each report.
+			@param num_reports The number of reports.
+			@param columns An array of @p num_fields arrays, where
+				@p columns[k] has room for @p num_reports *
+				@p fields[k].count values, or is NULL to skip field k.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT_CALL hid_report_decode_batch(const struct hid_report_field *fields, size_t num_fields, const unsigned char *data, size_t stride, const size_t *lengths, size_t num_reports, int **columns);
+
 		/** @brief Get a string describing the last error which occurred.
 
 			Whether a function sets the last error is noted in its
@@ -29,6 +29,7 @@
 #include <ctype.h>
 #include <locale.h>
 #include <errno.h>
+#include <limits.h>
 
 /* Unix */
 #include <unistd.h>
@@ -37,8 +38,13 @@
 #include <sys/ioctl.h>
 #include <sys/utsname.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 #include <wchar.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 /* GNU / LibUSB */
 #include <libusb.h>
@@ -51,71 +57,16 @@
 
 #include "hidapi_libusb.h"
 
-#if defined(__ANDROID__) && __ANDROID_API__ < __ANDROID_API_N__
-
-/* Barrier implementation because Android/Bionic don't have pthread_barrier.
-   This implementation came from Brent Priddy and was posted on
-   StackOverflow. It is used with his permission. */
-typedef int pthread_barrierattr_t;
-typedef struct pthread_barrier {
-    pthread_mutex_t mutex;
-    pthread_cond_t cond;
-    int count;
-    int trip_count;
-} pthread_barrier_t;
-
-static int pthread_barrier_init(pthread_barrier_t *barrier, const pthread_barrierattr_t *attr, unsigned int count)
-{
-	if(count == 0) {
-		errno = EINVAL;
-		return -1;
-	}
-
-	if(pthread_mutex_init(&barrier->mutex, 0) < 0) {
-		return -1;
-	}
-	if(pthread_cond_init(&barrier->cond, 0) < 0) {
-		pthread_mutex_destroy(&barrier->mutex);
-		return -1;
-	}
-	barrier->trip_count = count;
-	barrier->count = 0;
-
-	return 0;
-}
-
-static int pthread_barrier_destroy(pthread_barrier_t *barrier)
-{
-	pthread_cond_destroy(&barrier->cond);
-	pthread_mutex_destroy(&barrier->mutex);
-	return 0;
-}
-
-static int pthread_barrier_wait(pthread_barrier_t *barrier)
-{
-	pthread_mutex_lock(&barrier->mutex);
-	++(barrier->count);
-	if(barrier->count >= barrier->trip_count)
-	{
-		barrier->count = 0;
-		pthread_cond_broadcast(&barrier->cond);
-		pthread_mutex_unlock(&barrier->mutex);
-		return 1;
-	}
-	else
-	{
-		pthread_cond_wait(&barrier->cond, &(barrier->mutex));
-		pthread_mutex_unlock(&barrier->mutex);
-		return 0;
-	}
-}
-
-#endif
-
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* hid_poll(), Input report and statistics helpers of hid_report.c */
+#define HID_REPORT_POLL_HELPERS
+#define HID_REPORT_INPUT_HELPERS
+#define HID_REPORT_STATS_HELPERS
+#include "hid_report.c"
+
 #ifdef DEBUG_PRINTF
 #define LOG(...) fprintf(stderr, __VA_ARGS__)
 #else
@@ -134,14 +85,110 @@ libusb HIDAPI programs are encouraged to use the interface number
 instead to differentiate between interfaces on a composite HID device. */
 /*#define INVASIVE_GET_USAGE*/
 
-/* Linked List of input reports received from the device. */
+/* libusb_interrupt_event_handler() is available since libusb 1.0.21.
+   Without it, event_thread() wakes up periodically instead, so that it
+   notices a shutdown request even if no transfer is pending. */
+#if LIBUSB_API_VERSION >= 0x01000105
+#define HAVE_LIBUSB_INTERRUPT_EVENT_HANDLER
+#endif
+
+/* libusb_hotplug_register_callback() is available since libusb 1.0.16 */
+#if LIBUSB_API_VERSION >= 0x01000102
+#define HAVE_LIBUSB_HOTPLUG
+#endif
+
+/* The fd returned by hid_get_poll_fd() is an eventfd where available,
+   and the read end of a pipe otherwise. */
+#ifdef __linux__
+#define HAVE_EVENTFD
+#endif
+
+/* Default number of slots in the ring of input reports. When the ring
+   is full the oldest report is dropped (unless another policy is set
+   with hid_libusb_set_input_queue_policy()), so we don't grow forever
+   if the user never reads anything from the device. */
+#define INPUT_REPORT_RING_SIZE 32
+
+/* Slot in the ring of input reports received from the device. The data
+   points into hid_device::input_report_buffer and holds up to
+   input_ep_max_packet_size bytes. */
 struct input_report {
 	uint8_t *data;
 	size_t len;
-	struct input_report *next;
+	uint64_t timestamp; /* CLOCK_MONOTONIC, in nanoseconds */
+};
+
+/* Maximum number of interrupt IN transfers which may be kept
+   submitted for a device, see hid_libusb_set_input_transfers(). */
+#define MAX_INPUT_TRANSFERS 16
+
+/* Interrupt IN transfer of a device. The transfers of a device are
+   always submitted in the same round-robin order, and their reports
+   are handed over to the input ring in that order too. */
+struct input_transfer {
+	hid_device *dev;
+	struct libusb_transfer *transfer;
+	/* Completed, but not handed over yet, because an earlier
+	   transfer of the same device is still pending. */
+	int completed;
+	/* When the transfer completed, see hid_read_timestamped() */
+	uint64_t timestamp;
+};
+
+/* Number of output reports which can be in flight at once for a
+   device, see hid_libusb_write_async(). */
+#define OUTPUT_TRANSFER_POOL_SIZE 16
+
+/* Interrupt OUT (or control) transfer of hid_libusb_write_async().
+   The buffer is kept (and only grown) between reports. */
+struct output_transfer {
+	hid_device *dev;
+	struct libusb_transfer *transfer;
+	uint8_t *buffer;
+	size_t buffer_size;
+	int skipped_report_id;
+	hid_libusb_write_callback callback;
+	void *user_data;
+	/* When the transfer was submitted, in monotonic ns */
+	uint64_t submitted;
+	/* Next free transfer, when this one is free */
+	struct output_transfer *next;
+};
+
+/* Maximum number of event threads, see hid_libusb_set_event_threads(). */
+#define MAX_EVENT_THREADS 64
+
+/* Longest wait of an event thread between two attempts to handle
+   the events, after fatal libusb errors */
+#define EVENT_THREAD_MAX_BACKOFF_MS 100
+
+/* Largest report descriptor read (HID_MAX_DESCRIPTOR_SIZE in Linux) */
+#define MAX_REPORT_DESCRIPTOR_SIZE 4096
+
+/* Thread handling the libusb events (and so running read_callback())
+   for a shard of the open devices. Each one has a libusb context of
+   its own, so the threads never contend for the same event lock. */
+struct event_worker {
+	libusb_context *context;
+	pthread_t thread;
+	int running;
+	int shutdown;
+
+	/* Number of open devices handled by this thread */
+	int num_devices;
 };
 
 
+/* USB device strings already fetched, indexed by string index, and the
+   language they are fetched in. A string which could not be fetched is
+   tried again next time. */
+struct usb_string_cache {
+	pthread_mutex_t mutex;
+	int has_lang;
+	uint16_t lang;
+	wchar_t *strings[256];
+};
+
 struct hid_device_ {
 	/* Handle to the actual device. */
 	libusb_device_handle *device_handle;
@@ -159,20 +206,102 @@ struct hid_device_ {
 	int product_index;
 	int serial_index;
 
+	/* Strings read by hid_get_indexed_string() and friends */
+	struct usb_string_cache strings;
+
+	/* See hid_get_report_fields(). Compiled from the report descriptor
+	   on first use; num_report_fields is -1 until then. */
+	struct hid_report_field *report_fields;
+	int num_report_fields;
+
 	/* Whether blocking reads are used */
 	int blocking; /* boolean */
 
-	/* Read thread objects */
-	pthread_t thread;
-	pthread_mutex_t mutex; /* Protects input_reports */
+	/* Event thread which runs the transfer callbacks of this device */
+	struct event_worker *worker;
+
+	/* Read objects */
+	pthread_mutex_t mutex; /* Serializes readers of input_reports */
 	pthread_cond_t condition;
-	pthread_barrier_t barrier; /* Ensures correct startup sequence */
-	int shutdown_thread;
+	int shutdown_transfers;
 	int transfer_loop_finished;
-	struct libusb_transfer *transfer;
 
-	/* List of received input reports. */
+	/* Interrupt IN transfers. The transfers from next_transfer_to_deliver
+	   up to next_transfer_to_submit (in round-robin order) are submitted
+	   or completed, the remaining transfers_idle ones wait to be
+	   submitted. The transfer_mutex protects the counters below. */
+	pthread_mutex_t transfer_mutex;
+	struct input_transfer *transfers;
+	int num_transfers;
+	int transfers_in_flight;
+	int transfers_idle;
+	int next_transfer_to_submit;
+	int next_transfer_to_deliver;
+
+	/* See hid_set_input_callback(). Called by read_callback() in
+	   place of queue_input_report(), with the transfer_mutex held. */
+	hid_input_callback input_callback;
+	void *input_callback_data;
+
+	/* See hid_set_latest_report_mode() and hid_set_report_id_queues().
+	   The 256 latest_reports and report_id_queues (one per report ID)
+	   are allocated when their mode is first enabled, and kept until
+	   hid_close(). The modes and uses_numbered_reports are protected
+	   by the transfer_mutex. */
+	struct latest_report *latest_reports;
+	unsigned char *latest_report_buffer;
+	struct report_id_queue **report_id_queues;
+	int uses_numbered_reports;
+	int latest_report_mode;
+	int report_id_mode;
+
+	/* See hid_set_input_change_filter(). NULL unless enabled; used by
+	   read_callback() with the transfer_mutex held. */
+	struct input_filter *input_filter;
+	size_t input_reports_suppressed;
+
+	/* Transfers of hid_libusb_write_async(), allocated on first use.
+	   The output_mutex protects the fields below. */
+	pthread_mutex_t output_mutex;
+	pthread_cond_t output_condition;
+	struct output_transfer *output_transfers;
+	struct output_transfer *free_output_transfers;
+	int output_transfers_in_flight;
+
+	/* Ring of received input reports. It has a single producer,
+	   read_callback(), which is the only one to advance input_tail,
+	   and a single consumer, hid_read_timeout(), which advances
+	   input_head with the mutex held. Both indexes only ever grow;
+	   the slot is the index modulo input_ring_size. */
 	struct input_report *input_reports;
+	uint8_t *input_report_buffer;
+	size_t input_ring_size;
+	size_t input_head;
+	size_t input_tail;
+
+	/* What read_callback() does when the ring is full,
+	   see hid_libusb_set_input_queue_policy(). */
+	enum hid_libusb_input_queue_policy input_queue_policy;
+
+	/* Set (with the mutex held) by hid_libusb_set_input_queue_policy()
+	   while it replaces the ring. read_callback() sets input_ring_busy
+	   while it writes into the ring without holding the mutex. */
+	int input_ring_resizing;
+	int input_ring_busy;
+
+	/* Data of the head slot of the ring while it is lent to the
+	   application by hid_read_acquire(), NULL otherwise. The slot is
+	   not released to read_callback() until hid_read_release(). */
+	const uint8_t *input_report_lent;
+
+	/* See hid_get_poll_fd(). Both are -1 until it is first called;
+	   with an eventfd they are the same fd. Protected by the mutex. */
+	int poll_fd;
+	int poll_fd_write;
+	int poll_fd_signaled;
+
+	/* See hid_get_stats() */
+	struct device_stats stats;
 
 	/* Was kernel driver detached by libusb */
 #ifdef DETACH_KERNEL_DRIVER
@@ -188,28 +317,85 @@ static struct hid_api_version api_version = {
 
 static libusb_context *usb_context = NULL;
 
+/* Event threads, started on demand when devices are opened and
+   stopped by hid_exit(). event_workers_mutex protects the array. */
+static struct event_worker event_workers[MAX_EVENT_THREADS];
+static pthread_mutex_t event_workers_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Number of event threads the devices opened afterwards are
+   spread across, see hid_libusb_set_event_threads(). */
+static int num_event_threads = 1;
+
+/* Number of interrupt IN transfers kept submitted for each device
+   opened afterwards, see hid_libusb_set_input_transfers(). */
+static int num_input_transfers = 1;
+
+/* Whether the enumeration fetches the string descriptors of the
+   devices, see hid_libusb_set_enumerate_strings(). */
+static int enumerate_strings = 1;
+
 uint16_t get_usb_code_for_current_locale(void);
-static int return_data(hid_device *dev, unsigned char *data, size_t length);
+
+static void init_usb_string_cache(struct usb_string_cache *cache);
+static void free_usb_string_cache(struct usb_string_cache *cache);
 
 static hid_device *new_hid_device(void)
 {
 	hid_device *dev = (hid_device*) calloc(1, sizeof(hid_device));
 	dev->blocking = 1;
+	dev->poll_fd = -1;
+	dev->poll_fd_write = -1;
+	dev->num_report_fields = -1;
 
 	pthread_mutex_init(&dev->mutex, NULL);
+	pthread_mutex_init(&dev->transfer_mutex, NULL);
+	pthread_mutex_init(&dev->output_mutex, NULL);
 	pthread_cond_init(&dev->condition, NULL);
-	pthread_barrier_init(&dev->barrier, NULL, 2);
+	pthread_cond_init(&dev->output_condition, NULL);
+
+	init_usb_string_cache(&dev->strings);
 
 	return dev;
 }
 
+static void free_input_transfers(hid_device *dev);
+static void free_output_transfers(hid_device *dev);
+static void release_event_worker(struct event_worker *worker);
+
 static void free_hid_device(hid_device *dev)
 {
 	/* Clean up the thread objects */
-	pthread_barrier_destroy(&dev->barrier);
+	pthread_cond_destroy(&dev->output_condition);
 	pthread_cond_destroy(&dev->condition);
+	pthread_mutex_destroy(&dev->output_mutex);
+	pthread_mutex_destroy(&dev->transfer_mutex);
 	pthread_mutex_destroy(&dev->mutex);
 
+	/* Free the transfer objects */
+	free_input_transfers(dev);
+	free_output_transfers(dev);
+
+	/* Free the input report ring */
+	free(dev->input_reports);
+	free(dev->input_report_buffer);
+
+	free_usb_string_cache(&dev->strings);
+	free(dev->report_fields);
+	free(dev->latest_reports);
+	free(dev->latest_report_buffer);
+	free_report_id_queues(dev->report_id_queues);
+	free(dev->input_filter);
+
+	/* Close the fd of hid_get_poll_fd() */
+	if (dev->poll_fd_write >= 0 && dev->poll_fd_write != dev->poll_fd)
+		close(dev->poll_fd_write);
+	if (dev->poll_fd >= 0)
+		close(dev->poll_fd);
+
+	/* Give the device's slot on its event thread back */
+	if (dev->worker)
+		release_event_worker(dev->worker);
+
 	/* Free the device itself */
 	free(dev);
 }
@@ -346,28 +532,13 @@ static inline int libusb_get_string_descriptor(libusb_device_handle *dev,
 #endif
 
 
-/* Get the first language the device says it reports. This comes from
-   USB string #0. */
-static uint16_t get_first_language(libusb_device_handle *dev)
-{
-	uint16_t buf[32];
-	int len;
-
-	/* Get the string from libusb. */
-	len = libusb_get_string_descriptor(dev,
-			0x0, /* String ID */
-			0x0, /* Language */
-			(unsigned char*)buf,
-			sizeof(buf));
-	if (len < 4)
-		return 0x0;
-
-	return buf[1]; /* First two bytes are len and descriptor type. */
-}
-
-static int is_language_supported(libusb_device_handle *dev, uint16_t lang)
+/* Get the language to fetch the strings of the device in: the one of
+   the current locale if the device supports it, or else the first one
+   it reports. The languages come from USB string #0. */
+static uint16_t get_usb_string_language(libusb_device_handle *dev)
 {
 	uint16_t buf[32];
+	uint16_t lang;
 	int len;
 	int i;
 
@@ -380,22 +551,39 @@ static int is_language_supported(libusb_device_handle *dev, uint16_t lang)
 	if (len < 4)
 		return 0x0;
 
+	lang = get_usb_code_for_current_locale();
 
 	len /= 2; /* language IDs are two-bytes each. */
 	/* Start at index 1 because there are two bytes of protocol data. */
 	for (i = 1; i < len; i++) {
 		if (buf[i] == lang)
-			return 1;
+			return lang;
 	}
 
-	return 0;
+	return buf[1]; /* First two bytes are len and descriptor type. */
 }
 
+#if !defined(__ANDROID__) && !defined(NO_ICONV)
+/* Conversion descriptor from UTF-16LE to wchar_t, opened on first use
+   and closed by hid_exit(). The mutex serializes its use. */
+static iconv_t usb_string_ic = (iconv_t)-1;
+static pthread_mutex_t usb_string_ic_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void close_usb_string_ic(void)
+{
+	pthread_mutex_lock(&usb_string_ic_mutex);
+	if (usb_string_ic != (iconv_t)-1) {
+		iconv_close(usb_string_ic);
+		usb_string_ic = (iconv_t)-1;
+	}
+	pthread_mutex_unlock(&usb_string_ic_mutex);
+}
+#endif
 
 /* This function returns a newly allocated wide string containing the USB
-   device string numbered by the index. The returned string must be freed
-   by using free(). */
-static wchar_t *get_usb_string(libusb_device_handle *dev, uint8_t idx)
+   device string numbered by the index, in the language lang. The returned
+   string must be freed by using free(). */
+static wchar_t *get_usb_string(libusb_device_handle *dev, uint16_t lang, uint8_t idx)
 {
 	char buf[512];
 	int len;
@@ -404,7 +592,6 @@ static wchar_t *get_usb_string(libusb_device_handle *dev, uint8_t idx)
 #if !defined(__ANDROID__) && !defined(NO_ICONV) /* we don't use iconv on Android, or when it is explicitly disabled */
 	wchar_t wbuf[256];
 	/* iconv variables */
-	iconv_t ic;
 	size_t inbytes;
 	size_t outbytes;
 	size_t res;
@@ -412,12 +599,6 @@ static wchar_t *get_usb_string(libusb_device_handle *dev, uint8_t idx)
 	char *outptr;
 #endif
 
-	/* Determine which language to use. */
-	uint16_t lang;
-	lang = get_usb_code_for_current_locale();
-	if (!is_language_supported(dev, lang))
-		lang = get_first_language(dev);
-
 	/* Get the string from libusb. */
 	len = libusb_get_string_descriptor(dev,
 			idx,
@@ -449,11 +630,19 @@ static wchar_t *get_usb_string(libusb_device_handle *dev, uint8_t idx)
 	/* buf does not need to be explicitly NULL-terminated because
 	   it is only passed into iconv() which does not need it. */
 
-	/* Initialize iconv. */
-	ic = iconv_open("WCHAR_T", "UTF-16LE");
-	if (ic == (iconv_t)-1) {
-		LOG("iconv_open() failed\n");
-		return NULL;
+	pthread_mutex_lock(&usb_string_ic_mutex);
+
+	/* Initialize iconv, once. */
+	if (usb_string_ic == (iconv_t)-1) {
+		usb_string_ic = iconv_open("WCHAR_T", "UTF-16LE");
+		if (usb_string_ic == (iconv_t)-1) {
+			LOG("iconv_open() failed\n");
+			goto err;
+		}
+	}
+	else {
+		/* Back to the initial shift state */
+		iconv(usb_string_ic, NULL, NULL, NULL, NULL);
 	}
 
 	/* Convert to native wchar_t (UTF-32 on glibc/BSD systems).
@@ -462,7 +651,7 @@ static wchar_t *get_usb_string(libusb_device_handle *dev, uint8_t idx)
 	inbytes = len-2;
 	outptr = (char*) wbuf;
 	outbytes = sizeof(wbuf);
-	res = iconv(ic, &inptr, &inbytes, &outptr, &outbytes);
+	res = iconv(usb_string_ic, &inptr, &inbytes, &outptr, &outbytes);
 	if (res == (size_t)-1) {
 		LOG("iconv() failed\n");
 		goto err;
@@ -477,13 +666,60 @@ static wchar_t *get_usb_string(libusb_device_handle *dev, uint8_t idx)
 	str = wcsdup(wbuf);
 
 err:
-	iconv_close(ic);
+	pthread_mutex_unlock(&usb_string_ic_mutex);
 
 #endif
 
 	return str;
 }
 
+static void init_usb_string_cache(struct usb_string_cache *cache)
+{
+	memset(cache, 0, sizeof(*cache));
+	pthread_mutex_init(&cache->mutex, NULL);
+}
+
+static void free_usb_string_cache(struct usb_string_cache *cache)
+{
+	int i;
+
+	for (i = 0; i < 256; i++)
+		free(cache->strings[i]);
+	pthread_mutex_destroy(&cache->mutex);
+}
+
+/* Get the USB device string numbered by the index from the cache, or
+   from the device if it has not been fetched yet. The returned string
+   is newly allocated and must be freed by using free(). */
+static wchar_t *get_cached_usb_string(struct usb_string_cache *cache, libusb_device_handle *dev, uint8_t idx)
+{
+	wchar_t *str = NULL;
+	size_t len;
+
+	pthread_mutex_lock(&cache->mutex);
+
+	if (!cache->strings[idx]) {
+		/* Determine which language to use. */
+		if (!cache->has_lang) {
+			cache->lang = get_usb_string_language(dev);
+			cache->has_lang = 1;
+		}
+		cache->strings[idx] = get_usb_string(dev, cache->lang, idx);
+	}
+
+	/* Copy the string (no wcsdup() on Bionic) */
+	if (cache->strings[idx]) {
+		len = wcslen(cache->strings[idx]) + 1;
+		str = (wchar_t*) malloc(len * sizeof(wchar_t));
+		if (str)
+			memcpy(str, cache->strings[idx], len * sizeof(wchar_t));
+	}
+
+	pthread_mutex_unlock(&cache->mutex);
+
+	return str;
+}
+
 static char *make_path(libusb_device *dev, int interface_number, int config_number)
 {
 	char str[64]; /* max length "000-000.000.000.000.000.000.000:000.000" */
@@ -510,6 +746,79 @@ static char *make_path(libusb_device *dev, int interface_number, int config_numb
 	return strdup(str);
 }
 
+/* A path made by make_path(), parsed back into numbers */
+struct usb_path {
+	uint8_t bus_number;
+	uint8_t port_numbers[8];
+	int num_ports;
+	uint8_t config_number;
+	uint8_t interface_number;
+};
+
+/* Parse a decimal number from 0 to 255 at *str, and move past it.
+   Returns 0 on success and -1 on error. */
+static int parse_path_number(const char **str, uint8_t *number)
+{
+	const char *p = *str;
+	unsigned value = 0;
+
+	if (*p < '0' || *p > '9')
+		return -1;
+	while (*p >= '0' && *p <= '9') {
+		value = value * 10 + (unsigned) (*p - '0');
+		if (value > 255)
+			return -1;
+		p++;
+	}
+
+	*number = (uint8_t) value;
+	*str = p;
+	return 0;
+}
+
+/* Parse "bus-port.port...:config.interface". Returns 0 on success and
+   -1 if the path is not one make_path() could have made. */
+static int parse_path(const char *path, struct usb_path *parsed)
+{
+	const char *p = path;
+
+	if (parse_path_number(&p, &parsed->bus_number) < 0 || *p++ != '-')
+		return -1;
+
+	parsed->num_ports = 0;
+	for (;;) {
+		if (parsed->num_ports == 8 ||
+		    parse_path_number(&p, &parsed->port_numbers[parsed->num_ports]) < 0)
+			return -1;
+		parsed->num_ports++;
+		if (*p != '.')
+			break;
+		p++;
+	}
+
+	if (*p++ != ':' ||
+	    parse_path_number(&p, &parsed->config_number) < 0 || *p++ != '.' ||
+	    parse_path_number(&p, &parsed->interface_number) < 0 || *p != '\0')
+		return -1;
+
+	return 0;
+}
+
+/* Whether dev is at the bus and ports of the path. The configuration
+   and interface are checked by the caller. */
+static int device_matches_path(libusb_device *dev, const struct usb_path *parsed)
+{
+	uint8_t port_numbers[8];
+	int num_ports;
+
+	if (libusb_get_bus_number(dev) != parsed->bus_number)
+		return 0;
+
+	num_ports = libusb_get_port_numbers(dev, port_numbers, 8);
+	return num_ports == parsed->num_ports &&
+		memcmp(port_numbers, parsed->port_numbers, num_ports) == 0;
+}
+
 HID_API_EXPORT const struct hid_api_version* HID_API_CALL hid_version()
 {
 	return &api_version;
@@ -520,6 +829,121 @@ HID_API_EXPORT const char* HID_API_CALL hid_version_str()
 	return HID_API_VERSION_STR;
 }
 
+/* Handles the libusb events of a worker's context, until hid_exit()
+   stops it. The transfer callbacks of all the devices assigned to the
+   worker run on this thread. */
+static void *event_thread(void *param)
+{
+	struct event_worker *worker = param;
+	int backoff_ms = 0;
+
+	while (!__atomic_load_n(&worker->shutdown, __ATOMIC_SEQ_CST)) {
+		int res;
+#ifdef HAVE_LIBUSB_INTERRUPT_EVENT_HANDLER
+		res = libusb_handle_events(worker->context);
+#else
+		struct timeval tv = { 1, 0 };
+		res = libusb_handle_events_timeout(worker->context, &tv);
+#endif
+		if (res < 0) {
+			/* There was an error. */
+			LOG("event_thread(): libusb reports error # %d\n", res);
+
+			/* The thread serves other devices too, so it goes on
+			   even on fatal errors; but those (such as NO_MEM or IO)
+			   tend to persist, so wait longer and longer between the
+			   retries instead of spinning. */
+			if (res != LIBUSB_ERROR_BUSY &&
+			    res != LIBUSB_ERROR_TIMEOUT &&
+			    res != LIBUSB_ERROR_OVERFLOW &&
+			    res != LIBUSB_ERROR_INTERRUPTED) {
+				backoff_ms = backoff_ms ? backoff_ms * 2 : 1;
+				if (backoff_ms > EVENT_THREAD_MAX_BACKOFF_MS)
+					backoff_ms = EVENT_THREAD_MAX_BACKOFF_MS;
+				usleep(backoff_ms * 1000);
+			}
+		}
+		else {
+			backoff_ms = 0;
+		}
+	}
+
+	return NULL;
+}
+
+/* Picks the event thread with the fewest devices for a device which
+   is about to be opened, and starts it if it is not running yet.
+   The device must be opened on the returned worker's context.
+   Returns NULL on failure. */
+static struct event_worker *acquire_event_worker(void)
+{
+	struct event_worker *worker = &event_workers[0];
+	int i;
+
+	pthread_mutex_lock(&event_workers_mutex);
+
+	for (i = 1; i < num_event_threads; i++) {
+		if (event_workers[i].num_devices < worker->num_devices)
+			worker = &event_workers[i];
+	}
+
+	if (!worker->running) {
+		if (libusb_init(&worker->context)) {
+			LOG("can't create the libusb context of an event thread\n");
+			pthread_mutex_unlock(&event_workers_mutex);
+			return NULL;
+		}
+		worker->shutdown = 0;
+		if (pthread_create(&worker->thread, NULL, event_thread, worker) != 0) {
+			LOG("can't start an event thread\n");
+			libusb_exit(worker->context);
+			worker->context = NULL;
+			pthread_mutex_unlock(&event_workers_mutex);
+			return NULL;
+		}
+		worker->running = 1;
+	}
+	worker->num_devices++;
+
+	pthread_mutex_unlock(&event_workers_mutex);
+
+	return worker;
+}
+
+static void release_event_worker(struct event_worker *worker)
+{
+	pthread_mutex_lock(&event_workers_mutex);
+	worker->num_devices--;
+	pthread_mutex_unlock(&event_workers_mutex);
+}
+
+/* Stops all the event threads. Idle threads are kept running until
+   then, so that opening and closing devices doesn't create and join
+   a thread every time. */
+static void stop_event_workers(void)
+{
+	int i;
+
+	pthread_mutex_lock(&event_workers_mutex);
+	for (i = 0; i < MAX_EVENT_THREADS; i++) {
+		struct event_worker *worker = &event_workers[i];
+
+		if (!worker->running)
+			continue;
+
+		__atomic_store_n(&worker->shutdown, 1, __ATOMIC_SEQ_CST);
+#ifdef HAVE_LIBUSB_INTERRUPT_EVENT_HANDLER
+		libusb_interrupt_event_handler(worker->context);
+#endif
+		pthread_join(worker->thread, NULL);
+
+		libusb_exit(worker->context);
+		worker->context = NULL;
+		worker->running = 0;
+	}
+	pthread_mutex_unlock(&event_workers_mutex);
+}
+
 int HID_API_EXPORT hid_init(void)
 {
 	if (!usb_context) {
@@ -538,8 +962,17 @@ int HID_API_EXPORT hid_init(void)
 	return 0;
 }
 
+static void stop_hotplug_thread(void);
+
 int HID_API_EXPORT hid_exit(void)
 {
+	stop_hotplug_thread();
+	stop_event_workers();
+
+#if !defined(__ANDROID__) && !defined(NO_ICONV)
+	close_usb_string_ic();
+#endif
+
 	if (usb_context) {
 		libusb_exit(usb_context);
 		usb_context = NULL;
@@ -548,169 +981,243 @@ int HID_API_EXPORT hid_exit(void)
 	return 0;
 }
 
-struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+/* Create the device info records (one per HID interface) of the
+   device dev, whose device descriptor is desc, which match the filter
+   (NULL to match any). The interface number is checked before opening
+   the device, and the serial number before fetching the other strings.
+   The device is not opened at all if fetch_strings is 0 (see
+   hid_libusb_set_enumerate_strings()) and the filter does not need the
+   serial number. Otherwise it is opened once, and its strings fetched
+   once, for all its interfaces. */
+static struct hid_device_info *create_device_info_for_device(libusb_device *dev, struct libusb_device_descriptor *desc, const struct hid_enum_filter *filter, int fetch_strings)
 {
-	libusb_device **devs;
-	libusb_device *dev;
-	libusb_device_handle *handle;
-	ssize_t num_devs;
-	int i = 0;
+	libusb_device_handle *handle = NULL;
+	struct libusb_config_descriptor *conf_desc = NULL;
+	struct usb_string_cache strings;
+	int j, k, res;
+	unsigned short dev_vid = desc->idVendor;
+	unsigned short dev_pid = desc->idProduct;
+	int open_device = fetch_strings || (filter && (filter->match & HID_API_MATCH_SERIAL_NUMBER));
 
 	struct hid_device_info *root = NULL; /* return object */
 	struct hid_device_info *cur_dev = NULL;
 
-	if(hid_init() < 0)
-		return NULL;
-
-	num_devs = libusb_get_device_list(usb_context, &devs);
-	if (num_devs < 0)
-		return NULL;
-	while ((dev = devs[i++]) != NULL) {
-		struct libusb_device_descriptor desc;
-		struct libusb_config_descriptor *conf_desc = NULL;
-		int j, k;
-
-		int res = libusb_get_device_descriptor(dev, &desc);
-		unsigned short dev_vid = desc.idVendor;
-		unsigned short dev_pid = desc.idProduct;
-
-		if ((vendor_id != 0x0 && vendor_id != dev_vid) ||
-		    (product_id != 0x0 && product_id != dev_pid)) {
-			continue;
-		}
-
-		res = libusb_get_active_config_descriptor(dev, &conf_desc);
-		if (res < 0)
-			libusb_get_config_descriptor(dev, 0, &conf_desc);
-		if (conf_desc) {
-			for (j = 0; j < conf_desc->bNumInterfaces; j++) {
-				const struct libusb_interface *intf = &conf_desc->interface[j];
-				for (k = 0; k < intf->num_altsetting; k++) {
-					const struct libusb_interface_descriptor *intf_desc;
-					intf_desc = &intf->altsetting[k];
-					if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID) {
-						int interface_num = intf_desc->bInterfaceNumber;
-						struct hid_device_info *tmp;
-
-						/* VID/PID match. Create the record. */
-						tmp = (struct hid_device_info*) calloc(1, sizeof(struct hid_device_info));
-						if (cur_dev) {
-							cur_dev->next = tmp;
-						}
-						else {
-							root = tmp;
-						}
-						cur_dev = tmp;
-
-						/* Fill out the record */
-						cur_dev->next = NULL;
-						cur_dev->path = make_path(dev, interface_num, conf_desc->bConfigurationValue);
+#ifdef INVASIVE_GET_USAGE
+	open_device = 1;
+#endif
 
-						res = libusb_open(dev, &handle);
+	init_usb_string_cache(&strings);
 
-						if (res >= 0) {
+	res = libusb_get_active_config_descriptor(dev, &conf_desc);
+	if (res < 0)
+		libusb_get_config_descriptor(dev, 0, &conf_desc);
+	if (conf_desc) {
+		for (j = 0; j < conf_desc->bNumInterfaces; j++) {
+			const struct libusb_interface *intf = &conf_desc->interface[j];
+			for (k = 0; k < intf->num_altsetting; k++) {
+				const struct libusb_interface_descriptor *intf_desc;
+				intf_desc = &intf->altsetting[k];
+				if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID) {
+					int interface_num = intf_desc->bInterfaceNumber;
+					struct hid_device_info *tmp;
+
+					if (filter && (filter->match & HID_API_MATCH_INTERFACE_NUMBER) &&
+					    filter->interface_number != interface_num)
+						continue;
+
+					/* Create the record. It is appended to the list
+					   below if it matches the filter. */
+					tmp = (struct hid_device_info*) calloc(1, sizeof(struct hid_device_info));
+					if (!tmp)
+						continue;
+
+					/* Fill out the record */
+					tmp->next = NULL;
+					tmp->path = make_path(dev, interface_num, conf_desc->bConfigurationValue);
+
+					/* Open the device on its first HID interface */
+					if (open_device) {
+						open_device = 0;
+						if (libusb_open(dev, &handle) < 0)
+							handle = NULL;
 #ifdef __ANDROID__
-							/* There is (a potential) libusb Android backend, in which
-							   device descriptor is not accurate up until the device is opened.
-							   https://github.com/libusb/libusb/pull/874#discussion_r632801373
-							   A workaround is to re-read the descriptor again.
-							   Even if it is not going to be accepted into libusb master,
-							   having it here won't do any harm, since reading the device descriptor
-							   is as cheap as copy 18 bytes of data. */
-							libusb_get_device_descriptor(dev, &desc);
+						/* There is (a potential) libusb Android backend, in which
+						   device descriptor is not accurate up until the device is opened.
+						   https://github.com/libusb/libusb/pull/874#discussion_r632801373
+						   A workaround is to re-read the descriptor again.
+						   Even if it is not going to be accepted into libusb master,
+						   having it here won't do any harm, since reading the device descriptor
+						   is as cheap as copy 18 bytes of data. */
+						else
+							libusb_get_device_descriptor(dev, desc);
 #endif
+					}
 
-							/* Serial Number */
-							if (desc.iSerialNumber > 0)
-								cur_dev->serial_number =
-									get_usb_string(handle, desc.iSerialNumber);
-
-							/* Manufacturer and Product strings */
-							if (desc.iManufacturer > 0)
-								cur_dev->manufacturer_string =
-									get_usb_string(handle, desc.iManufacturer);
-							if (desc.iProduct > 0)
-								cur_dev->product_string =
-									get_usb_string(handle, desc.iProduct);
+					if (handle) {
+						/* Serial Number */
+						if (desc->iSerialNumber > 0)
+							tmp->serial_number =
+								get_cached_usb_string(&strings, handle, desc->iSerialNumber);
+
+						/* Manufacturer and Product strings, unless they
+						   are fetched on demand or the record is about
+						   to be dropped anyway */
+						if (fetch_strings && serial_number_matches(tmp->serial_number, filter)) {
+							if (desc->iManufacturer > 0)
+								tmp->manufacturer_string =
+									get_cached_usb_string(&strings, handle, desc->iManufacturer);
+							if (desc->iProduct > 0)
+								tmp->product_string =
+									get_cached_usb_string(&strings, handle, desc->iProduct);
+						}
 
 #ifdef INVASIVE_GET_USAGE
 {
-						/*
-						This section is removed because it is too
-						invasive on the system. Getting a Usage Page
-						and Usage requires parsing the HID Report
-						descriptor. Getting a HID Report descriptor
-						involves claiming the interface. Claiming the
-						interface involves detaching the kernel driver.
-						Detaching the kernel driver is hard on the system
-						because it will unclaim interfaces (if another
-						app has them claimed) and the re-attachment of
-						the driver will sometimes change /dev entry names.
-						It is for these reasons that this section is
-						#if 0. For composite devices, use the interface
-						field in the hid_device_info struct to distinguish
-						between interfaces. */
-							unsigned char data[256];
+					/*
+					This section is removed because it is too
+					invasive on the system. Getting a Usage Page
+					and Usage requires parsing the HID Report
+					descriptor. Getting a HID Report descriptor
+					involves claiming the interface. Claiming the
+					interface involves detaching the kernel driver.
+					Detaching the kernel driver is hard on the system
+					because it will unclaim interfaces (if another
+					app has them claimed) and the re-attachment of
+					the driver will sometimes change /dev entry names.
+					It is for these reasons that this section is
+					#if 0. For composite devices, use the interface
+					field in the hid_device_info struct to distinguish
+					between interfaces. */
+						unsigned char data[256];
 #ifdef DETACH_KERNEL_DRIVER
-							int detached = 0;
-							/* Usage Page and Usage */
-							res = libusb_kernel_driver_active(handle, interface_num);
-							if (res == 1) {
-								res = libusb_detach_kernel_driver(handle, interface_num);
-								if (res < 0)
-									LOG("Couldn't detach kernel driver, even though a kernel driver was attached.\n");
-								else
-									detached = 1;
-							}
+						int detached = 0;
+						/* Usage Page and Usage */
+						res = libusb_kernel_driver_active(handle, interface_num);
+						if (res == 1) {
+							res = libusb_detach_kernel_driver(handle, interface_num);
+							if (res < 0)
+								LOG("Couldn't detach kernel driver, even though a kernel driver was attached.\n");
+							else
+								detached = 1;
+						}
 #endif
-							res = libusb_claim_interface(handle, interface_num);
+						res = libusb_claim_interface(handle, interface_num);
+						if (res >= 0) {
+							/* Get the HID Report Descriptor. */
+							res = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN|LIBUSB_RECIPIENT_INTERFACE, LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_REPORT << 8)|interface_num, 0, data, sizeof(data), 5000);
 							if (res >= 0) {
-								/* Get the HID Report Descriptor. */
-								res = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN|LIBUSB_RECIPIENT_INTERFACE, LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_REPORT << 8)|interface_num, 0, data, sizeof(data), 5000);
-								if (res >= 0) {
-									unsigned short page=0, usage=0;
-									/* Parse the usage and usage page
-									   out of the report descriptor. */
-									get_usage(data, res,  &page, &usage);
-									cur_dev->usage_page = page;
-									cur_dev->usage = usage;
-								}
-								else
-									LOG("libusb_control_transfer() for getting the HID report failed with %d\n", res);
-
-								/* Release the interface */
-								res = libusb_release_interface(handle, interface_num);
-								if (res < 0)
-									LOG("Can't release the interface.\n");
+								unsigned short page=0, usage=0;
+								/* Parse the usage and usage page
+								   out of the report descriptor. */
+								get_usage(data, res,  &page, &usage);
+								tmp->usage_page = page;
+								tmp->usage = usage;
 							}
 							else
-								LOG("Can't claim interface %d\n", res);
+								LOG("libusb_control_transfer() for getting the HID report failed with %d\n", res);
+
+							/* Release the interface */
+							res = libusb_release_interface(handle, interface_num);
+							if (res < 0)
+								LOG("Can't release the interface.\n");
+						}
+						else
+							LOG("Can't claim interface %d\n", res);
 #ifdef DETACH_KERNEL_DRIVER
-							/* Re-attach kernel driver if necessary. */
-							if (detached) {
-								res = libusb_attach_kernel_driver(handle, interface_num);
-								if (res < 0)
-									LOG("Couldn't re-attach kernel driver.\n");
-							}
+						/* Re-attach kernel driver if necessary. */
+						if (detached) {
+							res = libusb_attach_kernel_driver(handle, interface_num);
+							if (res < 0)
+								LOG("Couldn't re-attach kernel driver.\n");
+						}
 #endif
 }
 #endif /* INVASIVE_GET_USAGE */
+					}
+					/* VID/PID */
+					tmp->vendor_id = dev_vid;
+					tmp->product_id = dev_pid;
 
-							libusb_close(handle);
-						}
-						/* VID/PID */
-						cur_dev->vendor_id = dev_vid;
-						cur_dev->product_id = dev_pid;
+					/* Release Number */
+					tmp->release_number = desc->bcdDevice;
+
+					/* Interface Number */
+					tmp->interface_number = interface_num;
 
-						/* Release Number */
-						cur_dev->release_number = desc.bcdDevice;
+					/* Bus Type */
+					tmp->bus_type = HID_API_BUS_USB;
 
-						/* Interface Number */
-						cur_dev->interface_number = interface_num;
+					if (!device_info_matches(tmp, filter)) {
+						hid_free_enumeration(tmp);
+						continue;
 					}
-				} /* altsettings */
-			} /* interfaces */
-			libusb_free_config_descriptor(conf_desc);
+
+					if (cur_dev) {
+						cur_dev->next = tmp;
+					}
+					else {
+						root = tmp;
+					}
+					cur_dev = tmp;
+				}
+			} /* altsettings */
+		} /* interfaces */
+		libusb_free_config_descriptor(conf_desc);
+	}
+
+	if (handle)
+		libusb_close(handle);
+	free_usb_string_cache(&strings);
+
+	return root;
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate_ex(const struct hid_enum_filter *filter)
+{
+	libusb_device **devs;
+	libusb_device *dev;
+	ssize_t num_devs;
+	int i = 0;
+
+	struct hid_device_info *root = NULL; /* return object */
+	struct hid_device_info *cur_dev = NULL;
+
+	if(hid_init() < 0)
+		return NULL;
+
+	/* All the devices are USB devices */
+	if (filter && (filter->match & HID_API_MATCH_BUS_TYPE) && filter->bus_type != HID_API_BUS_USB)
+		return NULL;
+
+	num_devs = libusb_get_device_list(usb_context, &devs);
+	if (num_devs < 0)
+		return NULL;
+	while ((dev = devs[i++]) != NULL) {
+		struct libusb_device_descriptor desc;
+		struct hid_device_info *tmp;
+
+		libusb_get_device_descriptor(dev, &desc);
+		unsigned short dev_vid = desc.idVendor;
+		unsigned short dev_pid = desc.idProduct;
+
+		if (filter &&
+		    (((filter->match & HID_API_MATCH_VENDOR_ID) && filter->vendor_id != dev_vid) ||
+		     ((filter->match & HID_API_MATCH_PRODUCT_ID) && filter->product_id != dev_pid))) {
+			continue;
+		}
+
+		tmp = create_device_info_for_device(dev, &desc, filter, enumerate_strings);
+		if (tmp) {
+			/* Append the records, and move to the last one */
+			if (cur_dev) {
+				cur_dev->next = tmp;
+			}
+			else {
+				root = tmp;
+			}
+			cur_dev = tmp;
+			while (cur_dev->next)
+				cur_dev = cur_dev->next;
 		}
 	}
 
@@ -719,6 +1226,21 @@ struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
 	return root;
 }
 
+struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+	struct hid_enum_filter filter;
+
+	memset(&filter, 0, sizeof(filter));
+	filter.vendor_id = vendor_id;
+	filter.product_id = product_id;
+	if (vendor_id != 0x0)
+		filter.match |= HID_API_MATCH_VENDOR_ID;
+	if (product_id != 0x0)
+		filter.match |= HID_API_MATCH_PRODUCT_ID;
+
+	return hid_enumerate_ex(&filter);
+}
+
 void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
 {
 	struct hid_device_info *d = devs;
@@ -733,309 +1255,514 @@ void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
 	}
 }
 
-hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+/* Hotplug callbacks, see hid_hotplug_register_callback(). The libusb
+   hotplug callback may run on any thread which handles the events of
+   usb_context, so it only queues the event (under the
+   hotplug_events_mutex). The hotplug thread creates the records of the
+   devices which arrived, keeps them in hotplug_devices to report them
+   once the device leaves, and calls the callbacks (see
+   call_hotplug_callbacks()). The hotplug_mutex protects the callbacks
+   and hotplug_devices. */
+struct hotplug_callback {
+	hid_hotplug_callback_handle handle;
+	unsigned short vendor_id;
+	unsigned short product_id;
+	int events;
+	hid_hotplug_callback_fn callback;
+	void *user_data;
+	struct hotplug_callback *next;
+};
+
+#ifdef HAVE_LIBUSB_HOTPLUG
+struct hotplug_device {
+	libusb_device *device; /* Referenced */
+	struct hid_device_info *devs;
+	struct hotplug_device *next;
+};
+
+struct hotplug_event {
+	libusb_device *device; /* Referenced */
+	libusb_hotplug_event event;
+	int silent; /* Present at start: not reported, nor opened */
+	struct hotplug_event *next;
+};
+
+static pthread_mutex_t hotplug_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct hotplug_callback *hotplug_callbacks = NULL;
+static hid_hotplug_callback_handle next_hotplug_handle = 1;
+static struct hotplug_device *hotplug_devices = NULL;
+static libusb_hotplug_callback_handle hotplug_libusb_handle;
+static pthread_t hotplug_thread;
+static int hotplug_thread_running = 0;
+static int hotplug_shutdown = 0;
+static int hotplug_dispatching = 0;
+static pthread_cond_t hotplug_dispatch_done = PTHREAD_COND_INITIALIZER;
+
+static pthread_mutex_t hotplug_events_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct hotplug_event *hotplug_events = NULL;
+static int hotplug_enumerating = 0;
+
+static int hotplug_libusb_callback(libusb_context *ctx, libusb_device *device, libusb_hotplug_event event, void *user_data)
 {
-	struct hid_device_info *devs, *cur_dev;
-	const char *path_to_open = NULL;
-	hid_device *handle = NULL;
-
-	devs = hid_enumerate(vendor_id, product_id);
-	cur_dev = devs;
-	while (cur_dev) {
-		if (cur_dev->vendor_id == vendor_id &&
-		    cur_dev->product_id == product_id) {
-			if (serial_number) {
-				if (cur_dev->serial_number &&
-				    wcscmp(serial_number, cur_dev->serial_number) == 0) {
-					path_to_open = cur_dev->path;
-					break;
-				}
-			}
-			else {
-				path_to_open = cur_dev->path;
-				break;
-			}
-		}
-		cur_dev = cur_dev->next;
-	}
+	struct hotplug_event *ev, **last;
+	(void) ctx;
+	(void) user_data;
 
-	if (path_to_open) {
-		/* Open the device */
-		handle = hid_open_path(path_to_open);
+	ev = (struct hotplug_event *) calloc(1, sizeof(struct hotplug_event));
+	if (!ev) {
+		LOG("can't queue a hotplug event\n");
+		return 0;
 	}
+	ev->device = libusb_ref_device(device);
+	ev->event = event;
 
-	hid_free_enumeration(devs);
+	pthread_mutex_lock(&hotplug_events_mutex);
+	ev->silent = hotplug_enumerating;
+	for (last = &hotplug_events; *last; last = &(*last)->next)
+		;
+	*last = ev;
+	pthread_mutex_unlock(&hotplug_events_mutex);
 
-	return handle;
+	return 0;
 }
 
-static void read_callback(struct libusb_transfer *transfer)
+/* Removes a callback from hotplug_callbacks. Returns 0 on success and
+   -1 if it is not registered. Called with the hotplug_mutex held. */
+static int remove_hotplug_callback(hid_hotplug_callback_handle handle)
 {
-	hid_device *dev = transfer->user_data;
-	int res;
-
-	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+	struct hotplug_callback **cb;
 
-		struct input_report *rpt = (struct input_report*) malloc(sizeof(*rpt));
-		rpt->data = (uint8_t*) malloc(transfer->actual_length);
-		memcpy(rpt->data, transfer->buffer, transfer->actual_length);
-		rpt->len = transfer->actual_length;
-		rpt->next = NULL;
+	for (cb = &hotplug_callbacks; *cb; cb = &(*cb)->next) {
+		if ((*cb)->handle == handle) {
+			struct hotplug_callback *found = *cb;
+			*cb = found->next;
+			free(found);
+			return 0;
+		}
+	}
+	return -1;
+}
 
-		pthread_mutex_lock(&dev->mutex);
+static int hotplug_callback_registered(hid_hotplug_callback_handle handle)
+{
+	struct hotplug_callback *cb;
+	int registered = 0;
 
-		/* Attach the new report object to the end of the list. */
-		if (dev->input_reports == NULL) {
-			/* The list is empty. Put it at the root. */
-			dev->input_reports = rpt;
-			pthread_cond_signal(&dev->condition);
+	pthread_mutex_lock(&hotplug_mutex);
+	for (cb = hotplug_callbacks; cb; cb = cb->next) {
+		if (cb->handle == handle) {
+			registered = 1;
+			break;
 		}
-		else {
-			/* Find the end of the list and attach. */
-			struct input_report *cur = dev->input_reports;
-			int num_queued = 0;
-			while (cur->next != NULL) {
-				cur = cur->next;
-				num_queued++;
-			}
-			cur->next = rpt;
+	}
+	pthread_mutex_unlock(&hotplug_mutex);
+
+	return registered;
+}
 
-			/* Pop one off if we've reached 30 in the queue. This
-			   way we don't grow forever if the user never reads
-			   anything from the device. */
-			if (num_queued > 30) {
-				return_data(dev, NULL, 0);
+/* Calls the callbacks which match the records of devs. This is called
+   only from the hotplug thread, without the hotplug_mutex held: the
+   callbacks are copied, so that they can call back into hidapi, and
+   each one is checked to still be registered right before it is
+   called. hid_hotplug_deregister_callback() waits for the end of the
+   round while hotplug_dispatching is set. */
+static void call_hotplug_callbacks(struct hid_device_info *devs, hid_hotplug_event event)
+{
+	struct hotplug_callback *callbacks, *c;
+	struct hid_device_info *info;
+	size_t num_callbacks = 0, i;
+
+	pthread_mutex_lock(&hotplug_mutex);
+	for (c = hotplug_callbacks; c; c = c->next)
+		num_callbacks++;
+	callbacks = num_callbacks ? (struct hotplug_callback *) calloc(num_callbacks, sizeof(struct hotplug_callback)) : NULL;
+	if (!callbacks) {
+		pthread_mutex_unlock(&hotplug_mutex);
+		return;
+	}
+	for (c = hotplug_callbacks, i = 0; c; c = c->next, i++)
+		callbacks[i] = *c;
+	hotplug_dispatching = 1;
+	pthread_mutex_unlock(&hotplug_mutex);
+
+	for (info = devs; info; info = info->next) {
+		struct hid_device_info *next = info->next;
+
+		/* Each record is passed on its own */
+		info->next = NULL;
+		for (i = 0; i < num_callbacks; i++) {
+			c = &callbacks[i];
+			if (!(c->events & event) ||
+			    (c->vendor_id != 0x0 && c->vendor_id != info->vendor_id) ||
+			    (c->product_id != 0x0 && c->product_id != info->product_id) ||
+			    !hotplug_callback_registered(c->handle))
+				continue;
+			if (c->callback(c->handle, info, event, c->user_data)) {
+				/* The callback deregistered itself */
+				pthread_mutex_lock(&hotplug_mutex);
+				remove_hotplug_callback(c->handle);
+				pthread_mutex_unlock(&hotplug_mutex);
 			}
 		}
-		pthread_mutex_unlock(&dev->mutex);
-	}
-	else if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
-		dev->shutdown_thread = 1;
-	}
-	else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
-		dev->shutdown_thread = 1;
-	}
-	else if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
-		//LOG("Timeout (normal)\n");
-	}
-	else {
-		LOG("Unknown transfer code: %d\n", transfer->status);
+		info->next = next;
 	}
 
-	if (dev->shutdown_thread) {
-		dev->transfer_loop_finished = 1;
-		return;
-	}
+	pthread_mutex_lock(&hotplug_mutex);
+	hotplug_dispatching = 0;
+	pthread_cond_broadcast(&hotplug_dispatch_done);
+	pthread_mutex_unlock(&hotplug_mutex);
 
-	/* Re-submit the transfer object. */
-	res = libusb_submit_transfer(transfer);
-	if (res != 0) {
-		LOG("Unable to submit URB. libusb error code: %d\n", res);
-		dev->shutdown_thread = 1;
-		dev->transfer_loop_finished = 1;
-	}
+	free(callbacks);
 }
 
-
-static void *read_thread(void *param)
+static struct hotplug_device *detach_hotplug_device(libusb_device *device)
 {
-	hid_device *dev = param;
-	uint8_t *buf;
-	const size_t length = dev->input_ep_max_packet_size;
+	struct hotplug_device **hd;
 
-	/* Set up the transfer object. */
-	buf = (uint8_t*) malloc(length);
-	dev->transfer = libusb_alloc_transfer(0);
-	libusb_fill_interrupt_transfer(dev->transfer,
-		dev->device_handle,
-		dev->input_endpoint,
-		buf,
-		length,
-		read_callback,
-		dev,
-		5000/*timeout*/);
-
-	/* Make the first submission. Further submissions are made
-	   from inside read_callback() */
-	libusb_submit_transfer(dev->transfer);
-
-	/* Notify the main thread that the read thread is up and running. */
-	pthread_barrier_wait(&dev->barrier);
-
-	/* Handle all the events. */
-	while (!dev->shutdown_thread) {
-		int res;
-		res = libusb_handle_events(usb_context);
-		if (res < 0) {
-			/* There was an error. */
-			LOG("read_thread(): libusb reports error # %d\n", res);
+	for (hd = &hotplug_devices; *hd; hd = &(*hd)->next) {
+		if ((*hd)->device == device) {
+			struct hotplug_device *found = *hd;
+			*hd = found->next;
+			return found;
+		}
+	}
+	return NULL;
+}
 
-			/* Break out of this loop only on fatal error.*/
-			if (res != LIBUSB_ERROR_BUSY &&
-			    res != LIBUSB_ERROR_TIMEOUT &&
-			    res != LIBUSB_ERROR_OVERFLOW &&
-			    res != LIBUSB_ERROR_INTERRUPTED) {
-				dev->shutdown_thread = 1;
-				break;
+static void free_hotplug_device(struct hotplug_device *hd)
+{
+	hid_free_enumeration(hd->devs);
+	libusb_unref_device(hd->device);
+	free(hd);
+}
+
+static void process_hotplug_events(void)
+{
+	struct hotplug_event *events, *ev;
+
+	pthread_mutex_lock(&hotplug_events_mutex);
+	events = hotplug_events;
+	hotplug_events = NULL;
+	pthread_mutex_unlock(&hotplug_events_mutex);
+
+	while ((ev = events) != NULL) {
+		struct hotplug_device *hd;
+
+		events = ev->next;
+
+		if (ev->event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+			struct libusb_device_descriptor desc;
+
+			/* Create the records before taking the mutex, as this
+			   reads the strings from the device. The devices which
+			   were present at start are only kept track of, without
+			   opening them: their records have no strings. */
+			hd = (struct hotplug_device *) calloc(1, sizeof(struct hotplug_device));
+			if (hd && libusb_get_device_descriptor(ev->device, &desc) == 0)
+				hd->devs = create_device_info_for_device(ev->device, &desc, NULL, ev->silent ? 0 : enumerate_strings);
+
+			if (hd && hd->devs) {
+				hd->device = libusb_ref_device(ev->device);
+
+				pthread_mutex_lock(&hotplug_mutex);
+				hd->next = hotplug_devices;
+				hotplug_devices = hd;
+				pthread_mutex_unlock(&hotplug_mutex);
+				if (!ev->silent)
+					call_hotplug_callbacks(hd->devs, HID_API_HOTPLUG_EVENT_DEVICE_ARRIVED);
+			}
+			else {
+				/* Not a HID device */
+				free(hd);
+			}
+		}
+		else {
+			pthread_mutex_lock(&hotplug_mutex);
+			hd = detach_hotplug_device(ev->device);
+			pthread_mutex_unlock(&hotplug_mutex);
+			if (hd) {
+				call_hotplug_callbacks(hd->devs, HID_API_HOTPLUG_EVENT_DEVICE_LEFT);
+				free_hotplug_device(hd);
 			}
 		}
-	}
 
-	/* Cancel any transfer that may be pending. This call will fail
-	   if no transfers are pending, but that's OK. */
-	libusb_cancel_transfer(dev->transfer);
+		libusb_unref_device(ev->device);
+		free(ev);
+	}
+}
 
-	while (!dev->transfer_loop_finished)
-		libusb_handle_events_completed(usb_context, &dev->transfer_loop_finished);
+/* Handles the events of usb_context, which include the hotplug events,
+   until hid_exit() stops it. */
+static void *hotplug_thread_func(void *param)
+{
+	(void) param;
 
-	/* Now that the read thread is stopping, Wake any threads which are
-	   waiting on data (in hid_read_timeout()). Do this under a mutex to
-	   make sure that a thread which is about to go to sleep waiting on
-	   the condition actually will go to sleep before the condition is
-	   signaled. */
-	pthread_mutex_lock(&dev->mutex);
-	pthread_cond_broadcast(&dev->condition);
-	pthread_mutex_unlock(&dev->mutex);
+	while (!__atomic_load_n(&hotplug_shutdown, __ATOMIC_SEQ_CST)) {
+		int res;
 
-	/* The dev->transfer->buffer and dev->transfer objects are cleaned up
-	   in hid_close(). They are not cleaned up here because this thread
-	   could end either due to a disconnect or due to a user
-	   call to hid_close(). In both cases the objects can be safely
-	   cleaned up after the call to pthread_join() (in hid_close()), but
-	   since hid_close() calls libusb_cancel_transfer(), on these objects,
-	   they can not be cleaned up here. */
+		process_hotplug_events();
+#ifdef HAVE_LIBUSB_INTERRUPT_EVENT_HANDLER
+		res = libusb_handle_events(usb_context);
+#else
+		struct timeval tv = { 1, 0 };
+		res = libusb_handle_events_timeout(usb_context, &tv);
+#endif
+		if (res < 0)
+			LOG("hotplug_thread(): libusb reports error # %d\n", res);
+	}
 
 	return NULL;
 }
 
+/* Called with the hotplug_mutex held */
+static int start_hotplug_thread(void)
+{
+	int res;
 
-static int hidapi_initialize_device(hid_device *dev, const struct libusb_interface_descriptor *intf_desc)
+	if (hid_init() < 0)
+		return -1;
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		LOG("libusb doesn't support hotplug on this platform\n");
+		return -1;
+	}
+
+	/* The devices which are already present are reported right away
+	   (without opening them, see process_hotplug_events()), to have
+	   their records once they leave. */
+	pthread_mutex_lock(&hotplug_events_mutex);
+	hotplug_enumerating = 1;
+	pthread_mutex_unlock(&hotplug_events_mutex);
+	res = libusb_hotplug_register_callback(usb_context,
+		LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+		LIBUSB_HOTPLUG_ENUMERATE,
+		LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+		hotplug_libusb_callback, NULL, &hotplug_libusb_handle);
+	pthread_mutex_lock(&hotplug_events_mutex);
+	hotplug_enumerating = 0;
+	pthread_mutex_unlock(&hotplug_events_mutex);
+	if (res != LIBUSB_SUCCESS) {
+		LOG("libusb_hotplug_register_callback() failed: %d\n", res);
+		return -1;
+	}
+
+	hotplug_shutdown = 0;
+	if (pthread_create(&hotplug_thread, NULL, hotplug_thread_func, NULL) != 0) {
+		LOG("can't start the hotplug thread\n");
+		libusb_hotplug_deregister_callback(usb_context, hotplug_libusb_handle);
+		return -1;
+	}
+	hotplug_thread_running = 1;
+
+	return 0;
+}
+
+static void stop_hotplug_thread(void)
 {
-	int i =0;
-	int res = 0;
-	struct libusb_device_descriptor desc;
-	libusb_get_device_descriptor(libusb_get_device(dev->device_handle), &desc);
+	struct hotplug_callback *cb;
+	struct hotplug_device *hd;
 
-#ifdef DETACH_KERNEL_DRIVER
-	/* Detach the kernel driver, but only if the
-	   device is managed by the kernel */
-	dev->is_driver_detached = 0;
-	if (libusb_kernel_driver_active(dev->device_handle, intf_desc->bInterfaceNumber) == 1) {
-		res = libusb_detach_kernel_driver(dev->device_handle, intf_desc->bInterfaceNumber);
-		if (res < 0) {
-			LOG("Unable to detach Kernel Driver\n");
-			return 0;
-		}
-		else {
-			dev->is_driver_detached = 1;
-			LOG("Driver successfully detached from kernel.\n");
-		}
+	pthread_mutex_lock(&hotplug_mutex);
+	if (!hotplug_thread_running) {
+		pthread_mutex_unlock(&hotplug_mutex);
+		return;
 	}
+
+	/* The thread may be waiting for the mutex */
+	pthread_mutex_unlock(&hotplug_mutex);
+	__atomic_store_n(&hotplug_shutdown, 1, __ATOMIC_SEQ_CST);
+	/* Deregistering wakes the event handler up too */
+	libusb_hotplug_deregister_callback(usb_context, hotplug_libusb_handle);
+#ifdef HAVE_LIBUSB_INTERRUPT_EVENT_HANDLER
+	libusb_interrupt_event_handler(usb_context);
 #endif
-	res = libusb_claim_interface(dev->device_handle, intf_desc->bInterfaceNumber);
-	if (res < 0) {
-		LOG("can't claim interface %d: %d\n", intf_desc->bInterfaceNumber, res);
-		return 0;
-	}
+	pthread_join(hotplug_thread, NULL);
 
-	/* Store off the string descriptor indexes */
-	dev->manufacturer_index = desc.iManufacturer;
-	dev->product_index      = desc.iProduct;
-	dev->serial_index       = desc.iSerialNumber;
+	pthread_mutex_lock(&hotplug_mutex);
+	hotplug_thread_running = 0;
+	while ((cb = hotplug_callbacks) != NULL) {
+		hotplug_callbacks = cb->next;
+		free(cb);
+	}
+	while ((hd = hotplug_devices) != NULL) {
+		hotplug_devices = hd->next;
+		free_hotplug_device(hd);
+	}
+	pthread_mutex_unlock(&hotplug_mutex);
+
+	/* Drop the events which were not processed */
+	hotplug_enumerating = 0;
+	while (hotplug_events) {
+		struct hotplug_event *ev = hotplug_events;
+		hotplug_events = ev->next;
+		libusb_unref_device(ev->device);
+		free(ev);
+	}
+}
 
-	/* Store off the interface number */
-	dev->interface = intf_desc->bInterfaceNumber;
+int HID_API_EXPORT hid_hotplug_register_callback(unsigned short vendor_id, unsigned short product_id, int events, hid_hotplug_callback_fn callback, void *user_data, hid_hotplug_callback_handle *callback_handle)
+{
+	struct hotplug_callback *cb, **last;
 
-	dev->input_endpoint = 0;
-	dev->input_ep_max_packet_size = 0;
-	dev->output_endpoint = 0;
+	if (!callback || !(events & (HID_API_HOTPLUG_EVENT_DEVICE_ARRIVED | HID_API_HOTPLUG_EVENT_DEVICE_LEFT)))
+		return -1;
 
-	/* Find the INPUT and OUTPUT endpoints. An
-	   OUTPUT endpoint is not required. */
-	for (i = 0; i < intf_desc->bNumEndpoints; i++) {
-		const struct libusb_endpoint_descriptor *ep
-			= &intf_desc->endpoint[i];
+	cb = (struct hotplug_callback *) calloc(1, sizeof(struct hotplug_callback));
+	if (!cb)
+		return -1;
+	cb->vendor_id = vendor_id;
+	cb->product_id = product_id;
+	cb->events = events;
+	cb->callback = callback;
+	cb->user_data = user_data;
 
-		/* Determine the type and direction of this
-		   endpoint. */
-		int is_interrupt =
-			(ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK)
-		      == LIBUSB_TRANSFER_TYPE_INTERRUPT;
-		int is_output =
-			(ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
-		      == LIBUSB_ENDPOINT_OUT;
-		int is_input =
-			(ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
-		      == LIBUSB_ENDPOINT_IN;
+	pthread_mutex_lock(&hotplug_mutex);
 
-		/* Decide whether to use it for input or output. */
-		if (dev->input_endpoint == 0 &&
-		    is_interrupt && is_input) {
-			/* Use this endpoint for INPUT */
-			dev->input_endpoint = ep->bEndpointAddress;
-			dev->input_ep_max_packet_size = ep->wMaxPacketSize;
-		}
-		if (dev->output_endpoint == 0 &&
-		    is_interrupt && is_output) {
-			/* Use this endpoint for OUTPUT */
-			dev->output_endpoint = ep->bEndpointAddress;
-		}
+	if (!hotplug_thread_running && start_hotplug_thread() < 0) {
+		pthread_mutex_unlock(&hotplug_mutex);
+		free(cb);
+		return -1;
 	}
 
-	pthread_create(&dev->thread, NULL, read_thread, dev);
+	cb->handle = next_hotplug_handle++;
+	for (last = &hotplug_callbacks; *last; last = &(*last)->next)
+		;
+	*last = cb;
+	if (callback_handle)
+		*callback_handle = cb->handle;
 
-	/* Wait here for the read thread to be initialized. */
-	pthread_barrier_wait(&dev->barrier);
-	return 1;
+	pthread_mutex_unlock(&hotplug_mutex);
+
+	return 0;
 }
 
+int HID_API_EXPORT hid_hotplug_deregister_callback(hid_hotplug_callback_handle callback_handle)
+{
+	int res;
+
+	pthread_mutex_lock(&hotplug_mutex);
+	res = remove_hotplug_callback(callback_handle);
+	/* The callback may be running on the hotplug thread. Wait for it
+	   to return, unless this is the hotplug thread itself (a callback
+	   deregistering itself or another one). */
+	while (res == 0 && hotplug_dispatching && !pthread_equal(pthread_self(), hotplug_thread))
+		pthread_cond_wait(&hotplug_dispatch_done, &hotplug_mutex);
+	pthread_mutex_unlock(&hotplug_mutex);
 
-hid_device * HID_API_EXPORT hid_open_path(const char *path)
+	return res;
+}
+#else
+static void stop_hotplug_thread(void)
+{
+}
+
+int HID_API_EXPORT hid_hotplug_register_callback(unsigned short vendor_id, unsigned short product_id, int events, hid_hotplug_callback_fn callback, void *user_data, hid_hotplug_callback_handle *callback_handle)
+{
+	(void) vendor_id;
+	(void) product_id;
+	(void) events;
+	(void) callback;
+	(void) user_data;
+	(void) callback_handle;
+
+	LOG("hotplug requires libusb 1.0.16 or later\n");
+	return -1;
+}
+
+int HID_API_EXPORT hid_hotplug_deregister_callback(hid_hotplug_callback_handle callback_handle)
+{
+	(void) callback_handle;
+	return -1;
+}
+#endif /* HAVE_LIBUSB_HOTPLUG */
+
+static int hidapi_initialize_device(hid_device *dev, const struct libusb_interface_descriptor *intf_desc);
+
+hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
 {
 	hid_device *dev = NULL;
 
 	libusb_device **devs = NULL;
 	libusb_device *usb_dev = NULL;
-	int res = 0;
 	int d = 0;
 	int good_open = 0;
+	int found = 0;
 
 	if(hid_init() < 0)
 		return NULL;
 
 	dev = new_hid_device();
 
-	libusb_get_device_list(usb_context, &devs);
-	while ((usb_dev = devs[d++]) != NULL && !good_open) {
+	/* The device is opened on the context of its event thread. */
+	dev->worker = acquire_event_worker();
+	if (!dev->worker) {
+		free_hid_device(dev);
+		return NULL;
+	}
+
+	/* Open the first HID interface hid_enumerate() would return, without
+	   creating the records: the VID/PID come from the cached device
+	   descriptors, and only the serial number is read from the devices,
+	   if there is one to compare. */
+	libusb_get_device_list(dev->worker->context, &devs);
+	while ((usb_dev = devs[d++]) != NULL && !found) {
+		struct libusb_device_descriptor desc;
 		struct libusb_config_descriptor *conf_desc = NULL;
+		const struct libusb_interface_descriptor *intf_desc = NULL;
 		int j,k;
 
+		libusb_get_device_descriptor(usb_dev, &desc);
+		if (desc.idVendor != vendor_id || desc.idProduct != product_id)
+			continue;
+
 		if (libusb_get_active_config_descriptor(usb_dev, &conf_desc) < 0)
 			continue;
-		for (j = 0; j < conf_desc->bNumInterfaces && !good_open; j++) {
+
+		/* The first HID interface of the device */
+		for (j = 0; j < conf_desc->bNumInterfaces && !intf_desc; j++) {
 			const struct libusb_interface *intf = &conf_desc->interface[j];
-			for (k = 0; k < intf->num_altsetting && !good_open; k++) {
-				const struct libusb_interface_descriptor *intf_desc = &intf->altsetting[k];
-				if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID) {
-					char *dev_path = make_path(usb_dev, intf_desc->bInterfaceNumber, conf_desc->bConfigurationValue);
-					if (!strcmp(dev_path, path)) {
-						/* Matched Paths. Open this device */
-
-						/* OPEN HERE */
-						res = libusb_open(usb_dev, &dev->device_handle);
-						if (res < 0) {
-							LOG("can't open device\n");
-							free(dev_path);
-							break;
-						}
-						good_open = hidapi_initialize_device(dev, intf_desc);
-						if (!good_open)
-							libusb_close(dev->device_handle);
-					}
-					free(dev_path);
-				}
+			for (k = 0; k < intf->num_altsetting && !intf_desc; k++) {
+				if (intf->altsetting[k].bInterfaceClass == LIBUSB_CLASS_HID)
+					intf_desc = &intf->altsetting[k];
+			}
+		}
+		if (!intf_desc) {
+			libusb_free_config_descriptor(conf_desc);
+			continue;
+		}
+
+		/* OPEN HERE */
+		if (libusb_open(usb_dev, &dev->device_handle) < 0) {
+			LOG("can't open device\n");
+			/* Without a serial number to compare, this is the
+			   device to open; else it can't be the one. */
+			found = !serial_number;
+			libusb_free_config_descriptor(conf_desc);
+			continue;
+		}
+
+		if (serial_number) {
+			/* The serial number stays in the string cache
+			   of the device if it is the one */
+			wchar_t *str = NULL;
+			if (desc.iSerialNumber > 0)
+				str = get_cached_usb_string(&dev->strings, dev->device_handle, desc.iSerialNumber);
+			found = str && wcscmp(serial_number, str) == 0;
+			free(str);
+			if (!found) {
+				libusb_close(dev->device_handle);
+				dev->device_handle = NULL;
+				free_usb_string_cache(&dev->strings);
+				init_usb_string_cache(&dev->strings);
+				libusb_free_config_descriptor(conf_desc);
+				continue;
 			}
 		}
+
+		found = 1;
+		good_open = hidapi_initialize_device(dev, intf_desc);
+		if (!good_open)
+			libusb_close(dev->device_handle);
 		libusb_free_config_descriptor(conf_desc);
 	}
 
@@ -1052,256 +1779,1612 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 	}
 }
 
+/* Allocates a ring of input reports with room for ring_size reports
+   of report_size bytes each. Nothing is allocated per report after
+   this. Returns 0 on success and -1 on failure. */
+static int alloc_input_reports(size_t ring_size, size_t report_size, struct input_report **reports, uint8_t **buffer)
+{
+	size_t i;
+
+	*reports = (struct input_report*) calloc(ring_size, sizeof(struct input_report));
+	*buffer = (uint8_t*) calloc(ring_size, report_size? report_size: 1);
+	if (!*reports || !*buffer) {
+		free(*reports);
+		free(*buffer);
+		return -1;
+	}
+
+	for (i = 0; i < ring_size; i++)
+		(*reports)[i].data = *buffer + i * report_size;
+
+	return 0;
+}
+
+static int init_input_reports(hid_device *dev)
+{
+	dev->input_ring_size = INPUT_REPORT_RING_SIZE;
+	dev->input_head = 0;
+	dev->input_tail = 0;
+	dev->input_queue_policy = HID_LIBUSB_INPUT_QUEUE_DROP_OLDEST;
+	dev->stats.input_reports_dropped = 0;
+
+	return alloc_input_reports(dev->input_ring_size, dev->input_ep_max_packet_size,
+		&dev->input_reports, &dev->input_report_buffer);
+}
+
+static int input_reports_empty(hid_device *dev)
+{
+	return __atomic_load_n(&dev->input_head, __ATOMIC_SEQ_CST) ==
+	       __atomic_load_n(&dev->input_tail, __ATOMIC_SEQ_CST);
+}
+
+/* Makes the fd returned by hid_get_poll_fd() readable if there is an
+   input report to read or the device is gone, and not readable
+   otherwise. This should be called with dev->mutex locked, whenever
+   either may have changed. */
+static void update_poll_fd(hid_device *dev)
+{
+	int ready;
+
+	if (dev->poll_fd < 0)
+		return;
+
+	ready = !input_reports_empty(dev) || dev->shutdown_transfers;
+	if (ready && !dev->poll_fd_signaled) {
+#ifdef HAVE_EVENTFD
+		uint64_t value = 1;
+		if (write(dev->poll_fd_write, &value, sizeof(value)) < 0)
+#else
+		if (write(dev->poll_fd_write, "", 1) < 0)
+#endif
+			LOG("can't signal the poll fd: %d\n", errno);
+	}
+	else if (!ready && dev->poll_fd_signaled) {
+#ifdef HAVE_EVENTFD
+		uint64_t value;
+		if (read(dev->poll_fd, &value, sizeof(value)) < 0)
+#else
+		char value;
+		if (read(dev->poll_fd, &value, 1) < 0)
+#endif
+			LOG("can't clear the poll fd: %d\n", errno);
+	}
+	dev->poll_fd_signaled = ready;
+}
+
+/* Called once the last transfer of a device is done after
+   dev->shutdown_transfers was set. Wakes hid_close(), and any thread
+   which is waiting on data in hid_read_timeout(). Do this under the
+   mutex to make sure that a thread which is about to go to sleep
+   waiting on the condition actually will go to sleep before the
+   condition is signaled. This should be called with
+   dev->transfer_mutex locked. */
+static void finish_transfer_loop(hid_device *dev)
+{
+	if (dev->report_id_queues)
+		shutdown_report_id_queues(dev->report_id_queues);
+
+	pthread_mutex_lock(&dev->mutex);
+	dev->transfer_loop_finished = 1;
+	pthread_cond_broadcast(&dev->condition);
+	update_poll_fd(dev);
+	pthread_mutex_unlock(&dev->mutex);
+}
+
+static void read_callback(struct libusb_transfer *transfer);
+
+/* Allocates the interrupt IN transfers of a device, each with a buffer
+   of input_ep_max_packet_size bytes.
+   Returns 0 on success and -1 on failure. */
+static int init_input_transfers(hid_device *dev)
+{
+	const size_t length = dev->input_ep_max_packet_size;
+	int i;
+
+	dev->num_transfers = num_input_transfers;
+	dev->transfers = (struct input_transfer*) calloc(dev->num_transfers, sizeof(struct input_transfer));
+	if (!dev->transfers)
+		return -1;
+
+	for (i = 0; i < dev->num_transfers; i++) {
+		struct input_transfer *xfer = &dev->transfers[i];
+		uint8_t *buf = (uint8_t*) malloc(length? length: 1);
+
+		xfer->dev = dev;
+		xfer->transfer = libusb_alloc_transfer(0);
+		if (!buf || !xfer->transfer) {
+			free(buf);
+			return -1;
+		}
+		libusb_fill_interrupt_transfer(xfer->transfer,
+			dev->device_handle,
+			dev->input_endpoint,
+			buf,
+			length,
+			read_callback,
+			xfer,
+			5000/*timeout*/);
+	}
+
+	dev->transfers_in_flight = 0;
+	dev->transfers_idle = dev->num_transfers;
+	dev->next_transfer_to_submit = 0;
+	dev->next_transfer_to_deliver = 0;
+
+	return 0;
+}
+
+static void free_input_transfers(hid_device *dev)
+{
+	int i;
+
+	if (!dev->transfers)
+		return;
+
+	for (i = 0; i < dev->num_transfers; i++) {
+		struct libusb_transfer *transfer = dev->transfers[i].transfer;
+		if (transfer) {
+			free(transfer->buffer);
+			transfer->buffer = NULL;
+			libusb_free_transfer(transfer);
+		}
+	}
+	free(dev->transfers);
+	dev->transfers = NULL;
+}
+
+/* In backpressure mode every submitted transfer needs a free slot in
+   the input ring for its report. Returns 1 if one more transfer can
+   be submitted. This should be called with dev->transfer_mutex locked. */
+static int may_submit_input_transfer(hid_device *dev)
+{
+	size_t pending = dev->num_transfers - dev->transfers_idle;
+	int res = 1;
+
+	/* The reports don't go to the ring */
+	if (dev->input_callback || dev->latest_report_mode || dev->report_id_mode)
+		return 1;
+
+	if (__atomic_load_n(&dev->input_queue_policy, __ATOMIC_RELAXED) != HID_LIBUSB_INPUT_QUEUE_BACKPRESSURE)
+		return 1;
+
+	pthread_mutex_lock(&dev->mutex);
+	if (dev->input_queue_policy == HID_LIBUSB_INPUT_QUEUE_BACKPRESSURE)
+		res = dev->input_ring_size - (dev->input_tail - dev->input_head) > pending;
+	pthread_mutex_unlock(&dev->mutex);
+
+	return res;
+}
+
+/* Submits the idle transfers, in round-robin order.
+   This should be called with dev->transfer_mutex locked. */
+static void submit_input_transfers_locked(hid_device *dev)
+{
+	while (dev->transfers_idle > 0 && !dev->shutdown_transfers) {
+		struct input_transfer *xfer = &dev->transfers[dev->next_transfer_to_submit];
+		int res;
+
+		if (!may_submit_input_transfer(dev)) {
+			/* The input queue is full. The transfer will be
+			   submitted by hid_read_timeout(). */
+			break;
+		}
+
+		res = libusb_submit_transfer(xfer->transfer);
+		if (res != 0) {
+			LOG("Unable to submit URB. libusb error code: %d\n", res);
+			dev->shutdown_transfers = 1;
+			break;
+		}
+
+		dev->next_transfer_to_submit = (dev->next_transfer_to_submit + 1) % dev->num_transfers;
+		__atomic_store_n(&dev->transfers_idle, dev->transfers_idle - 1, __ATOMIC_SEQ_CST);
+		dev->transfers_in_flight++;
+	}
+
+	if (dev->shutdown_transfers && dev->transfers_in_flight == 0 && !dev->transfer_loop_finished)
+		finish_transfer_loop(dev);
+}
+
+static void submit_input_transfers(hid_device *dev)
+{
+	pthread_mutex_lock(&dev->transfer_mutex);
+	submit_input_transfers_locked(dev);
+	pthread_mutex_unlock(&dev->transfer_mutex);
+}
+
+/* Cancels the pending transfers, if any.
+   This should be called with dev->transfer_mutex locked. */
+static void cancel_input_transfers_locked(hid_device *dev)
+{
+	int i;
+
+	for (i = 0; i < dev->num_transfers; i++) {
+		/* This call will fail if the transfer is not pending,
+		   but that's OK. */
+		libusb_cancel_transfer(dev->transfers[i].transfer);
+	}
+	if (dev->transfers_in_flight == 0 && !dev->transfer_loop_finished)
+		finish_transfer_loop(dev);
+}
+
+/* Copies a received report into the tail slot of the input ring.
+   This is called only from read_callback(). It never allocates, and
+   only takes the mutex if the ring is full, is being resized, or a
+   reader may be waiting for this report. */
+static void queue_input_report(hid_device *dev, const uint8_t *data, size_t len, uint64_t timestamp)
+{
+	struct input_report *rpt;
+	size_t head, tail;
+	int locked = 0;
+
+	/* Fast path: there is a free slot, fill it in without the mutex. */
+	__atomic_store_n(&dev->input_ring_busy, 1, __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&dev->input_ring_resizing, __ATOMIC_SEQ_CST)) {
+		tail = __atomic_load_n(&dev->input_tail, __ATOMIC_RELAXED); /* Only written by this thread */
+		head = __atomic_load_n(&dev->input_head, __ATOMIC_SEQ_CST);
+		if (tail - head < dev->input_ring_size) {
+			rpt = &dev->input_reports[tail % dev->input_ring_size];
+			memcpy(rpt->data, data, len);
+			rpt->len = len;
+			rpt->timestamp = timestamp;
+			__atomic_store_n(&dev->input_tail, tail + 1, __ATOMIC_SEQ_CST);
+			__atomic_store_n(&dev->input_ring_busy, 0, __ATOMIC_SEQ_CST);
+			goto queued;
+		}
+		if (dev->input_queue_policy == HID_LIBUSB_INPUT_QUEUE_DROP_NEWEST) {
+			stats_add(&dev->stats.input_reports_dropped, 1);
+			__atomic_store_n(&dev->input_ring_busy, 0, __ATOMIC_SEQ_CST);
+			return;
+		}
+	}
+	__atomic_store_n(&dev->input_ring_busy, 0, __ATOMIC_SEQ_CST);
+
+	/* Slow path: the ring is full or is being resized. Take the mutex,
+	   so that hid_read_timeout() is not copying out of the slot which
+	   is about to be overwritten. */
+	pthread_mutex_lock(&dev->mutex);
+	locked = 1;
+	tail = dev->input_tail;
+	head = dev->input_head;
+	if (tail - head >= dev->input_ring_size) {
+		stats_add(&dev->stats.input_reports_dropped, 1);
+		if (dev->input_queue_policy != HID_LIBUSB_INPUT_QUEUE_DROP_OLDEST ||
+		    dev->input_report_lent) {
+			/* Drop the new report. In backpressure mode this only
+			   happens if the ring was shrunk (or the policy changed)
+			   while the transfer was in flight. The oldest report
+			   can't be dropped while the application borrows it. */
+			pthread_mutex_unlock(&dev->mutex);
+			return;
+		}
+		/* Pop the oldest report off. */
+		head++;
+		__atomic_store_n(&dev->input_head, head, __ATOMIC_SEQ_CST);
+	}
+	rpt = &dev->input_reports[tail % dev->input_ring_size];
+	memcpy(rpt->data, data, len);
+	rpt->len = len;
+	rpt->timestamp = timestamp;
+	__atomic_store_n(&dev->input_tail, tail + 1, __ATOMIC_SEQ_CST);
+
+queued:
+	stats_update_high_water(&dev->stats.input_queue_high_water, tail + 1 - head);
+
+	/* If this is the only report in the ring, a reader may be
+	   sleeping in hid_read_timeout(). Signal it under the mutex, so
+	   that a reader which is about to go to sleep actually will go
+	   to sleep before the condition is signaled. */
+	if (__atomic_load_n(&dev->input_head, __ATOMIC_SEQ_CST) == tail) {
+		if (!locked) {
+			pthread_mutex_lock(&dev->mutex);
+			locked = 1;
+		}
+		if (dev->input_tail - dev->input_head == 1)
+			pthread_cond_signal(&dev->condition);
+	}
+
+	if (locked) {
+		update_poll_fd(dev);
+		pthread_mutex_unlock(&dev->mutex);
+	}
+}
+
+static void read_callback(struct libusb_transfer *transfer)
+{
+	struct input_transfer *xfer = transfer->user_data;
+	hid_device *dev = xfer->dev;
+
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		/* The report is handed over below */
+	}
+	else if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
+		dev->shutdown_transfers = 1;
+	}
+	else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+		dev->shutdown_transfers = 1;
+		stats_add(&dev->stats.input_errors, 1);
+	}
+	else if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
+		//LOG("Timeout (normal)\n");
+		stats_add(&dev->stats.input_idle_timeouts, 1);
+	}
+	else if (transfer->status == LIBUSB_TRANSFER_STALL) {
+		LOG("Transfer stalled\n");
+		stats_add(&dev->stats.input_stalls, 1);
+	}
+	else if (transfer->status == LIBUSB_TRANSFER_OVERFLOW) {
+		LOG("Transfer overflowed\n");
+		stats_add(&dev->stats.input_overflows, 1);
+	}
+	else {
+		LOG("Unknown transfer code: %d\n", transfer->status);
+		stats_add(&dev->stats.input_errors, 1);
+	}
+
+	pthread_mutex_lock(&dev->transfer_mutex);
+	dev->transfers_in_flight--;
+
+	/* Hand the reports over in the order the transfers were
+	   submitted, even if libusb completes them in another order. */
+	xfer->timestamp = monotonic_time_ns();
+	xfer->completed = 1;
+	while (dev->transfers[dev->next_transfer_to_deliver].completed) {
+		struct input_transfer *x = &dev->transfers[dev->next_transfer_to_deliver];
+		struct libusb_transfer *t = x->transfer;
+
+		if (t->status == LIBUSB_TRANSFER_COMPLETED) {
+			stats_add(&dev->stats.input_reports, 1);
+			stats_add(&dev->stats.input_bytes, t->actual_length);
+		}
+
+		if (t->status == LIBUSB_TRANSFER_COMPLETED && dev->input_filter &&
+		    filter_input_report(dev->input_filter, dev->uses_numbered_reports, t->buffer, t->actual_length)) {
+			/* Unchanged, drop it before anyone is woken up */
+			__atomic_fetch_add(&dev->input_reports_suppressed, 1, __ATOMIC_RELAXED);
+		}
+		else if (t->status == LIBUSB_TRANSFER_COMPLETED) {
+			if (dev->input_callback)
+				dev->input_callback(dev, t->buffer, t->actual_length, dev->input_callback_data);
+			else if (dev->latest_report_mode)
+				store_latest_report(dev->latest_reports, dev->uses_numbered_reports, t->buffer, t->actual_length);
+			else if (dev->report_id_mode)
+				queue_report_id_report(dev->report_id_queues, dev->uses_numbered_reports, t->buffer, t->actual_length, x->timestamp, &dev->stats);
+			else
+				queue_input_report(dev, t->buffer, t->actual_length, x->timestamp);
+		}
+
+		x->completed = 0;
+		dev->next_transfer_to_deliver = (dev->next_transfer_to_deliver + 1) % dev->num_transfers;
+		__atomic_store_n(&dev->transfers_idle, dev->transfers_idle + 1, __ATOMIC_SEQ_CST);
+	}
+
+	if (dev->shutdown_transfers) {
+		/* The device is gone or is being closed. Stop the other
+		   transfers too; hid_close() is woken up once the last
+		   one is done. */
+		cancel_input_transfers_locked(dev);
+	}
+	else {
+		/* Re-submit the transfer objects. */
+		submit_input_transfers_locked(dev);
+	}
+	pthread_mutex_unlock(&dev->transfer_mutex);
+}
+
+
+
+static int hidapi_initialize_device(hid_device *dev, const struct libusb_interface_descriptor *intf_desc)
+{
+	int i =0;
+	int res = 0;
+	struct libusb_device_descriptor desc;
+	libusb_get_device_descriptor(libusb_get_device(dev->device_handle), &desc);
+
+#ifdef DETACH_KERNEL_DRIVER
+	/* Detach the kernel driver, but only if the
+	   device is managed by the kernel */
+	dev->is_driver_detached = 0;
+	if (libusb_kernel_driver_active(dev->device_handle, intf_desc->bInterfaceNumber) == 1) {
+		res = libusb_detach_kernel_driver(dev->device_handle, intf_desc->bInterfaceNumber);
+		if (res < 0) {
+			LOG("Unable to detach Kernel Driver\n");
+			return 0;
+		}
+		else {
+			dev->is_driver_detached = 1;
+			LOG("Driver successfully detached from kernel.\n");
+		}
+	}
+#endif
+	res = libusb_claim_interface(dev->device_handle, intf_desc->bInterfaceNumber);
+	if (res < 0) {
+		LOG("can't claim interface %d: %d\n", intf_desc->bInterfaceNumber, res);
+		return 0;
+	}
+
+	/* Store off the string descriptor indexes */
+	dev->manufacturer_index = desc.iManufacturer;
+	dev->product_index      = desc.iProduct;
+	dev->serial_index       = desc.iSerialNumber;
+
+	/* Store off the interface number */
+	dev->interface = intf_desc->bInterfaceNumber;
+
+	dev->input_endpoint = 0;
+	dev->input_ep_max_packet_size = 0;
+	dev->output_endpoint = 0;
+
+	/* Find the INPUT and OUTPUT endpoints. An
+	   OUTPUT endpoint is not required. */
+	for (i = 0; i < intf_desc->bNumEndpoints; i++) {
+		const struct libusb_endpoint_descriptor *ep
+			= &intf_desc->endpoint[i];
+
+		/* Determine the type and direction of this
+		   endpoint. */
+		int is_interrupt =
+			(ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK)
+		      == LIBUSB_TRANSFER_TYPE_INTERRUPT;
+		int is_output =
+			(ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
+		      == LIBUSB_ENDPOINT_OUT;
+		int is_input =
+			(ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
+		      == LIBUSB_ENDPOINT_IN;
+
+		/* Decide whether to use it for input or output. */
+		if (dev->input_endpoint == 0 &&
+		    is_interrupt && is_input) {
+			/* Use this endpoint for INPUT */
+			dev->input_endpoint = ep->bEndpointAddress;
+			dev->input_ep_max_packet_size = ep->wMaxPacketSize;
+		}
+		if (dev->output_endpoint == 0 &&
+		    is_interrupt && is_output) {
+			/* Use this endpoint for OUTPUT */
+			dev->output_endpoint = ep->bEndpointAddress;
+		}
+	}
+
+	if (init_input_reports(dev) < 0 || init_input_transfers(dev) < 0) {
+		LOG("can't allocate the input reports\n");
+		libusb_release_interface(dev->device_handle, intf_desc->bInterfaceNumber);
+		return 0;
+	}
+
+	/* Make the first submissions. Further submissions are made
+	   from inside read_callback(), on the device's event thread. */
+	submit_input_transfers(dev);
+	return 1;
+}
+
+
+hid_device * HID_API_EXPORT hid_open_path(const char *path)
+{
+	hid_device *dev = NULL;
+
+	libusb_device **devs = NULL;
+	libusb_device *usb_dev = NULL;
+	struct usb_path parsed;
+	int res = 0;
+	int d = 0;
+	int good_open = 0;
+
+	if(hid_init() < 0)
+		return NULL;
+
+	if (parse_path(path, &parsed) < 0) {
+		LOG("invalid path %s\n", path);
+		return NULL;
+	}
+
+	dev = new_hid_device();
+
+	/* The device is opened on the context of its event thread. */
+	dev->worker = acquire_event_worker();
+	if (!dev->worker) {
+		free_hid_device(dev);
+		return NULL;
+	}
+
+	/* The path is compared as numbers, without formatting the path
+	   of every device. Only one device can be at its bus and ports. */
+	libusb_get_device_list(dev->worker->context, &devs);
+	while ((usb_dev = devs[d++]) != NULL) {
+		struct libusb_config_descriptor *conf_desc = NULL;
+		int j,k;
+
+		if (!device_matches_path(usb_dev, &parsed))
+			continue;
+
+		if (libusb_get_active_config_descriptor(usb_dev, &conf_desc) < 0)
+			break;
+		if (conf_desc->bConfigurationValue != parsed.config_number) {
+			libusb_free_config_descriptor(conf_desc);
+			break;
+		}
+		for (j = 0; j < conf_desc->bNumInterfaces && !good_open; j++) {
+			const struct libusb_interface *intf = &conf_desc->interface[j];
+			for (k = 0; k < intf->num_altsetting && !good_open; k++) {
+				const struct libusb_interface_descriptor *intf_desc = &intf->altsetting[k];
+				if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID &&
+				    intf_desc->bInterfaceNumber == parsed.interface_number) {
+					/* Matched Paths. Open this device */
+
+					/* OPEN HERE */
+					res = libusb_open(usb_dev, &dev->device_handle);
+					if (res < 0) {
+						LOG("can't open device\n");
+						break;
+					}
+					good_open = hidapi_initialize_device(dev, intf_desc);
+					if (!good_open)
+						libusb_close(dev->device_handle);
+				}
+			}
+		}
+		libusb_free_config_descriptor(conf_desc);
+		break;
+	}
+
+	libusb_free_device_list(devs, 1);
+
+	/* If we have a good handle, return it. */
+	if (good_open) {
+		return dev;
+	}
+	else {
+		/* Unable to open any devices. */
+		free_hid_device(dev);
+		return NULL;
+	}
+}
+
+
+HID_API_EXPORT hid_device * HID_API_CALL hid_libusb_wrap_sys_device(intptr_t sys_dev, int interface_num)
+{
+/* 0x01000107 is a LIBUSB_API_VERSION for 1.0.23 - version when libusb_wrap_sys_device was introduced */
+#if (!defined(HIDAPI_TARGET_LIBUSB_API_VERSION) || HIDAPI_TARGET_LIBUSB_API_VERSION >= 0x01000107) && (LIBUSB_API_VERSION >= 0x01000107)
+	hid_device *dev = NULL;
+	struct libusb_config_descriptor *conf_desc = NULL;
+	const struct libusb_interface_descriptor *selected_intf_desc = NULL;
+	int res = 0;
+	int j = 0, k = 0;
+
+	if(hid_init() < 0)
+		return NULL;
+
+	dev = new_hid_device();
+
+	dev->worker = acquire_event_worker();
+	if (!dev->worker)
+		goto err;
+
+	res = libusb_wrap_sys_device(dev->worker->context, sys_dev, &dev->device_handle);
+	if (res < 0) {
+		LOG("libusb_wrap_sys_device failed: %d %s\n", res, libusb_error_name(res));
+		goto err;
+	}
+
+	res = libusb_get_active_config_descriptor(libusb_get_device(dev->device_handle), &conf_desc);
+	if (res < 0)
+		libusb_get_config_descriptor(libusb_get_device(dev->device_handle), 0, &conf_desc);
+
+	if (!conf_desc) {
+		LOG("Failed to get configuration descriptor: %d %s\n", res, libusb_error_name(res));
+		goto err;
+	}
+
+	/* find matching HID interface */
+	for (j = 0; j < conf_desc->bNumInterfaces && !selected_intf_desc; j++) {
+		const struct libusb_interface *intf = &conf_desc->interface[j];
+		for (k = 0; k < intf->num_altsetting; k++) {
+			const struct libusb_interface_descriptor *intf_desc = &intf->altsetting[k];
+			if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID) {
+				if (interface_num < 0 || interface_num == intf_desc->bInterfaceNumber) {
+					selected_intf_desc = intf_desc;
+					break;
+				}
+			}
+		}
+	}
+
+	if (!selected_intf_desc) {
+		if (interface_num < 0) {
+			LOG("Sys USB device doesn't contain a HID interface\n");
+		}
+		else {
+			LOG("Sys USB device doesn't contain a HID interface with number %d\n", interface_num);
+		}
+		goto err;
+	}
+
+	if (!hidapi_initialize_device(dev, selected_intf_desc))
+		goto err;
+
+	return dev;
+
+err:
+	if (conf_desc)
+		libusb_free_config_descriptor(conf_desc);
+	if (dev->device_handle)
+		libusb_close(dev->device_handle);
+	free_hid_device(dev);
+#else
+	(void)sys_dev;
+	(void)interface_num;
+	LOG("libusb_wrap_sys_device is not available\n");
+#endif
+	return NULL;
+}
+
+
+static int write_output_report(hid_device *dev, const unsigned char *data, size_t length)
+{
+	int res;
+	int report_number;
+	int skipped_report_id = 0;
+
+	if (!data || (length ==0)) {
+		return -1;
+	}
+
+	report_number = data[0];
+
+	if (report_number == 0x0) {
+		data++;
+		length--;
+		skipped_report_id = 1;
+	}
+
+
+	if (dev->output_endpoint <= 0) {
+		/* No interrupt out endpoint. Use the Control Endpoint */
+		res = libusb_control_transfer(dev->device_handle,
+			LIBUSB_REQUEST_TYPE_CLASS|LIBUSB_RECIPIENT_INTERFACE|LIBUSB_ENDPOINT_OUT,
+			0x09/*HID Set_Report*/,
+			(2/*HID output*/ << 8) | report_number,
+			dev->interface,
+			(unsigned char *)data, length,
+			1000/*timeout millis*/);
+
+		if (res < 0)
+			return -1;
+
+		if (skipped_report_id)
+			length++;
+
+		return length;
+	}
+	else {
+		/* Use the interrupt out endpoint */
+		int actual_length;
+		res = libusb_interrupt_transfer(dev->device_handle,
+			dev->output_endpoint,
+			(unsigned char*)data,
+			length,
+			&actual_length, 1000);
+
+		if (res < 0)
+			return -1;
+
+		if (skipped_report_id)
+			actual_length++;
+
+		return actual_length;
+	}
+}
+
+/* Counts a written Output report (or a failed write, if res is
+   negative) into the statistics of a device. */
+static void count_output_report(hid_device *dev, int res, uint64_t latency_ns)
+{
+	if (res < 0) {
+		stats_add(&dev->stats.output_errors, 1);
+		return;
+	}
+	stats_add(&dev->stats.output_reports, 1);
+	stats_add(&dev->stats.output_bytes, (size_t) res);
+	stats_add_latency(dev->stats.write_latency, latency_ns);
+}
+
+int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length)
+{
+	uint64_t start = monotonic_time_ns();
+	int res = write_output_report(dev, data, length);
+
+	count_output_report(dev, res, monotonic_time_ns() - start);
+	return res;
+}
+
+/* Allocates the pool of output transfers of a device, if it isn't
+   yet. This should be called with dev->output_mutex locked.
+   Returns 0 on success and -1 on failure. */
+static int init_output_transfers(hid_device *dev)
+{
+	int i;
+
+	if (dev->output_transfers)
+		return 0;
+
+	dev->output_transfers = (struct output_transfer*) calloc(OUTPUT_TRANSFER_POOL_SIZE, sizeof(struct output_transfer));
+	if (!dev->output_transfers)
+		return -1;
+
+	for (i = 0; i < OUTPUT_TRANSFER_POOL_SIZE; i++) {
+		struct output_transfer *xfer = &dev->output_transfers[i];
+
+		xfer->dev = dev;
+		xfer->transfer = libusb_alloc_transfer(0);
+		if (!xfer->transfer) {
+			free_output_transfers(dev);
+			return -1;
+		}
+		xfer->next = dev->free_output_transfers;
+		dev->free_output_transfers = xfer;
+	}
+
+	return 0;
+}
+
+static void free_output_transfers(hid_device *dev)
+{
+	int i;
+
+	if (!dev->output_transfers)
+		return;
+
+	for (i = 0; i < OUTPUT_TRANSFER_POOL_SIZE; i++) {
+		libusb_free_transfer(dev->output_transfers[i].transfer);
+		free(dev->output_transfers[i].buffer);
+	}
+	free(dev->output_transfers);
+	dev->output_transfers = NULL;
+	dev->free_output_transfers = NULL;
+}
+
+/* Gives an output transfer back to the pool, and wakes up
+   hid_libusb_write_async() and hid_libusb_flush(). */
+static void put_output_transfer(hid_device *dev, struct output_transfer *xfer)
+{
+	pthread_mutex_lock(&dev->output_mutex);
+	xfer->next = dev->free_output_transfers;
+	dev->free_output_transfers = xfer;
+	dev->output_transfers_in_flight--;
+	pthread_cond_broadcast(&dev->output_condition);
+	pthread_mutex_unlock(&dev->output_mutex);
+}
+
+static void write_callback(struct libusb_transfer *transfer)
+{
+	struct output_transfer *xfer = transfer->user_data;
+	int res = -1;
+
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		res = transfer->actual_length;
+		if (xfer->skipped_report_id)
+			res++;
+	}
+	else {
+		LOG("write_callback(): transfer status %d\n", transfer->status);
+	}
+	count_output_report(xfer->dev, res, monotonic_time_ns() - xfer->submitted);
+
+	if (xfer->callback)
+		xfer->callback(xfer->dev, res, xfer->user_data);
+
+	put_output_transfer(xfer->dev, xfer);
+}
+
+/* Cancels the output transfers in flight, and waits for them to
+   complete. */
+static void cancel_output_transfers(hid_device *dev)
+{
+	int i;
+
+	pthread_mutex_lock(&dev->output_mutex);
+	if (dev->output_transfers) {
+		for (i = 0; i < OUTPUT_TRANSFER_POOL_SIZE; i++) {
+			/* This call will fail if the transfer is not pending,
+			   but that's OK. */
+			libusb_cancel_transfer(dev->output_transfers[i].transfer);
+		}
+	}
+	while (dev->output_transfers_in_flight > 0)
+		pthread_cond_wait(&dev->output_condition, &dev->output_mutex);
+	pthread_mutex_unlock(&dev->output_mutex);
+}
+
+int HID_API_EXPORT_CALL hid_libusb_write_async(hid_device *dev, const unsigned char *data, size_t length, hid_libusb_write_callback callback, void *user_data)
+{
+	struct output_transfer *xfer;
+	int report_number;
+	int skipped_report_id = 0;
+	size_t buffer_size;
+	int res;
+
+	if (!data || (length ==0)) {
+		return -1;
+	}
+
+	report_number = data[0];
+
+	if (report_number == 0x0) {
+		data++;
+		length--;
+		skipped_report_id = 1;
+	}
+
+	/* Take a free transfer, waiting for one if they are all in flight. */
+	pthread_mutex_lock(&dev->output_mutex);
+	if (init_output_transfers(dev) < 0) {
+		LOG("can't allocate the output transfers\n");
+		pthread_mutex_unlock(&dev->output_mutex);
+		return -1;
+	}
+	while (!dev->free_output_transfers)
+		pthread_cond_wait(&dev->output_condition, &dev->output_mutex);
+	xfer = dev->free_output_transfers;
+	dev->free_output_transfers = xfer->next;
+	dev->output_transfers_in_flight++;
+	pthread_mutex_unlock(&dev->output_mutex);
+
+	buffer_size = length;
+	if (dev->output_endpoint <= 0)
+		buffer_size += LIBUSB_CONTROL_SETUP_SIZE;
+	if (xfer->buffer_size < buffer_size) {
+		uint8_t *buffer = (uint8_t*) realloc(xfer->buffer, buffer_size);
+		if (!buffer) {
+			put_output_transfer(dev, xfer);
+			return -1;
+		}
+		xfer->buffer = buffer;
+		xfer->buffer_size = buffer_size;
+	}
+
+	xfer->skipped_report_id = skipped_report_id;
+	xfer->callback = callback;
+	xfer->user_data = user_data;
+
+	if (dev->output_endpoint <= 0) {
+		/* No interrupt out endpoint. Use the Control Endpoint */
+		libusb_fill_control_setup(xfer->buffer,
+			LIBUSB_REQUEST_TYPE_CLASS|LIBUSB_RECIPIENT_INTERFACE|LIBUSB_ENDPOINT_OUT,
+			0x09/*HID Set_Report*/,
+			(2/*HID output*/ << 8) | report_number,
+			dev->interface,
+			length);
+		memcpy(xfer->buffer + LIBUSB_CONTROL_SETUP_SIZE, data, length);
+		libusb_fill_control_transfer(xfer->transfer,
+			dev->device_handle,
+			xfer->buffer,
+			write_callback,
+			xfer,
+			1000/*timeout millis*/);
+	}
+	else {
+		/* Use the interrupt out endpoint */
+		memcpy(xfer->buffer, data, length);
+		libusb_fill_interrupt_transfer(xfer->transfer,
+			dev->device_handle,
+			dev->output_endpoint,
+			xfer->buffer,
+			length,
+			write_callback,
+			xfer,
+			1000/*timeout millis*/);
+	}
+
+	xfer->submitted = monotonic_time_ns();
+	res = libusb_submit_transfer(xfer->transfer);
+	if (res < 0) {
+		LOG("Unable to submit the output transfer. libusb error code: %d\n", res);
+		count_output_report(dev, -1, 0);
+		put_output_transfer(dev, xfer);
+		return -1;
+	}
+
+	if (skipped_report_id)
+		length++;
+
+	return length;
+}
+
+int HID_API_EXPORT_CALL hid_libusb_flush(hid_device *dev, int milliseconds)
+{
+	int res = 0;
+
+	pthread_mutex_lock(&dev->output_mutex);
+
+	if (milliseconds == -1) {
+		while (dev->output_transfers_in_flight > 0 && res == 0)
+			res = pthread_cond_wait(&dev->output_condition, &dev->output_mutex);
+	}
+	else {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += milliseconds / 1000;
+		ts.tv_nsec += (milliseconds % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+
+		while (dev->output_transfers_in_flight > 0 && res == 0)
+			res = pthread_cond_timedwait(&dev->output_condition, &dev->output_mutex, &ts);
+	}
+
+	pthread_mutex_unlock(&dev->output_mutex);
+
+	return res == 0? 0: -1;
+}
+
+/* Helper function, to simplify hid_read().
+   This should be called with dev->mutex locked, and only when the
+   input ring is not empty. */
+static int return_data(hid_device *dev, unsigned char *data, size_t length, uint64_t *timestamp)
+{
+	/* Copy the data out of the head slot of the ring (rpt) into the
+	   return buffer (data), and release the slot to read_callback(). */
+	size_t head = dev->input_head;
+	struct input_report *rpt = &dev->input_reports[head % dev->input_ring_size];
+	size_t len = (length < rpt->len)? length: rpt->len;
+	if (len > 0)
+		memcpy(data, rpt->data, len);
+	if (timestamp)
+		*timestamp = rpt->timestamp;
+	stats_add_latency(dev->stats.read_latency, monotonic_time_ns() - rpt->timestamp);
+	__atomic_store_n(&dev->input_head, head + 1, __ATOMIC_SEQ_CST);
+	return len;
+}
+
+static void cleanup_mutex(void *param)
+{
+	hid_device *dev = param;
+	pthread_mutex_unlock(&dev->mutex);
+}
+
+
+/* Waits for the input ring not to be empty, for up to milliseconds,
+   or for ever if milliseconds is -1. Returns 1 if there is a report
+   to return, 0 on timeout and -1 on error or disconnection.
+   This should be called with dev->mutex locked. */
+static int wait_for_input_reports(hid_device *dev, int milliseconds)
+{
+	/* There's an input report queued up. Return it. */
+	if (!input_reports_empty(dev))
+		return 1;
+
+	if (dev->shutdown_transfers) {
+		/* This means the device has been disconnected.
+		   An error code of -1 should be returned. */
+		return -1;
+	}
+
+	if (milliseconds == -1) {
+		/* Blocking */
+		while (input_reports_empty(dev) && !dev->shutdown_transfers) {
+			pthread_cond_wait(&dev->condition, &dev->mutex);
+		}
+	}
+	else if (milliseconds > 0) {
+		/* Non-blocking, but called with timeout. */
+		int res;
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += milliseconds / 1000;
+		ts.tv_nsec += (milliseconds % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+
+		while (input_reports_empty(dev) && !dev->shutdown_transfers) {
+			res = pthread_cond_timedwait(&dev->condition, &dev->mutex, &ts);
+			if (res == ETIMEDOUT) {
+				/* Timed out. */
+				return 0;
+			}
+			else if (res != 0) {
+				/* Error. */
+				return -1;
+			}
+
+			/* If we're here, there was a report, a spurious wake
+			   up or the transfers were shut down. Run the loop
+			   again to find out. */
+		}
+	}
+	else {
+		/* Purely non-blocking */
+		return 0;
+	}
+
+	return input_reports_empty(dev)? -1: 1;
+}
+
+/* In backpressure mode some transfers may wait for a free slot
+   in the input ring. Returns 1 if they should be submitted after a
+   read. This should be called with dev->mutex locked. */
+static int should_resume_transfers(hid_device *dev)
+{
+	return dev->input_queue_policy == HID_LIBUSB_INPUT_QUEUE_BACKPRESSURE &&
+	       __atomic_load_n(&dev->transfers_idle, __ATOMIC_SEQ_CST) > 0;
+}
+
+/* Implements hid_read_timeout() and hid_read_timestamped(). The
+   timestamp is only returned if it's not NULL. */
+static int read_timeout(hid_device *dev, unsigned char *data, size_t length, uint64_t *timestamp, int milliseconds)
+{
+#if 0
+	int transferred;
+	int res = libusb_interrupt_transfer(dev->device_handle, dev->input_endpoint, data, length, &transferred, 5000);
+	LOG("transferred: %d\n", transferred);
+	return transferred;
+#endif
+	/* by initialising this variable right here, GCC gives a compilation warning/error: */
+	/* error: variable ‘bytes_read’ might be clobbered by ‘longjmp’ or ‘vfork’ [-Werror=clobbered] */
+	int bytes_read; /* = -1; */
+	int resume_transfers;
+
+	pthread_mutex_lock(&dev->mutex);
+	pthread_cleanup_push(&cleanup_mutex, dev);
+
+	if (dev->input_report_lent) {
+		/* hid_read_release() must be called first. */
+		bytes_read = -1;
+	}
+	else {
+		bytes_read = wait_for_input_reports(dev, milliseconds);
+		if (bytes_read > 0) {
+			/* Return the first one */
+			bytes_read = return_data(dev, data, length, timestamp);
+		}
+	}
+
+	update_poll_fd(dev);
+	resume_transfers = should_resume_transfers(dev);
+	pthread_mutex_unlock(&dev->mutex);
+	pthread_cleanup_pop(0);
+
+	if (resume_transfers)
+		submit_input_transfers(dev);
+
+	return bytes_read;
+}
+
+int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+{
+	return read_timeout(dev, data, length, NULL, milliseconds);
+}
+
+int HID_API_EXPORT hid_read_timestamped(hid_device *dev, unsigned char *data, size_t length, uint64_t *timestamp_ns, int milliseconds)
+{
+	if (!timestamp_ns)
+		return -1;
+
+	return read_timeout(dev, data, length, timestamp_ns, milliseconds);
+}
+
+int HID_API_EXPORT hid_read_batch(hid_device *dev, unsigned char *data, size_t stride, size_t max_reports, size_t *lengths, int milliseconds)
+{
+	/* Same as bytes_read in hid_read_timeout() */
+	int reports_read; /* = -1; */
+	int resume_transfers;
+
+	if (!data || !lengths || max_reports == 0)
+		return -1;
+
+	if (max_reports > INT_MAX)
+		max_reports = INT_MAX;
+
+	pthread_mutex_lock(&dev->mutex);
+	pthread_cleanup_push(&cleanup_mutex, dev);
+
+	/* Wait once, then take every report which is queued up. */
+	if (dev->input_report_lent)
+		reports_read = -1;
+	else
+		reports_read = wait_for_input_reports(dev, milliseconds);
+	if (reports_read > 0) {
+		reports_read = 0;
+		while (!input_reports_empty(dev) && (size_t) reports_read < max_reports) {
+			lengths[reports_read] = return_data(dev, data + reports_read * stride, stride, NULL);
+			reports_read++;
+		}
+	}
+
+	update_poll_fd(dev);
+	resume_transfers = should_resume_transfers(dev);
+	pthread_mutex_unlock(&dev->mutex);
+	pthread_cleanup_pop(0);
+
+	if (resume_transfers)
+		submit_input_transfers(dev);
+
+	return reports_read;
+}
+
+int HID_API_EXPORT hid_read_acquire(hid_device *dev, const unsigned char **data, size_t *length, int milliseconds)
+{
+	/* Same as bytes_read in hid_read_timeout() */
+	int res; /* = -1; */
+
+	if (!data || !length)
+		return -1;
+
+	pthread_mutex_lock(&dev->mutex);
+	pthread_cleanup_push(&cleanup_mutex, dev);
+
+	if (dev->input_report_lent)
+		res = -1;
+	else
+		res = wait_for_input_reports(dev, milliseconds);
+	if (res > 0) {
+		/* Lend the head slot out. It stays in the ring (and in
+		   use) until hid_read_release(). */
+		struct input_report *rpt = &dev->input_reports[dev->input_head % dev->input_ring_size];
+		dev->input_report_lent = rpt->data;
+		*data = rpt->data;
+		*length = rpt->len;
+		stats_add_latency(dev->stats.read_latency, monotonic_time_ns() - rpt->timestamp);
+	}
+
+	pthread_mutex_unlock(&dev->mutex);
+	pthread_cleanup_pop(0);
+
+	return res;
+}
+
+int HID_API_EXPORT hid_read_release(hid_device *dev, const unsigned char *data)
+{
+	int resume_transfers;
+
+	pthread_mutex_lock(&dev->mutex);
+
+	if (!data || data != dev->input_report_lent) {
+		pthread_mutex_unlock(&dev->mutex);
+		return -1;
+	}
+
+	dev->input_report_lent = NULL;
+	__atomic_store_n(&dev->input_head, dev->input_head + 1, __ATOMIC_SEQ_CST);
+
+	update_poll_fd(dev);
+	resume_transfers = should_resume_transfers(dev);
+	pthread_mutex_unlock(&dev->mutex);
+
+	if (resume_transfers)
+		submit_input_transfers(dev);
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
+{
+	return hid_read_timeout(dev, data, length, dev->blocking ? -1 : 0);
+}
+
+int HID_API_EXPORT hid_get_poll_fd(hid_device *dev)
+{
+	int fd;
+
+	pthread_mutex_lock(&dev->mutex);
+
+	if (dev->poll_fd < 0) {
+#ifdef HAVE_EVENTFD
+		dev->poll_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		dev->poll_fd_write = dev->poll_fd;
+#else
+		int fds[2];
+		if (pipe(fds) == 0) {
+			fcntl(fds[0], F_SETFL, O_NONBLOCK);
+			fcntl(fds[1], F_SETFL, O_NONBLOCK);
+			fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+			fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+			dev->poll_fd = fds[0];
+			dev->poll_fd_write = fds[1];
+		}
+#endif
+		if (dev->poll_fd < 0)
+			LOG("can't create the poll fd: %d\n", errno);
+
+		/* Reports may be queued already. */
+		dev->poll_fd_signaled = 0;
+		update_poll_fd(dev);
+	}
+	fd = dev->poll_fd;
+
+	pthread_mutex_unlock(&dev->mutex);
+
+	return fd;
+}
+
+int HID_API_EXPORT hid_poll(hid_device **devs, int n, int *ready, int timeout_ms)
+{
+	const char *error;
+
+	return poll_devices(devs, n, ready, timeout_ms, &error);
+}
+
+int HID_API_EXPORT hid_set_input_callback(hid_device *dev, hid_input_callback callback, void *user_data)
+{
+	/* read_callback() calls the callback with the transfer_mutex
+	   held, so once it is taken here the previous one has returned. */
+	pthread_mutex_lock(&dev->transfer_mutex);
+	dev->input_callback = callback;
+	dev->input_callback_data = user_data;
+	pthread_mutex_unlock(&dev->transfer_mutex);
+
+	return 0;
+}
+
+/* Gets the sizes of the Input reports of a device from its report
+   descriptor, and whether it uses numbered reports. */
+static int get_device_input_report_sizes(hid_device *dev, size_t *sizes, int *numbered)
+{
+	const struct hid_report_field *fields;
+	int num_fields;
+
+	num_fields = hid_get_report_fields(dev, &fields);
+	if (num_fields < 0)
+		return -1;
+
+	*numbered = get_input_report_sizes(fields, num_fields, sizes);
+	return 0;
+}
+
+int HID_API_EXPORT hid_set_latest_report_mode(hid_device *dev, int enable)
+{
+	int numbered = dev->uses_numbered_reports;
+
+	if (enable && !dev->latest_reports) {
+		size_t sizes[256];
+		struct latest_report *reports;
+		unsigned char *buffer;
+
+		if (get_device_input_report_sizes(dev, sizes, &numbered) < 0)
+			return -1;
+		if (alloc_latest_reports(sizes, &reports, &buffer) < 0)
+			return -1;
+		dev->latest_report_buffer = buffer;
+		__atomic_store_n(&dev->latest_reports, reports, __ATOMIC_RELEASE);
+	}
+
+	/* read_callback() stores the reports with the transfer_mutex
+	   held. The transfers held back by a full ring in backpressure
+	   mode can go again once the ring is bypassed. */
+	pthread_mutex_lock(&dev->transfer_mutex);
+	dev->uses_numbered_reports = numbered;
+	dev->latest_report_mode = enable ? 1 : 0;
+	if (enable)
+		submit_input_transfers_locked(dev);
+	pthread_mutex_unlock(&dev->transfer_mutex);
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_get_latest_report(hid_device *dev, unsigned char report_id, unsigned char *data, size_t length, size_t *sequence)
+{
+	struct latest_report *reports = __atomic_load_n(&dev->latest_reports, __ATOMIC_ACQUIRE);
+
+	if (!reports || !data || reports[report_id].size == 0)
+		return -1;
+
+	return read_latest_report(&reports[report_id], data, length, sequence);
+}
+
+int HID_API_EXPORT hid_set_report_id_queues(hid_device *dev, int enable)
+{
+	int numbered = dev->uses_numbered_reports;
+
+	if (enable && !dev->report_id_queues) {
+		size_t sizes[256];
+		struct report_id_queue **queues;
+
+		if (get_device_input_report_sizes(dev, sizes, &numbered) < 0)
+			return -1;
+		queues = alloc_report_id_queues(sizes);
+		if (!queues)
+			return -1;
+		__atomic_store_n(&dev->report_id_queues, queues, __ATOMIC_RELEASE);
+	}
+
+	/* Like hid_set_latest_report_mode() */
+	pthread_mutex_lock(&dev->transfer_mutex);
+	dev->uses_numbered_reports = numbered;
+	dev->report_id_mode = enable ? 1 : 0;
+	if (enable) {
+		if (dev->transfer_loop_finished)
+			shutdown_report_id_queues(dev->report_id_queues);
+		submit_input_transfers_locked(dev);
+	}
+	pthread_mutex_unlock(&dev->transfer_mutex);
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_read_report_id(hid_device *dev, unsigned char report_id, unsigned char *data, size_t length, int milliseconds)
+{
+	struct report_id_queue **queues = __atomic_load_n(&dev->report_id_queues, __ATOMIC_ACQUIRE);
+
+	if (!queues || !data || !queues[report_id])
+		return -1;
+
+	return read_report_id_queue(queues[report_id], data, length, milliseconds, &dev->stats);
+}
+
+int HID_API_EXPORT hid_set_input_change_filter(hid_device *dev, int enable, const unsigned char *mask, size_t mask_length)
+{
+	struct input_filter *filter = NULL;
+	int numbered = dev->uses_numbered_reports;
+
+	if (enable) {
+		size_t sizes[256];
+
+		if (get_device_input_report_sizes(dev, sizes, &numbered) < 0)
+			return -1;
+		filter = alloc_input_filter(sizes, mask, mask_length);
+		if (!filter)
+			return -1;
+	}
+
+	/* read_callback() filters the reports with the transfer_mutex
+	   held, so the previous filter can be freed once it is taken. */
+	pthread_mutex_lock(&dev->transfer_mutex);
+	dev->uses_numbered_reports = numbered;
+	free(dev->input_filter);
+	dev->input_filter = filter;
+	pthread_mutex_unlock(&dev->transfer_mutex);
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_get_input_reports_suppressed(hid_device *dev, size_t *suppressed)
+{
+	if (!suppressed)
+		return -1;
+
+	*suppressed = __atomic_load_n(&dev->input_reports_suppressed, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int HID_API_EXPORT hid_get_stats(hid_device *dev, struct hid_stats *stats)
+{
+	if (!stats)
+		return -1;
+
+	read_device_stats(&dev->stats, stats);
+	stats->input_reports_suppressed = __atomic_load_n(&dev->input_reports_suppressed, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
+{
+	dev->blocking = !nonblock;
+
+	return 0;
+}
 
-HID_API_EXPORT hid_device * HID_API_CALL hid_libusb_wrap_sys_device(intptr_t sys_dev, int interface_num)
+int HID_API_EXPORT_CALL hid_libusb_set_input_queue_policy(hid_device *dev, size_t depth, enum hid_libusb_input_queue_policy policy)
 {
-/* 0x01000107 is a LIBUSB_API_VERSION for 1.0.23 - version when libusb_wrap_sys_device was introduced */
-#if (!defined(HIDAPI_TARGET_LIBUSB_API_VERSION) || HIDAPI_TARGET_LIBUSB_API_VERSION >= 0x01000107) && (LIBUSB_API_VERSION >= 0x01000107)
-	hid_device *dev = NULL;
-	struct libusb_config_descriptor *conf_desc = NULL;
-	const struct libusb_interface_descriptor *selected_intf_desc = NULL;
-	int res = 0;
-	int j = 0, k = 0;
-
-	if(hid_init() < 0)
-		return NULL;
+	struct input_report *reports, *old_reports;
+	uint8_t *buffer, *old_buffer;
+	size_t queued, i;
 
-	dev = new_hid_device();
+	if (!dev || depth == 0)
+		return -1;
 
-	res = libusb_wrap_sys_device(usb_context, sys_dev, &dev->device_handle);
-	if (res < 0) {
-		LOG("libusb_wrap_sys_device failed: %d %s\n", res, libusb_error_name(res));
-		goto err;
+	switch (policy) {
+		case HID_LIBUSB_INPUT_QUEUE_DROP_OLDEST:
+		case HID_LIBUSB_INPUT_QUEUE_DROP_NEWEST:
+		case HID_LIBUSB_INPUT_QUEUE_BACKPRESSURE:
+			break;
+		default:
+			return -1;
 	}
 
-	res = libusb_get_active_config_descriptor(libusb_get_device(dev->device_handle), &conf_desc);
-	if (res < 0)
-		libusb_get_config_descriptor(libusb_get_device(dev->device_handle), 0, &conf_desc);
+	if (alloc_input_reports(depth, dev->input_ep_max_packet_size, &reports, &buffer) < 0)
+		return -1;
 
-	if (!conf_desc) {
-		LOG("Failed to get configuration descriptor: %d %s\n", res, libusb_error_name(res));
-		goto err;
-	}
+	pthread_mutex_lock(&dev->mutex);
 
-	/* find matching HID interface */
-	for (j = 0; j < conf_desc->bNumInterfaces && !selected_intf_desc; j++) {
-		const struct libusb_interface *intf = &conf_desc->interface[j];
-		for (k = 0; k < intf->num_altsetting; k++) {
-			const struct libusb_interface_descriptor *intf_desc = &intf->altsetting[k];
-			if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID) {
-				if (interface_num < 0 || interface_num == intf_desc->bInterfaceNumber) {
-					selected_intf_desc = intf_desc;
-					break;
-				}
-			}
-		}
+	if (dev->input_report_lent) {
+		/* The lent report lives in the ring which would be freed. */
+		pthread_mutex_unlock(&dev->mutex);
+		free(reports);
+		free(buffer);
+		return -1;
 	}
 
-	if (!selected_intf_desc) {
-		if (interface_num < 0) {
-			LOG("Sys USB device doesn't contain a HID interface\n");
-		}
-		else {
-			LOG("Sys USB device doesn't contain a HID interface with number %d\n", interface_num);
-		}
-		goto err;
+	/* Keep read_callback() out of the ring while it is replaced. */
+	__atomic_store_n(&dev->input_ring_resizing, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&dev->input_ring_busy, __ATOMIC_SEQ_CST))
+		sched_yield();
+
+	/* Move the queued reports over, keeping the newest ones. */
+	queued = dev->input_tail - dev->input_head;
+	if (queued > depth) {
+		stats_add(&dev->stats.input_reports_dropped, queued - depth);
+		dev->input_head += queued - depth;
+		queued = depth;
+	}
+	for (i = 0; i < queued; i++) {
+		struct input_report *rpt = &dev->input_reports[(dev->input_head + i) % dev->input_ring_size];
+		memcpy(reports[i].data, rpt->data, rpt->len);
+		reports[i].len = rpt->len;
+		reports[i].timestamp = rpt->timestamp;
 	}
 
-	if (!hidapi_initialize_device(dev, selected_intf_desc))
-		goto err;
+	old_reports = dev->input_reports;
+	old_buffer = dev->input_report_buffer;
+	dev->input_reports = reports;
+	dev->input_report_buffer = buffer;
+	dev->input_ring_size = depth;
+	__atomic_store_n(&dev->input_head, 0, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&dev->input_tail, queued, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&dev->input_queue_policy, policy, __ATOMIC_RELAXED);
 
-	return dev;
+	__atomic_store_n(&dev->input_ring_resizing, 0, __ATOMIC_SEQ_CST);
 
-err:
-	if (conf_desc)
-		libusb_free_config_descriptor(conf_desc);
-	if (dev->device_handle)
-		libusb_close(dev->device_handle);
-	free_hid_device(dev);
-#else
-	(void)sys_dev;
-	(void)interface_num;
-	LOG("libusb_wrap_sys_device is not available\n");
-#endif
-	return NULL;
-}
+	if (queued)
+		pthread_cond_signal(&dev->condition);
+	update_poll_fd(dev);
 
+	pthread_mutex_unlock(&dev->mutex);
 
-int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length)
-{
-	int res;
-	int report_number;
-	int skipped_report_id = 0;
+	free(old_reports);
+	free(old_buffer);
 
-	if (!data || (length ==0)) {
-		return -1;
-	}
+	/* Submit the transfers which waited for a free slot, if the new
+	   ring has room or the new policy is not backpressure. */
+	submit_input_transfers(dev);
 
-	report_number = data[0];
+	return 0;
+}
 
-	if (report_number == 0x0) {
-		data++;
-		length--;
-		skipped_report_id = 1;
-	}
+int HID_API_EXPORT_CALL hid_libusb_set_input_transfers(int count)
+{
+	if (count < 1 || count > MAX_INPUT_TRANSFERS)
+		return -1;
 
+	num_input_transfers = count;
 
-	if (dev->output_endpoint <= 0) {
-		/* No interrupt out endpoint. Use the Control Endpoint */
-		res = libusb_control_transfer(dev->device_handle,
-			LIBUSB_REQUEST_TYPE_CLASS|LIBUSB_RECIPIENT_INTERFACE|LIBUSB_ENDPOINT_OUT,
-			0x09/*HID Set_Report*/,
-			(2/*HID output*/ << 8) | report_number,
-			dev->interface,
-			(unsigned char *)data, length,
-			1000/*timeout millis*/);
+	return 0;
+}
 
-		if (res < 0)
-			return -1;
+int HID_API_EXPORT_CALL hid_libusb_get_input_transfers(void)
+{
+	return num_input_transfers;
+}
 
-		if (skipped_report_id)
-			length++;
+int HID_API_EXPORT_CALL hid_libusb_set_event_threads(int count)
+{
+	if (count < 1 || count > MAX_EVENT_THREADS)
+		return -1;
 
-		return length;
-	}
-	else {
-		/* Use the interrupt out endpoint */
-		int actual_length;
-		res = libusb_interrupt_transfer(dev->device_handle,
-			dev->output_endpoint,
-			(unsigned char*)data,
-			length,
-			&actual_length, 1000);
+	pthread_mutex_lock(&event_workers_mutex);
+	num_event_threads = count;
+	pthread_mutex_unlock(&event_workers_mutex);
 
-		if (res < 0)
-			return -1;
+	return 0;
+}
 
-		if (skipped_report_id)
-			actual_length++;
+int HID_API_EXPORT_CALL hid_libusb_get_event_threads(void)
+{
+	int count;
 
-		return actual_length;
-	}
+	pthread_mutex_lock(&event_workers_mutex);
+	count = num_event_threads;
+	pthread_mutex_unlock(&event_workers_mutex);
+
+	return count;
 }
 
-/* Helper function, to simplify hid_read().
-   This should be called with dev->mutex locked. */
-static int return_data(hid_device *dev, unsigned char *data, size_t length)
+int HID_API_EXPORT_CALL hid_libusb_set_enumerate_strings(int enable)
 {
-	/* Copy the data out of the linked list item (rpt) into the
-	   return buffer (data), and delete the liked list item. */
-	struct input_report *rpt = dev->input_reports;
-	size_t len = (length < rpt->len)? length: rpt->len;
-	if (len > 0)
-		memcpy(data, rpt->data, len);
-	dev->input_reports = rpt->next;
-	free(rpt->data);
-	free(rpt);
-	return len;
+	enumerate_strings = enable ? 1 : 0;
+
+	return 0;
 }
 
-static void cleanup_mutex(void *param)
+int HID_API_EXPORT_CALL hid_libusb_get_enumerate_strings(void)
 {
-	hid_device *dev = param;
-	pthread_mutex_unlock(&dev->mutex);
+	return enumerate_strings;
 }
 
+/* Find the device which has a HID interface with the given path, and
+   return it with an extra reference, or NULL. */
+static libusb_device *find_device_by_path(libusb_device **devs, const char *path)
+{
+	libusb_device *usb_dev;
+	libusb_device *found = NULL;
+	int d = 0;
+
+	while ((usb_dev = devs[d++]) != NULL && !found) {
+		struct libusb_config_descriptor *conf_desc = NULL;
+		int j, k;
 
-int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+		if (libusb_get_active_config_descriptor(usb_dev, &conf_desc) < 0)
+			continue;
+		for (j = 0; j < conf_desc->bNumInterfaces && !found; j++) {
+			const struct libusb_interface *intf = &conf_desc->interface[j];
+			for (k = 0; k < intf->num_altsetting && !found; k++) {
+				const struct libusb_interface_descriptor *intf_desc = &intf->altsetting[k];
+				if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID) {
+					char *dev_path = make_path(usb_dev, intf_desc->bInterfaceNumber, conf_desc->bConfigurationValue);
+					if (!strcmp(dev_path, path))
+						found = libusb_ref_device(usb_dev);
+					free(dev_path);
+				}
+			}
+		}
+		libusb_free_config_descriptor(conf_desc);
+	}
+
+	return found;
+}
+
+int HID_API_EXPORT_CALL hid_libusb_resolve_strings(struct hid_device_info *info)
 {
-#if 0
-	int transferred;
-	int res = libusb_interrupt_transfer(dev->device_handle, dev->input_endpoint, data, length, &transferred, 5000);
-	LOG("transferred: %d\n", transferred);
-	return transferred;
-#endif
-	/* by initialising this variable right here, GCC gives a compilation warning/error: */
-	/* error: variable ‘bytes_read’ might be clobbered by ‘longjmp’ or ‘vfork’ [-Werror=clobbered] */
-	int bytes_read; /* = -1; */
+	libusb_device **devs = NULL;
+	libusb_device *usb_dev;
+	libusb_device_handle *handle;
+	struct libusb_device_descriptor desc;
+	struct usb_string_cache strings;
+	int res;
 
-	pthread_mutex_lock(&dev->mutex);
-	pthread_cleanup_push(&cleanup_mutex, dev);
+	if (!info || !info->path)
+		return -1;
 
-	bytes_read = -1;
+	if(hid_init() < 0)
+		return -1;
 
-	/* There's an input report queued up. Return it. */
-	if (dev->input_reports) {
-		/* Return the first one */
-		bytes_read = return_data(dev, data, length);
-		goto ret;
-	}
+	if (libusb_get_device_list(usb_context, &devs) < 0)
+		return -1;
+	usb_dev = find_device_by_path(devs, info->path);
+	libusb_free_device_list(devs, 1);
 
-	if (dev->shutdown_thread) {
-		/* This means the device has been disconnected.
-		   An error code of -1 should be returned. */
-		bytes_read = -1;
-		goto ret;
+	if (!usb_dev) {
+		LOG("can't find device %s\n", info->path);
+		return -1;
 	}
 
-	if (milliseconds == -1) {
-		/* Blocking */
-		while (!dev->input_reports && !dev->shutdown_thread) {
-			pthread_cond_wait(&dev->condition, &dev->mutex);
-		}
-		if (dev->input_reports) {
-			bytes_read = return_data(dev, data, length);
-		}
+	res = libusb_open(usb_dev, &handle);
+	if (res < 0) {
+		LOG("can't open device\n");
+		libusb_unref_device(usb_dev);
+		return -1;
 	}
-	else if (milliseconds > 0) {
-		/* Non-blocking, but called with timeout. */
-		int res;
-		struct timespec ts;
-		clock_gettime(CLOCK_REALTIME, &ts);
-		ts.tv_sec += milliseconds / 1000;
-		ts.tv_nsec += (milliseconds % 1000) * 1000000;
-		if (ts.tv_nsec >= 1000000000L) {
-			ts.tv_sec++;
-			ts.tv_nsec -= 1000000000L;
-		}
 
-		while (!dev->input_reports && !dev->shutdown_thread) {
-			res = pthread_cond_timedwait(&dev->condition, &dev->mutex, &ts);
-			if (res == 0) {
-				if (dev->input_reports) {
-					bytes_read = return_data(dev, data, length);
-					break;
-				}
+	/* Read after opening, as the descriptor may not be accurate before
+	   on Android (see create_device_info_for_device()) */
+	libusb_get_device_descriptor(usb_dev, &desc);
 
-				/* If we're here, there was a spurious wake up
-				   or the read thread was shutdown. Run the
-				   loop again (ie: don't break). */
-			}
-			else if (res == ETIMEDOUT) {
-				/* Timed out. */
-				bytes_read = 0;
-				break;
-			}
-			else {
-				/* Error. */
-				bytes_read = -1;
-				break;
-			}
-		}
-	}
-	else {
-		/* Purely non-blocking */
-		bytes_read = 0;
-	}
+	/* Only the strings which are still missing are fetched */
+	init_usb_string_cache(&strings);
+	if (!info->serial_number && desc.iSerialNumber > 0)
+		info->serial_number = get_cached_usb_string(&strings, handle, desc.iSerialNumber);
+	if (!info->manufacturer_string && desc.iManufacturer > 0)
+		info->manufacturer_string = get_cached_usb_string(&strings, handle, desc.iManufacturer);
+	if (!info->product_string && desc.iProduct > 0)
+		info->product_string = get_cached_usb_string(&strings, handle, desc.iProduct);
+	free_usb_string_cache(&strings);
 
-ret:
-	pthread_mutex_unlock(&dev->mutex);
-	pthread_cleanup_pop(0);
+	libusb_close(handle);
+	libusb_unref_device(usb_dev);
 
-	return bytes_read;
+	return 0;
 }
 
-int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
+int HID_API_EXPORT_CALL hid_libusb_get_input_reports_dropped(hid_device *dev, size_t *dropped)
 {
-	return hid_read_timeout(dev, data, length, dev->blocking ? -1 : 0);
-}
+	if (!dev || !dropped)
+		return -1;
 
-int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
-{
-	dev->blocking = !nonblock;
+	*dropped = __atomic_load_n(&dev->stats.input_reports_dropped, __ATOMIC_RELAXED);
 
 	return 0;
 }
@@ -1402,17 +3485,24 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 	if (!dev)
 		return;
 
-	/* Cause read_thread() to stop. */
-	dev->shutdown_thread = 1;
-	libusb_cancel_transfer(dev->transfer);
+	/* Drop the output reports which were not sent yet. */
+	cancel_output_transfers(dev);
 
-	/* Wait for read_thread() to end. */
-	pthread_join(dev->thread, NULL);
+	/* Stop the transfers of the device. */
+	pthread_mutex_lock(&dev->transfer_mutex);
+	dev->shutdown_transfers = 1;
+	cancel_input_transfers_locked(dev);
+	pthread_mutex_unlock(&dev->transfer_mutex);
+
+	/* Wait for the event thread to be done with them. */
+	pthread_mutex_lock(&dev->mutex);
+	while (!dev->transfer_loop_finished)
+		pthread_cond_wait(&dev->condition, &dev->mutex);
+	pthread_mutex_unlock(&dev->mutex);
 
-	/* Clean up the Transfer objects allocated in read_thread(). */
-	free(dev->transfer->buffer);
-	dev->transfer->buffer = NULL;
-	libusb_free_transfer(dev->transfer);
+	/* read_callback() may still be unlocking the transfer_mutex. */
+	pthread_mutex_lock(&dev->transfer_mutex);
+	pthread_mutex_unlock(&dev->transfer_mutex);
 
 	/* release the interface */
 	libusb_release_interface(dev->device_handle, dev->interface);
@@ -1429,13 +3519,8 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 	/* Close the handle */
 	libusb_close(dev->device_handle);
 
-	/* Clear out the queue of received reports. */
-	pthread_mutex_lock(&dev->mutex);
-	while (dev->input_reports) {
-		return_data(dev, NULL, 0);
-	}
-	pthread_mutex_unlock(&dev->mutex);
-
+	/* The transfer objects and the ring of received reports are
+	   freed along with the device. */
 	free_hid_device(dev);
 }
 
@@ -1459,7 +3544,7 @@ int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index
 {
 	wchar_t *str;
 
-	str = get_usb_string(dev->device_handle, string_index);
+	str = get_cached_usb_string(&dev->strings, dev->device_handle, string_index);
 	if (str) {
 		wcsncpy(string, str, maxlen);
 		string[maxlen-1] = L'\0';
@@ -1470,6 +3555,42 @@ int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index
 		return -1;
 }
 
+int HID_API_EXPORT_CALL hid_get_report_fields(hid_device *dev, const struct hid_report_field **fields)
+{
+	if (!fields)
+		return -1;
+
+	if (dev->num_report_fields < 0) {
+		/* The interface is claimed already, so unlike in
+		   hid_enumerate(), reading the descriptor is harmless. */
+		unsigned char *data = (unsigned char*) malloc(MAX_REPORT_DESCRIPTOR_SIZE);
+		int res;
+
+		if (!data)
+			return -1;
+
+		res = libusb_control_transfer(dev->device_handle,
+			LIBUSB_ENDPOINT_IN|LIBUSB_RECIPIENT_INTERFACE,
+			LIBUSB_REQUEST_GET_DESCRIPTOR,
+			(LIBUSB_DT_REPORT << 8),
+			dev->interface,
+			data, MAX_REPORT_DESCRIPTOR_SIZE,
+			1000/*timeout millis*/);
+		if (res < 0) {
+			LOG("libusb_control_transfer() for getting the HID report descriptor failed with %d\n", res);
+			free(data);
+			return -1;
+		}
+
+		dev->num_report_fields = compile_report_descriptor(data, (size_t) res, &dev->report_fields);
+		free(data);
+		if (dev->num_report_fields < 0)
+			return -1;
+	}
+
+	*fields = dev->report_fields;
+	return dev->num_report_fields;
+}
 
 HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
 {
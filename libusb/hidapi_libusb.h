@@ -49,6 +49,220 @@ extern "C" {
 		*/
 		HID_API_EXPORT hid_device * HID_API_CALL hid_libusb_wrap_sys_device(intptr_t sys_dev, int interface_num);
 
+		/** @brief What to do with an input report which arrives
+			while the input queue of a device is full.
+
+			@ingroup API
+			@see hid_libusb_set_input_queue_policy
+		*/
+		enum hid_libusb_input_queue_policy {
+			/** Drop the oldest queued report to make room for the
+			    new one. This is the default. */
+			HID_LIBUSB_INPUT_QUEUE_DROP_OLDEST = 0,
+			/** Drop the report which just arrived. */
+			HID_LIBUSB_INPUT_QUEUE_DROP_NEWEST = 1,
+			/** Stop reading from the interrupt IN endpoint until
+			    the application reads a report from the queue.
+			    The device NAKs meanwhile, and keeps its reports
+			    (or drops them) according to its own firmware. */
+			HID_LIBUSB_INPUT_QUEUE_BACKPRESSURE = 2,
+		};
+
+		/** @brief Set the depth and the overflow policy of the
+			queue of input reports of a device.
+
+			By default the queue holds 32 reports, and the oldest
+			report is dropped when a new one arrives while the
+			queue is full. Reports which are already queued are
+			kept, except for the oldest ones if @p depth is less
+			than the number of queued reports.
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param depth The maximum number of reports to queue.
+			@param policy What to do when the queue is full.
+
+			@returns
+				This function returns 0 on success and -1 on error,
+				including while a report is borrowed with
+				hid_read_acquire().
+		*/
+		int HID_API_EXPORT_CALL hid_libusb_set_input_queue_policy(hid_device *dev, size_t depth, enum hid_libusb_input_queue_policy policy);
+
+		/** @brief Set the number of interrupt IN transfers which are
+			kept submitted for each device opened afterwards.
+
+			With a single transfer (the default), the host controller
+			has nothing queued for the endpoint between the completion
+			of the transfer and its resubmission, which can cost missed
+			polling intervals for devices with high report rates.
+			Reports are queued in the order they arrived, whatever the
+			number of transfers.
+
+			@ingroup API
+			@param count The number of transfers, from 1 to 16.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+
+			@note This setting has no effect on devices which are
+			already open.
+		*/
+		int HID_API_EXPORT_CALL hid_libusb_set_input_transfers(int count);
+
+		/** @brief Getter for option set by @ref hid_libusb_set_input_transfers.
+
+			@ingroup API
+			@return The number of interrupt IN transfers which are
+				kept submitted for each device opened afterwards.
+		*/
+		int HID_API_EXPORT_CALL hid_libusb_get_input_transfers(void);
+
+		/** @brief Set the number of threads which handle the USB
+			events of the devices opened afterwards.
+
+			Each thread has a libusb context of its own, and runs
+			the transfers of a share of the open devices; a device
+			is assigned to the thread with the fewest devices when
+			it is opened. The threads are started as needed, and
+			stopped by hid_exit(). The default is a single thread
+			for all the devices.
+
+			@ingroup API
+			@param count The number of threads, from 1 to 64.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+
+			@note This setting has no effect on devices which are
+			already open.
+		*/
+		int HID_API_EXPORT_CALL hid_libusb_set_event_threads(int count);
+
+		/** @brief Getter for option set by @ref hid_libusb_set_event_threads.
+
+			@ingroup API
+			@return The number of threads which handle the USB events
+				of the devices opened afterwards.
+		*/
+		int HID_API_EXPORT_CALL hid_libusb_get_event_threads(void);
+
+		/** @brief Completion callback of hid_libusb_write_async().
+
+			It is called on the thread which handles the USB events of
+			the device (see hid_libusb_set_event_threads()), so it must
+			not block, nor call hid_libusb_flush() or hid_close().
+
+			@ingroup API
+			@param dev The device the report was written to.
+			@param result The number of bytes written, as returned by
+				hid_write(), or -1 if the report could not be sent
+				(including when it was cancelled by hid_close()).
+			@param user_data The pointer given to hid_libusb_write_async().
+		*/
+		typedef void (HID_API_CALL *hid_libusb_write_callback)(hid_device *dev, int result, void *user_data);
+
+		/** @brief Write an Output report to a HID device without
+			waiting for it to be sent.
+
+			Same as hid_write(), but the report is only queued for
+			transfer: the function returns as soon as it is submitted,
+			and @p callback is called once it has been sent. Up to 16
+			reports can be in flight at once for a device; if they
+			all are, this function waits for one of them to complete.
+			Reports are sent in the order they were queued.
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param data The data to send, including the report number as
+				the first byte.
+			@param length The length in bytes of the data to send.
+			@param callback The function to call when the report has been
+				sent, or NULL.
+			@param user_data A pointer passed to @p callback.
+
+			@returns
+				This function returns the number of bytes queued for
+				writing and -1 on error.
+		*/
+		int HID_API_EXPORT_CALL hid_libusb_write_async(hid_device *dev, const unsigned char *data, size_t length, hid_libusb_write_callback callback, void *user_data);
+
+		/** @brief Wait for the reports queued with hid_libusb_write_async()
+			to be sent.
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param milliseconds timeout in milliseconds or -1 for blocking wait.
+
+			@returns
+				This function returns 0 once all the reports have been
+				sent (or have failed), and -1 on timeout or error.
+		*/
+		int HID_API_EXPORT_CALL hid_libusb_flush(hid_device *dev, int milliseconds);
+
+		/** @brief Set whether the enumeration reads the string
+			descriptors of the devices.
+
+			Reading the serial number, manufacturer and product
+			strings means opening each device and issuing several
+			control transfers per string, which makes the enumeration
+			slow on a bus with many devices. When disabled, the
+			records returned by hid_enumerate() (and passed to the
+			hotplug callbacks) have these strings set to NULL, and
+			the devices are not opened, unless the serial number is
+			needed to match a filter of hid_enumerate_ex(). The
+			strings of a record can then be read with
+			hid_libusb_resolve_strings(). The default is enabled.
+
+			@ingroup API
+			@param enable 0 to leave the strings unresolved, 1 to
+				read them.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT_CALL hid_libusb_set_enumerate_strings(int enable);
+
+		/** @brief Getter for option set by @ref hid_libusb_set_enumerate_strings.
+
+			@ingroup API
+			@return 1 if the enumeration reads the string descriptors
+				of the devices, 0 otherwise.
+		*/
+		int HID_API_EXPORT_CALL hid_libusb_get_enumerate_strings(void);
+
+		/** @brief Read the strings of a device information record
+			which the enumeration left unresolved.
+
+			The serial number, manufacturer and product strings of
+			@p info which are NULL are read from the device, which
+			must still be connected. The strings which are already
+			set are left as they are.
+
+			@ingroup API
+			@param info A record returned by hid_enumerate().
+
+			@returns
+				This function returns 0 on success and -1 if the
+				device could not be found or opened.
+
+			@see hid_libusb_set_enumerate_strings
+		*/
+		int HID_API_EXPORT_CALL hid_libusb_resolve_strings(struct hid_device_info *info);
+
+		/** @brief Get the number of input reports which were dropped
+			because the queue of input reports of a device was full.
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param dropped The number of dropped reports since the
+				device was opened, on return.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT_CALL hid_libusb_get_input_reports_dropped(hid_device *dev, size_t *dropped);
+
 #ifdef __cplusplus
 }
 #endif
@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <locale.h>
 #include <errno.h>
+#include <limits.h>
 
 /* Unix */
 #include <unistd.h>
@@ -35,6 +36,9 @@
 #include <sys/utsname.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 
 /* Linux */
 #include <linux/hidraw.h>
@@ -42,7 +46,13 @@
 #include <linux/input.h>
 #include <libudev.h>
 
-#include "hidapi.h"
+#include "hidapi_hidraw.h"
+
+/* hid_poll(), Input report and statistics helpers of hid_report.c */
+#define HID_REPORT_POLL_HELPERS
+#define HID_REPORT_INPUT_HELPERS
+#define HID_REPORT_STATS_HELPERS
+#include "hid_report.c"
 
 #ifdef HIDAPI_ALLOW_BUILD_WORKAROUND_KERNEL_2_6_39
 /* This definitions first appeared in Linux Kernel 2.6.39 in linux/hidraw.h.
@@ -68,6 +78,12 @@
 #define HIDIOCGINPUT(len)    _IOC(_IOC_WRITE|_IOC_READ, 'H', 0x0A, len)
 #endif
 
+// HIDIOCGRAWUNIQ is not defined in Linux kernel headers < 5.6.
+// Older kernels fail it, and the serial number is then read from udev.
+#ifndef HIDIOCGRAWUNIQ
+#define HIDIOCGRAWUNIQ(len)     _IOC(_IOC_READ, 'H', 0x08, len)
+#endif
+
 /* USB HID device property names */
 const char *device_string_names[] = {
 	"manufacturer",
@@ -89,8 +105,62 @@ struct hid_device_ {
 	int blocking;
 	int uses_numbered_reports;
 	wchar_t *last_error_str;
+
+	/* Buffer lent to the application by hid_read_acquire() */
+	unsigned char *report_buffer;
+	int report_lent;
+
+	/* See hid_set_input_callback(). The callback thread reads the
+	   reports and calls input_callback with callback_mutex held, or
+	   stores them in latest_reports or report_id_queues in the modes
+	   set by hid_set_latest_report_mode() and
+	   hid_set_report_id_queues(); it is stopped by signaling
+	   callback_wakeup_fd (an eventfd, -1 until the thread is first
+	   started). */
+	pthread_mutex_t callback_mutex;
+	hid_input_callback input_callback;
+	void *input_callback_data;
+	pthread_t callback_thread;
+	int callback_thread_running;
+	int callback_wakeup_fd;
+	int callback_thread_device_gone;
+
+	/* The 256 latest_reports and report_id_queues (one per report ID)
+	   are allocated when their mode is first enabled, and kept until
+	   hid_close(). The modes are protected by callback_mutex. */
+	struct latest_report *latest_reports;
+	unsigned char *latest_report_buffer;
+	struct report_id_queue **report_id_queues;
+	int latest_report_mode;
+	int report_id_mode;
+
+	/* See hid_set_input_change_filter(). NULL unless enabled; both are
+	   protected by input_filter_mutex, as the reports are filtered by
+	   the read functions and by the callback thread. */
+	pthread_mutex_t input_filter_mutex;
+	struct input_filter *input_filter;
+	size_t input_reports_suppressed;
+
+	/* See hid_get_stats() */
+	struct device_stats stats;
+
+	/* Identity of the device, read once by hid_open_path(): the strings
+	   returned by hid_get_*_string() (NULL if the device has none), and
+	   the report descriptor. */
+	wchar_t *strings[DEVICE_STRING_COUNT];
+	__u8 *report_descriptor;
+	__u32 report_descriptor_size;
+
+	/* See hid_get_report_fields(). Compiled from report_descriptor
+	   on first use; num_report_fields is -1 until then. */
+	struct hid_report_field *report_fields;
+	int num_report_fields;
 };
 
+/* Size of the buffer hid_read_acquire() reads into, which is the
+   largest report hidraw can return (HID_MAX_BUFFER_SIZE) */
+#define HIDRAW_MAX_REPORT_SIZE 16384
+
 static struct hid_api_version api_version = {
 	.major = HID_API_VERSION_MAJOR,
 	.minor = HID_API_VERSION_MINOR,
@@ -108,6 +178,10 @@ static hid_device *new_hid_device(void)
 	dev->blocking = 1;
 	dev->uses_numbered_reports = 0;
 	dev->last_error_str = NULL;
+	dev->callback_wakeup_fd = -1;
+	dev->num_report_fields = -1;
+	pthread_mutex_init(&dev->callback_mutex, NULL);
+	pthread_mutex_init(&dev->input_filter_mutex, NULL);
 
 	return dev;
 }
@@ -487,29 +561,55 @@ next_line:
 }
 
 
-static int get_device_string(hid_device *dev, enum device_string_id key, wchar_t *string, size_t maxlen)
+/* Read a string of the HID device with HIDIOCGRAWNAME or HIDIOCGRAWUNIQ.
+   The caller must free the returned string with free(). */
+static char *get_hidraw_string(int fd, unsigned long request)
 {
-	struct udev *udev;
-	struct udev_device *udev_dev, *parent, *hid_dev;
-	struct stat s;
-	int ret = -1;
+	char buf[256];
+	int res;
+
+	res = ioctl(fd, request, buf);
+	if (res < 0)
+		return NULL;
+	buf[sizeof(buf) - 1] = '\0';
+
+	return strdup(buf);
+}
+
+/* Read the strings of the device once, at open. The bus and the name
+   and unique ID of the HID device come from the hidraw ioctls; udev is
+   only looked up for the strings of USB devices, which are those of the
+   USB device node, or when the ioctls are not supported. */
+static void load_device_strings(hid_device *dev)
+{
+	struct hidraw_devinfo info;
+	struct udev *udev = NULL;
+	struct udev_device *udev_dev = NULL;
+	unsigned bus_type = 0;
+	int found_bus = 0;
 	char *serial_number_utf8 = NULL;
 	char *product_name_utf8 = NULL;
+	int i;
 
-	/* Create the udev object */
-	udev = udev_new();
-	if (!udev) {
-		register_global_error("Couldn't create udev context");
-		return -1;
+	if (ioctl(dev->device_handle, HIDIOCGRAWINFO, &info) >= 0) {
+		bus_type = (unsigned) info.bustype;
+		found_bus = 1;
 	}
+	product_name_utf8 = get_hidraw_string(dev->device_handle, HIDIOCGRAWNAME(256));
+	serial_number_utf8 = get_hidraw_string(dev->device_handle, HIDIOCGRAWUNIQ(256));
+
+	if (!found_bus || bus_type == BUS_USB || !product_name_utf8 || !serial_number_utf8) {
+		struct stat s;
+
+		udev = udev_new();
+		/* Open a udev device from the dev_t. 'c' means character device. */
+		if (udev && fstat(dev->device_handle, &s) == 0)
+			udev_dev = udev_device_new_from_devnum(udev, 'c', s.st_rdev);
+	}
+
+	if (udev_dev && (!found_bus || !product_name_utf8 || !serial_number_utf8)) {
+		struct udev_device *hid_dev;
 
-	/* Get the dev_t (major/minor numbers) from the file handle. */
-	ret = fstat(dev->device_handle, &s);
-	if (-1 == ret)
-		return ret;
-	/* Open a udev device from the dev_t. 'c' means character device. */
-	udev_dev = udev_device_new_from_devnum(udev, 'c', s.st_rdev);
-	if (udev_dev) {
 		hid_dev = udev_device_get_parent_with_subsystem_devtype(
 			udev_dev,
 			"hid",
@@ -517,74 +617,60 @@ static int get_device_string(hid_device *dev, enum device_string_id key, wchar_t
 		if (hid_dev) {
 			unsigned short dev_vid;
 			unsigned short dev_pid;
-			unsigned bus_type;
-			size_t retm;
+			unsigned uevent_bus_type = 0;
+			char *uevent_serial_utf8 = NULL;
+			char *uevent_product_utf8 = NULL;
 
-			ret = parse_uevent_info(
+			parse_uevent_info(
 			           udev_device_get_sysattr_value(hid_dev, "uevent"),
-			           &bus_type,
+			           &uevent_bus_type,
 			           &dev_vid,
 			           &dev_pid,
-			           &serial_number_utf8,
-			           &product_name_utf8);
-
-			/* Standard USB device */
-			if (bus_type == BUS_USB) {
-				/* This is a USB device. Find its parent USB Device node. */
-				parent = udev_device_get_parent_with_subsystem_devtype(
-					   udev_dev,
-					   "usb",
-					   "usb_device");
-				if (parent) {
-					const char *str;
-					const char *key_str = NULL;
-
-					if (key >= 0 && key < DEVICE_STRING_COUNT) {
-						key_str = device_string_names[key];
-					} else {
-						ret = -1;
-						goto end;
-					}
-
-					str = udev_device_get_sysattr_value(parent, key_str);
-					if (str) {
-						/* Convert the string from UTF-8 to wchar_t */
-						retm = mbstowcs(string, str, maxlen);
-						ret = (retm == (size_t)-1)? -1: 0;
-					}
-
-					/* USB information parsed */
-					goto end;
-				}
-				else {
-					/* Correctly handled below */
-				}
-			}
+			           &uevent_serial_utf8,
+			           &uevent_product_utf8);
 
-			/* USB information not available (uhid) or another type of HID bus */
-			switch (bus_type) {
-				case BUS_BLUETOOTH:
-				case BUS_I2C:
-				case BUS_USB:
-					switch (key) {
-						case DEVICE_STRING_MANUFACTURER:
-							wcsncpy(string, L"", maxlen);
-							ret = 0;
-							break;
-						case DEVICE_STRING_PRODUCT:
-							retm = mbstowcs(string, product_name_utf8, maxlen);
-							ret = (retm == (size_t)-1)? -1: 0;
-							break;
-						case DEVICE_STRING_SERIAL:
-							retm = mbstowcs(string, serial_number_utf8, maxlen);
-							ret = (retm == (size_t)-1)? -1: 0;
-							break;
-						case DEVICE_STRING_COUNT:
-						default:
-							ret = -1;
-							break;
-					}
+			if (!found_bus) {
+				bus_type = uevent_bus_type;
+				found_bus = 1;
 			}
+			if (!product_name_utf8) {
+				product_name_utf8 = uevent_product_utf8;
+				uevent_product_utf8 = NULL;
+			}
+			if (!serial_number_utf8) {
+				serial_number_utf8 = uevent_serial_utf8;
+				uevent_serial_utf8 = NULL;
+			}
+			free(uevent_serial_utf8);
+			free(uevent_product_utf8);
+		}
+	}
+
+	if (found_bus && bus_type == BUS_USB && udev_dev) {
+		/* This is a USB device. Find its parent USB Device node. */
+		struct udev_device *parent = udev_device_get_parent_with_subsystem_devtype(
+			udev_dev,
+			"usb",
+			"usb_device");
+		if (parent) {
+			for (i = 0; i < DEVICE_STRING_COUNT; i++)
+				dev->strings[i] = copy_udev_string(parent, device_string_names[i]);
+
+			/* USB information parsed */
+			goto end;
+		}
+	}
+
+	/* USB information not available (uhid) or another type of HID bus */
+	if (found_bus) {
+		switch (bus_type) {
+			case BUS_BLUETOOTH:
+			case BUS_I2C:
+			case BUS_USB:
+				dev->strings[DEVICE_STRING_MANUFACTURER] = utf8_to_wchar_t("");
+				dev->strings[DEVICE_STRING_PRODUCT] = utf8_to_wchar_t(product_name_utf8);
+				dev->strings[DEVICE_STRING_SERIAL] = utf8_to_wchar_t(serial_number_utf8);
+				break;
 		}
 	}
 
@@ -592,12 +678,31 @@ end:
 	free(serial_number_utf8);
 	free(product_name_utf8);
 
-	udev_device_unref(udev_dev);
+	if (udev_dev)
+		udev_device_unref(udev_dev);
 	/* parent and hid_dev don't need to be (and can't be) unref'd.
 	   I'm not sure why, but they'll throw double-free() errors. */
-	udev_unref(udev);
+	if (udev)
+		udev_unref(udev);
+}
 
-	return ret;
+static int get_device_string(hid_device *dev, enum device_string_id key, wchar_t *string, size_t maxlen)
+{
+	const wchar_t *str;
+
+	if (key < 0 || key >= DEVICE_STRING_COUNT || !string || !maxlen)
+		return -1;
+
+	str = dev->strings[key];
+	if (!str) {
+		register_device_error(dev, "The device has no such string");
+		return -1;
+	}
+
+	wcsncpy(string, str, maxlen);
+	string[maxlen - 1] = L'\0';
+
+	return 0;
 }
 
 HID_API_EXPORT const struct hid_api_version* HID_API_CALL hid_version()
@@ -622,352 +727,1192 @@ int HID_API_EXPORT hid_init(void)
 	return 0;
 }
 
+static void stop_hotplug_thread(void);
+
 int HID_API_EXPORT hid_exit(void)
 {
 	/* Free global error message */
 	register_global_error(NULL);
 
+	hid_hidraw_set_enumeration_cache(0);
+	stop_hotplug_thread();
+
 	return 0;
 }
 
 
-struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+static struct hid_device_info *copy_device_info(const struct hid_device_info *src)
 {
-	struct udev *udev;
-	struct udev_enumerate *enumerate;
-	struct udev_list_entry *devices, *dev_list_entry;
+	struct hid_device_info *dev = (struct hid_device_info*) calloc(1, sizeof(struct hid_device_info));
+	if (!dev)
+		return NULL;
+
+	*dev = *src;
+	dev->next = NULL;
+	dev->path = src->path? strdup(src->path): NULL;
+	dev->serial_number = src->serial_number? wcsdup(src->serial_number): NULL;
+	dev->manufacturer_string = src->manufacturer_string? wcsdup(src->manufacturer_string): NULL;
+	dev->product_string = src->product_string? wcsdup(src->product_string): NULL;
 
+	return dev;
+}
+
+/* Append a copy of info with the given usage to the list */
+static void append_device_info(struct hid_device_info **root, struct hid_device_info **cur_dev, const struct hid_device_info *info, unsigned short usage_page, unsigned short usage)
+{
+	struct hid_device_info *tmp = copy_device_info(info);
+	if (!tmp)
+		return;
+
+	tmp->usage_page = usage_page;
+	tmp->usage = usage;
+	if (*cur_dev) {
+		(*cur_dev)->next = tmp;
+	}
+	else {
+		*root = tmp;
+	}
+	*cur_dev = tmp;
+}
+
+/* Create the device info records (one per top-level usage) for the
+   hidraw node raw_dev which match the filter (NULL to match any).
+   Returns NULL if none does, or if it isn't a supported device.
+
+   The criteria are checked as soon as the information they need is
+   known: the ones from the uevent of the hid device first, then the
+   interface number, then the usages from the report descriptor. The
+   strings are only read for a node which matches. */
+static struct hid_device_info *create_device_info_for_device(struct udev_device *raw_dev, const struct hid_enum_filter *filter)
+{
+	const char *sysfs_path;
+	const char *dev_path;
+	const char *str;
+	struct udev_device *hid_dev; /* The device's HID udev node. */
+	struct udev_device *usb_dev = NULL; /* The device's USB udev node. */
+	struct udev_device *intf_dev; /* The device's interface (in the USB sense). */
+	unsigned short dev_vid;
+	unsigned short dev_pid;
+	char *serial_number_utf8 = NULL;
+	char *product_name_utf8 = NULL;
+	unsigned bus_type;
+	int result;
+	struct hidraw_report_descriptor report_desc;
+	unsigned short page = 0, usage = 0;
+	unsigned int pos = 0;
+	int found_usage = 0;
+
+	struct hid_device_info info; /* Fields common to all the records */
 	struct hid_device_info *root = NULL; /* return object */
 	struct hid_device_info *cur_dev = NULL;
-	struct hid_device_info *prev_dev = NULL; /* previous device */
 
-	hid_init();
+	memset(&info, 0, sizeof(info));
 
-	/* Create the udev object */
-	udev = udev_new();
-	if (!udev) {
-		register_global_error("Couldn't create udev context");
-		return NULL;
+	sysfs_path = udev_device_get_syspath(raw_dev);
+	dev_path = udev_device_get_devnode(raw_dev);
+
+	hid_dev = udev_device_get_parent_with_subsystem_devtype(
+		raw_dev,
+		"hid",
+		NULL);
+
+	if (!hid_dev) {
+		/* Unable to find parent hid device. */
+		goto end;
 	}
 
-	/* Create a list of the devices in the 'hidraw' subsystem. */
-	enumerate = udev_enumerate_new(udev);
-	udev_enumerate_add_match_subsystem(enumerate, "hidraw");
-	udev_enumerate_scan_devices(enumerate);
-	devices = udev_enumerate_get_list_entry(enumerate);
-	/* For each item, see if it matches the vid/pid, and if so
-	   create a udev_device record for it */
-	udev_list_entry_foreach(dev_list_entry, devices) {
-		const char *sysfs_path;
-		const char *dev_path;
-		const char *str;
-		struct udev_device *raw_dev; /* The device's hidraw udev node. */
-		struct udev_device *hid_dev; /* The device's HID udev node. */
-		struct udev_device *usb_dev; /* The device's USB udev node. */
-		struct udev_device *intf_dev; /* The device's interface (in the USB sense). */
-		unsigned short dev_vid;
-		unsigned short dev_pid;
-		char *serial_number_utf8 = NULL;
-		char *product_name_utf8 = NULL;
-		unsigned bus_type;
-		int result;
-		struct hidraw_report_descriptor report_desc;
+	result = parse_uevent_info(
+		udev_device_get_sysattr_value(hid_dev, "uevent"),
+		&bus_type,
+		&dev_vid,
+		&dev_pid,
+		&serial_number_utf8,
+		&product_name_utf8);
+
+	if (!result) {
+		/* parse_uevent_info() failed for at least one field. */
+		goto end;
+	}
 
-		/* Get the filename of the /sys entry for the device
-		   and create a udev_device object (dev) representing it */
-		sysfs_path = udev_list_entry_get_name(dev_list_entry);
-		raw_dev = udev_device_new_from_syspath(udev, sysfs_path);
-		dev_path = udev_device_get_devnode(raw_dev);
+	/* Filter out unhandled devices right away */
+	switch (bus_type) {
+		case BUS_USB:
+			info.bus_type = HID_API_BUS_USB;
+			break;
 
-		hid_dev = udev_device_get_parent_with_subsystem_devtype(
-			raw_dev,
-			"hid",
-			NULL);
+		case BUS_BLUETOOTH:
+			info.bus_type = HID_API_BUS_BLUETOOTH;
+			break;
+
+		case BUS_I2C:
+			info.bus_type = HID_API_BUS_I2C;
+			break;
 
-		if (!hid_dev) {
-			/* Unable to find parent hid device. */
-			goto next;
+		default:
+			goto end;
+	}
+
+	/* Check the VID/PID and bus type against the filter */
+	if (filter &&
+	    (((filter->match & HID_API_MATCH_VENDOR_ID) && filter->vendor_id != dev_vid) ||
+	     ((filter->match & HID_API_MATCH_PRODUCT_ID) && filter->product_id != dev_pid) ||
+	     ((filter->match & HID_API_MATCH_BUS_TYPE) && filter->bus_type != info.bus_type)))
+		goto end;
+
+	/* Fill out the record */
+	info.path = dev_path? strdup(dev_path): NULL;
+
+	/* VID/PID */
+	info.vendor_id = dev_vid;
+	info.product_id = dev_pid;
+
+	/* Serial Number */
+	info.serial_number = utf8_to_wchar_t(serial_number_utf8);
+
+	/* Release Number */
+	info.release_number = 0x0;
+
+	/* Interface Number */
+	info.interface_number = -1;
+
+	if (!serial_number_matches(info.serial_number, filter))
+		goto end;
+
+	if (bus_type == BUS_USB) {
+		/* The device pointed to by raw_dev contains information about
+		   the hidraw device. In order to get information about the
+		   USB device, get the parent device with the
+		   subsystem/devtype pair of "usb"/"usb_device". This will
+		   be several levels up the tree, but the function will find
+		   it. */
+		usb_dev = udev_device_get_parent_with_subsystem_devtype(
+				raw_dev,
+				"usb",
+				"usb_device");
+
+		/* uhid USB devices
+		   Since this is a virtual hid interface, no USB information will
+		   be available. */
+		if (usb_dev) {
+			/* Get a handle to the interface's udev node. */
+			intf_dev = udev_device_get_parent_with_subsystem_devtype(
+					raw_dev,
+					"usb",
+					"usb_interface");
+			if (intf_dev) {
+				str = udev_device_get_sysattr_value(intf_dev, "bInterfaceNumber");
+				info.interface_number = (str)? strtol(str, NULL, 16): -1;
+			}
 		}
+	}
 
-		result = parse_uevent_info(
-			udev_device_get_sysattr_value(hid_dev, "uevent"),
-			&bus_type,
-			&dev_vid,
-			&dev_pid,
-			&serial_number_utf8,
-			&product_name_utf8);
-
-		if (!result) {
-			/* parse_uevent_info() failed for at least one field. */
-			goto next;
+	if (filter && (filter->match & HID_API_MATCH_INTERFACE_NUMBER) &&
+	    filter->interface_number != info.interface_number)
+		goto end;
+
+	/* Usage Page and Usage. With a filter on them, the node is
+	   dropped now if none of its usages match. */
+	result = get_hid_report_descriptor_from_sysfs(sysfs_path, &report_desc);
+	if (filter && (filter->match & (HID_API_MATCH_USAGE_PAGE | HID_API_MATCH_USAGE))) {
+		int matched = 0;
+		if (result >= 0) {
+			while (!matched && !get_next_hid_usage(report_desc.value, report_desc.size, &pos, &page, &usage))
+				matched = usage_matches(page, usage, filter);
+			/* Parse from the start again below */
+			pos = 0;
+			page = usage = 0;
 		}
+		if (!matched)
+			goto end;
+	}
 
-		/* Filter out unhandled devices right away */
-		switch (bus_type) {
-			case BUS_BLUETOOTH:
-			case BUS_I2C:
-			case BUS_USB:
+	switch (bus_type) {
+		case BUS_USB:
+			if (!usb_dev) {
+				/* Manufacturer and Product strings */
+				info.manufacturer_string = wcsdup(L"");
+				info.product_string = utf8_to_wchar_t(product_name_utf8);
 				break;
+			}
 
-			default:
-				goto next;
-		}
-
-		/* Check the VID/PID against the arguments */
-		if ((vendor_id == 0x0 || vendor_id == dev_vid) &&
-		    (product_id == 0x0 || product_id == dev_pid)) {
-			struct hid_device_info *tmp;
+			/* Manufacturer and Product strings */
+			info.manufacturer_string = copy_udev_string(usb_dev, device_string_names[DEVICE_STRING_MANUFACTURER]);
+			info.product_string = copy_udev_string(usb_dev, device_string_names[DEVICE_STRING_PRODUCT]);
 
-			/* VID/PID match. Create the record. */
-			tmp = (struct hid_device_info*) calloc(1, sizeof(struct hid_device_info));
-			if (cur_dev) {
-				cur_dev->next = tmp;
-			}
-			else {
-				root = tmp;
-			}
-			prev_dev = cur_dev;
-			cur_dev = tmp;
+			/* Release Number */
+			str = udev_device_get_sysattr_value(usb_dev, "bcdDevice");
+			info.release_number = (str)? strtol(str, NULL, 16): 0x0;
 
-			/* Fill out the record */
-			cur_dev->next = NULL;
-			cur_dev->path = dev_path? strdup(dev_path): NULL;
+			break;
 
-			/* VID/PID */
-			cur_dev->vendor_id = dev_vid;
-			cur_dev->product_id = dev_pid;
+		case BUS_BLUETOOTH:
+		case BUS_I2C:
+			/* Manufacturer and Product strings */
+			info.manufacturer_string = wcsdup(L"");
+			info.product_string = utf8_to_wchar_t(product_name_utf8);
 
-			/* Serial Number */
-			cur_dev->serial_number = utf8_to_wchar_t(serial_number_utf8);
+			break;
 
-			/* Release Number */
-			cur_dev->release_number = 0x0;
-
-			/* Interface Number */
-			cur_dev->interface_number = -1;
-
-			switch (bus_type) {
-				case BUS_USB:
-					/* The device pointed to by raw_dev contains information about
-					   the hidraw device. In order to get information about the
-					   USB device, get the parent device with the
-					   subsystem/devtype pair of "usb"/"usb_device". This will
-					   be several levels up the tree, but the function will find
-					   it. */
-					usb_dev = udev_device_get_parent_with_subsystem_devtype(
-							raw_dev,
-							"usb",
-							"usb_device");
-
-					/* uhid USB devices
-					   Since this is a virtual hid interface, no USB information will
-					   be available. */
-					if (!usb_dev) {
-						/* Manufacturer and Product strings */
-						cur_dev->manufacturer_string = wcsdup(L"");
-						cur_dev->product_string = utf8_to_wchar_t(product_name_utf8);
-						break;
-					}
-
-					/* Manufacturer and Product strings */
-					cur_dev->manufacturer_string = copy_udev_string(usb_dev, device_string_names[DEVICE_STRING_MANUFACTURER]);
-					cur_dev->product_string = copy_udev_string(usb_dev, device_string_names[DEVICE_STRING_PRODUCT]);
-
-					/* Release Number */
-					str = udev_device_get_sysattr_value(usb_dev, "bcdDevice");
-					cur_dev->release_number = (str)? strtol(str, NULL, 16): 0x0;
-
-					/* Get a handle to the interface's udev node. */
-					intf_dev = udev_device_get_parent_with_subsystem_devtype(
-							raw_dev,
-							"usb",
-							"usb_interface");
-					if (intf_dev) {
-						str = udev_device_get_sysattr_value(intf_dev, "bInterfaceNumber");
-						cur_dev->interface_number = (str)? strtol(str, NULL, 16): -1;
-					}
+		default:
+			/* Unknown device type - this should never happen, as we
+			 * check for USB and Bluetooth devices above */
+			break;
+	}
 
-					break;
+	/*
+	 * Create a record for each usage and usage page parsed out of the
+	 * report descriptor, or a single one without usage if there is none.
+	 */
+	if (result >= 0) {
+		while (!get_next_hid_usage(report_desc.value, report_desc.size, &pos, &page, &usage)) {
+			found_usage = 1;
+			if (usage_matches(page, usage, filter))
+				append_device_info(&root, &cur_dev, &info, page, usage);
+		}
+	}
+	if (!found_usage)
+		append_device_info(&root, &cur_dev, &info, 0, 0);
 
-				case BUS_BLUETOOTH:
-				case BUS_I2C:
-					/* Manufacturer and Product strings */
-					cur_dev->manufacturer_string = wcsdup(L"");
-					cur_dev->product_string = utf8_to_wchar_t(product_name_utf8);
+end:
+	free(info.path);
+	free(info.serial_number);
+	free(info.manufacturer_string);
+	free(info.product_string);
+	free(serial_number_utf8);
+	free(product_name_utf8);
+	/* hid_dev, usb_dev and intf_dev don't need to be (and can't be)
+	   unref()d.  It will cause a double-free() error.  I'm not
+	   sure why.  */
 
-					break;
+	return root;
+}
 
-				default:
-					/* Unknown device type - this should never happen, as we
-					 * check for USB and Bluetooth devices above */
-					break;
-			}
+/* Device info records of a hidraw node, in a list of the nodes known
+   to the enumeration cache or to the hotplug thread. */
+struct device_info_entry {
+	char *syspath;
+	struct hid_device_info *devs;
+	struct device_info_entry *next;
+};
 
-			/* Usage Page and Usage */
-			result = get_hid_report_descriptor_from_sysfs(sysfs_path, &report_desc);
-			if (result >= 0) {
-				unsigned short page = 0, usage = 0;
-				unsigned int pos = 0;
-				/*
-				 * Parse the first usage and usage page
-				 * out of the report descriptor.
-				 */
-				if (!get_next_hid_usage(report_desc.value, report_desc.size, &pos, &page, &usage)) {
-					cur_dev->usage_page = page;
-					cur_dev->usage = usage;
-				}
+static void free_device_info_entry(struct device_info_entry *entry)
+{
+	hid_free_enumeration(entry->devs);
+	free(entry->syspath);
+	free(entry);
+}
 
-				/*
-				 * Parse any additional usage and usage pages
-				 * out of the report descriptor.
-				 */
-				while (!get_next_hid_usage(report_desc.value, report_desc.size, &pos, &page, &usage)) {
-					/* Create new record for additional usage pairs */
-					tmp = (struct hid_device_info*) calloc(1, sizeof(struct hid_device_info));
-					cur_dev->next = tmp;
-					prev_dev = cur_dev;
-					cur_dev = tmp;
-
-					/* Update fields */
-					cur_dev->path = strdup(dev_path);
-					cur_dev->vendor_id = dev_vid;
-					cur_dev->product_id = dev_pid;
-					cur_dev->serial_number = prev_dev->serial_number? wcsdup(prev_dev->serial_number): NULL;
-					cur_dev->release_number = prev_dev->release_number;
-					cur_dev->interface_number = prev_dev->interface_number;
-					cur_dev->manufacturer_string = prev_dev->manufacturer_string? wcsdup(prev_dev->manufacturer_string): NULL;
-					cur_dev->product_string = prev_dev->product_string? wcsdup(prev_dev->product_string): NULL;
-					cur_dev->usage_page = page;
-					cur_dev->usage = usage;
-				}
-			}
+/* Unlink the entry of the node syspath from the list, if any. */
+static struct device_info_entry *detach_device_info_entry(struct device_info_entry **list, const char *syspath)
+{
+	struct device_info_entry **entry = list;
+
+	while (*entry) {
+		if (strcmp((*entry)->syspath, syspath) == 0) {
+			struct device_info_entry *found = *entry;
+			*entry = found->next;
+			found->next = NULL;
+			return found;
 		}
+		entry = &(*entry)->next;
+	}
+	return NULL;
+}
 
-	next:
-		free(serial_number_utf8);
-		free(product_name_utf8);
-		udev_device_unref(raw_dev);
-		/* hid_dev, usb_dev and intf_dev don't need to be (and can't be)
-		   unref()d.  It will cause a double-free() error.  I'm not
-		   sure why.  */
+/* Create the entry of raw_dev, replacing the one it had in the list.
+   Returns NULL if it isn't a supported device. */
+static struct device_info_entry *add_device_info_entry(struct device_info_entry **list, struct udev_device *raw_dev)
+{
+	struct device_info_entry *entry;
+	struct hid_device_info *devs;
+
+	entry = detach_device_info_entry(list, udev_device_get_syspath(raw_dev));
+	if (entry)
+		free_device_info_entry(entry);
+
+	devs = create_device_info_for_device(raw_dev, NULL);
+	if (!devs)
+		return NULL;
+
+	entry = (struct device_info_entry *) calloc(1, sizeof(struct device_info_entry));
+	if (!entry) {
+		hid_free_enumeration(devs);
+		return NULL;
 	}
-	/* Free the enumerator and udev objects. */
-	udev_enumerate_unref(enumerate);
-	udev_unref(udev);
+	entry->syspath = strdup(udev_device_get_syspath(raw_dev));
+	entry->devs = devs;
+	entry->next = *list;
+	*list = entry;
 
-	return root;
+	return entry;
 }
 
-void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
+static void free_device_info_list(struct device_info_entry **list)
 {
-	struct hid_device_info *d = devs;
-	while (d) {
-		struct hid_device_info *next = d->next;
-		free(d->path);
-		free(d->serial_number);
-		free(d->manufacturer_string);
-		free(d->product_string);
-		free(d);
-		d = next;
+	while (*list) {
+		struct device_info_entry *entry = *list;
+		*list = entry->next;
+		free_device_info_entry(entry);
 	}
 }
 
-hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+/* Fill the list with all the hidraw nodes. */
+static int scan_device_info_list(struct udev *udev, struct device_info_entry **list)
 {
-	/* Set global error to none */
-	register_global_error(NULL);
+	struct udev_enumerate *enumerate;
+	struct udev_list_entry *devices, *dev_list_entry;
 
-	struct hid_device_info *devs, *cur_dev;
-	const char *path_to_open = NULL;
-	hid_device *handle = NULL;
+	free_device_info_list(list);
 
-	devs = hid_enumerate(vendor_id, product_id);
-	cur_dev = devs;
-	while (cur_dev) {
-		if (cur_dev->vendor_id == vendor_id &&
-		    cur_dev->product_id == product_id) {
-			if (serial_number) {
-				if (wcscmp(serial_number, cur_dev->serial_number) == 0) {
-					path_to_open = cur_dev->path;
-					break;
-				}
-			}
-			else {
-				path_to_open = cur_dev->path;
-				break;
-			}
-		}
-		cur_dev = cur_dev->next;
-	}
+	enumerate = udev_enumerate_new(udev);
+	if (!enumerate)
+		return -1;
+	udev_enumerate_add_match_subsystem(enumerate, "hidraw");
+	udev_enumerate_scan_devices(enumerate);
+	devices = udev_enumerate_get_list_entry(enumerate);
+	udev_list_entry_foreach(dev_list_entry, devices) {
+		struct udev_device *raw_dev;
 
-	if (path_to_open) {
-		/* Open the device */
-		handle = hid_open_path(path_to_open);
-	} else {
-		register_global_error("No such device");
+		raw_dev = udev_device_new_from_syspath(udev, udev_list_entry_get_name(dev_list_entry));
+		if (raw_dev) {
+			add_device_info_entry(list, raw_dev);
+			udev_device_unref(raw_dev);
+		}
 	}
+	udev_enumerate_unref(enumerate);
 
-	hid_free_enumeration(devs);
-
-	return handle;
+	return 0;
 }
 
-hid_device * HID_API_EXPORT hid_open_path(const char *path)
+/* Create a monitor of the hidraw nodes, which doesn't block */
+static struct udev_monitor *new_hidraw_monitor(struct udev *udev)
 {
-	/* Set global error to none */
-	register_global_error(NULL);
+	struct udev_monitor *monitor;
+	int fd;
 
-	hid_device *dev = NULL;
+	monitor = udev_monitor_new_from_netlink(udev, "udev");
+	if (!monitor)
+		return NULL;
 
-	hid_init();
+	if (udev_monitor_filter_add_match_subsystem_devtype(monitor, "hidraw", NULL) < 0 ||
+	    udev_monitor_enable_receiving(monitor) < 0) {
+		udev_monitor_unref(monitor);
+		return NULL;
+	}
 
-	dev = new_hid_device();
+	fd = udev_monitor_get_fd(monitor);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
 
-	/* OPEN HERE */
-	dev->device_handle = open(path, O_RDWR);
+	return monitor;
+}
 
-	/* If we have a good handle, return it. */
-	if (dev->device_handle >= 0) {
-		/* Set device error to none */
-		register_device_error(dev, NULL);
+/* The enumeration cache, see hid_hidraw_set_enumeration_cache().
+   It keeps the device info records of every supported hidraw node,
+   and is brought up to date from the udev monitor at the start of
+   each hid_enumerate(). The mutex protects all of the below. */
+static pthread_mutex_t enumeration_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct udev *enumeration_cache_udev = NULL;
+static struct udev_monitor *enumeration_cache_monitor = NULL;
+static struct device_info_entry *enumeration_cache = NULL;
+
+/* Apply the changes queued on the monitor since the last call. */
+static void update_enumeration_cache(void)
+{
+	struct udev_device *raw_dev;
 
-		/* Get the report descriptor */
-		int res, desc_size = 0;
-		struct hidraw_report_descriptor rpt_desc;
+	for (;;) {
+		errno = 0;
+		raw_dev = udev_monitor_receive_device(enumeration_cache_monitor);
+		if (!raw_dev)
+			break;
 
-		memset(&rpt_desc, 0x0, sizeof(rpt_desc));
+		const char *action = udev_device_get_action(raw_dev);
+		if (action && strcmp(action, "remove") == 0) {
+			struct device_info_entry *entry = detach_device_info_entry(&enumeration_cache, udev_device_get_syspath(raw_dev));
+			if (entry)
+				free_device_info_entry(entry);
+		}
+		else
+			add_device_info_entry(&enumeration_cache, raw_dev);
 
-		/* Get Report Descriptor Size */
-		res = ioctl(dev->device_handle, HIDIOCGRDESCSIZE, &desc_size);
-		if (res < 0)
-			register_device_error_format(dev, "ioctl (GRDESCSIZE): %s", strerror(errno));
+		udev_device_unref(raw_dev);
+	}
 
-		/* Get Report Descriptor */
-		rpt_desc.size = desc_size;
-		res = ioctl(dev->device_handle, HIDIOCGRDESC, &rpt_desc);
-		if (res < 0) {
-			register_device_error_format(dev, "ioctl (GRDESC): %s", strerror(errno));
-		} else {
-			/* Determine if this device uses numbered reports. */
-			dev->uses_numbered_reports =
-				uses_numbered_reports(rpt_desc.value,
-				                      rpt_desc.size);
-		}
+	/* Events were lost if the socket buffer overflowed. */
+	if (errno == ENOBUFS)
+		scan_device_info_list(enumeration_cache_udev, &enumeration_cache);
+}
 
-		return dev;
+static void free_enumeration_cache(void)
+{
+	free_device_info_list(&enumeration_cache);
+	if (enumeration_cache_monitor) {
+		udev_monitor_unref(enumeration_cache_monitor);
+		enumeration_cache_monitor = NULL;
 	}
-	else {
-		/* Unable to open any devices. */
-		register_global_error(strerror(errno));
-		free(dev);
-		return NULL;
+	if (enumeration_cache_udev) {
+		udev_unref(enumeration_cache_udev);
+		enumeration_cache_udev = NULL;
 	}
 }
 
-
-int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length)
+int HID_API_EXPORT_CALL hid_hidraw_set_enumeration_cache(int enable)
 {
-	int bytes_written;
+	int res = 0;
+
+	/* Set global error to none */
+	register_global_error(NULL);
+
+	pthread_mutex_lock(&enumeration_cache_mutex);
+
+	if (!enable) {
+		free_enumeration_cache();
+		goto end;
+	}
+
+	if (enumeration_cache_udev)
+		goto end; /* Already enabled */
+
+	enumeration_cache_udev = udev_new();
+	if (!enumeration_cache_udev) {
+		register_global_error("Couldn't create udev context");
+		res = -1;
+		goto end;
+	}
+
+	/* Start listening before the scan, so that no device which
+	   appears in between is missed. */
+	enumeration_cache_monitor = new_hidraw_monitor(enumeration_cache_udev);
+	if (!enumeration_cache_monitor) {
+		register_global_error("Couldn't create udev monitor");
+		free_enumeration_cache();
+		res = -1;
+		goto end;
+	}
+
+	if (scan_device_info_list(enumeration_cache_udev, &enumeration_cache) < 0) {
+		register_global_error("Couldn't create udev enumerate");
+		free_enumeration_cache();
+		res = -1;
+	}
+
+end:
+	pthread_mutex_unlock(&enumeration_cache_mutex);
+	return res;
+}
+
+/* Copy the matching records out of the enumeration cache. Returns 0 if
+   the cache is disabled. The result is returned in devs. */
+static int enumerate_from_cache(const struct hid_enum_filter *filter, struct hid_device_info **devs)
+{
+	struct device_info_entry *entry;
+	struct hid_device_info *src;
+	struct hid_device_info **tail = devs;
+
+	*devs = NULL;
+
+	pthread_mutex_lock(&enumeration_cache_mutex);
+	if (!enumeration_cache_udev) {
+		pthread_mutex_unlock(&enumeration_cache_mutex);
+		return 0;
+	}
+
+	update_enumeration_cache();
+
+	for (entry = enumeration_cache; entry; entry = entry->next) {
+		for (src = entry->devs; src; src = src->next) {
+			if (device_info_matches(src, filter)) {
+				*tail = copy_device_info(src);
+				if (!*tail)
+					break;
+				tail = &(*tail)->next;
+			}
+		}
+	}
+	pthread_mutex_unlock(&enumeration_cache_mutex);
+
+	return 1;
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate_ex(const struct hid_enum_filter *filter)
+{
+	struct udev *udev;
+	struct udev_enumerate *enumerate;
+	struct udev_list_entry *devices, *dev_list_entry;
+
+	struct hid_device_info *root = NULL; /* return object */
+	struct hid_device_info *cur_dev = NULL;
+
+	hid_init();
+
+	if (enumerate_from_cache(filter, &root))
+		return root;
+
+	/* Create the udev object */
+	udev = udev_new();
+	if (!udev) {
+		register_global_error("Couldn't create udev context");
+		return NULL;
+	}
+
+	/* Create a list of the devices in the 'hidraw' subsystem. */
+	enumerate = udev_enumerate_new(udev);
+	udev_enumerate_add_match_subsystem(enumerate, "hidraw");
+	udev_enumerate_scan_devices(enumerate);
+	devices = udev_enumerate_get_list_entry(enumerate);
+	/* For each item, see if it matches the filter, and if so
+	   create a udev_device record for it */
+	udev_list_entry_foreach(dev_list_entry, devices) {
+		const char *sysfs_path;
+		struct udev_device *raw_dev; /* The device's hidraw udev node. */
+		struct hid_device_info *tmp;
+
+		/* Get the filename of the /sys entry for the device
+		   and create a udev_device object (dev) representing it */
+		sysfs_path = udev_list_entry_get_name(dev_list_entry);
+		raw_dev = udev_device_new_from_syspath(udev, sysfs_path);
+		if (!raw_dev)
+			continue;
+
+		tmp = create_device_info_for_device(raw_dev, filter);
+		if (tmp) {
+			/* Append the records, and move to the last one */
+			if (cur_dev) {
+				cur_dev->next = tmp;
+			}
+			else {
+				root = tmp;
+			}
+			cur_dev = tmp;
+			while (cur_dev->next)
+				cur_dev = cur_dev->next;
+		}
+
+		udev_device_unref(raw_dev);
+	}
+	/* Free the enumerator and udev objects. */
+	udev_enumerate_unref(enumerate);
+	udev_unref(udev);
+
+	return root;
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+	struct hid_enum_filter filter;
+
+	memset(&filter, 0, sizeof(filter));
+	filter.vendor_id = vendor_id;
+	filter.product_id = product_id;
+	if (vendor_id != 0x0)
+		filter.match |= HID_API_MATCH_VENDOR_ID;
+	if (product_id != 0x0)
+		filter.match |= HID_API_MATCH_PRODUCT_ID;
+
+	return hid_enumerate_ex(&filter);
+}
+
+void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
+{
+	struct hid_device_info *d = devs;
+	while (d) {
+		struct hid_device_info *next = d->next;
+		free(d->path);
+		free(d->serial_number);
+		free(d->manufacturer_string);
+		free(d->product_string);
+		free(d);
+		d = next;
+	}
+}
+
+/* Hotplug callbacks, see hid_hotplug_register_callback(). The hotplug
+   thread waits on a udev monitor of the hidraw nodes, and calls the
+   callbacks (see call_hotplug_callbacks()). It keeps the records of
+   the nodes which are present in hotplug_devices, to report them once
+   the node is removed; only the thread uses them while it runs. The
+   hotplug_mutex protects the rest of the below. */
+struct hotplug_callback {
+	hid_hotplug_callback_handle handle;
+	unsigned short vendor_id;
+	unsigned short product_id;
+	int events;
+	hid_hotplug_callback_fn callback;
+	void *user_data;
+	struct hotplug_callback *next;
+};
+
+static pthread_mutex_t hotplug_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct hotplug_callback *hotplug_callbacks = NULL;
+static hid_hotplug_callback_handle next_hotplug_handle = 1;
+static struct udev *hotplug_udev = NULL;
+static struct udev_monitor *hotplug_monitor = NULL;
+static struct device_info_entry *hotplug_devices = NULL;
+static pthread_t hotplug_thread;
+static int hotplug_wakeup_fd = -1; /* -1 while the thread isn't running */
+static int hotplug_dispatching = 0;
+static pthread_cond_t hotplug_dispatch_done = PTHREAD_COND_INITIALIZER;
+
+/* Removes a callback from hotplug_callbacks. Returns 0 on success and
+   -1 if it is not registered. Called with the hotplug_mutex held. */
+static int remove_hotplug_callback(hid_hotplug_callback_handle handle)
+{
+	struct hotplug_callback **cb;
+
+	for (cb = &hotplug_callbacks; *cb; cb = &(*cb)->next) {
+		if ((*cb)->handle == handle) {
+			struct hotplug_callback *found = *cb;
+			*cb = found->next;
+			free(found);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static int hotplug_callback_registered(hid_hotplug_callback_handle handle)
+{
+	struct hotplug_callback *cb;
+	int registered = 0;
+
+	pthread_mutex_lock(&hotplug_mutex);
+	for (cb = hotplug_callbacks; cb; cb = cb->next) {
+		if (cb->handle == handle) {
+			registered = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&hotplug_mutex);
+
+	return registered;
+}
+
+/* Calls the callbacks which match the records of devs. This is called
+   only from the hotplug thread, without the hotplug_mutex held: the
+   callbacks are copied, so that they can call back into hidapi, and
+   each one is checked to still be registered right before it is
+   called. hid_hotplug_deregister_callback() waits for the end of the
+   round while hotplug_dispatching is set. */
+static void call_hotplug_callbacks(struct hid_device_info *devs, hid_hotplug_event event)
+{
+	struct hotplug_callback *callbacks, *c;
+	struct hid_device_info *info;
+	size_t num_callbacks = 0, i;
+
+	pthread_mutex_lock(&hotplug_mutex);
+	for (c = hotplug_callbacks; c; c = c->next)
+		num_callbacks++;
+	callbacks = num_callbacks ? (struct hotplug_callback *) calloc(num_callbacks, sizeof(struct hotplug_callback)) : NULL;
+	if (!callbacks) {
+		pthread_mutex_unlock(&hotplug_mutex);
+		return;
+	}
+	for (c = hotplug_callbacks, i = 0; c; c = c->next, i++)
+		callbacks[i] = *c;
+	hotplug_dispatching = 1;
+	pthread_mutex_unlock(&hotplug_mutex);
+
+	for (info = devs; info; info = info->next) {
+		struct hid_device_info *next = info->next;
+
+		/* Each record is passed on its own */
+		info->next = NULL;
+		for (i = 0; i < num_callbacks; i++) {
+			c = &callbacks[i];
+			if (!(c->events & event) ||
+			    (c->vendor_id != 0x0 && c->vendor_id != info->vendor_id) ||
+			    (c->product_id != 0x0 && c->product_id != info->product_id) ||
+			    !hotplug_callback_registered(c->handle))
+				continue;
+			if (c->callback(c->handle, info, event, c->user_data)) {
+				/* The callback deregistered itself */
+				pthread_mutex_lock(&hotplug_mutex);
+				remove_hotplug_callback(c->handle);
+				pthread_mutex_unlock(&hotplug_mutex);
+			}
+		}
+		info->next = next;
+	}
+
+	pthread_mutex_lock(&hotplug_mutex);
+	hotplug_dispatching = 0;
+	pthread_cond_broadcast(&hotplug_dispatch_done);
+	pthread_mutex_unlock(&hotplug_mutex);
+
+	free(callbacks);
+}
+
+/* Rescan the nodes after events were lost, and report the difference. */
+static void rescan_hotplug_devices(void)
+{
+	struct device_info_entry *old_devices = hotplug_devices;
+	struct device_info_entry *entry, *found;
+
+	hotplug_devices = NULL;
+	scan_device_info_list(hotplug_udev, &hotplug_devices);
+
+	for (entry = hotplug_devices; entry; entry = entry->next) {
+		found = detach_device_info_entry(&old_devices, entry->syspath);
+		if (found)
+			free_device_info_entry(found);
+		else
+			call_hotplug_callbacks(entry->devs, HID_API_HOTPLUG_EVENT_DEVICE_ARRIVED);
+	}
+
+	/* Whatever is left is gone */
+	for (entry = old_devices; entry; entry = entry->next)
+		call_hotplug_callbacks(entry->devs, HID_API_HOTPLUG_EVENT_DEVICE_LEFT);
+	free_device_info_list(&old_devices);
+}
+
+static void process_hotplug_events(void)
+{
+	struct udev_device *raw_dev;
+	struct device_info_entry *entry;
+
+	for (;;) {
+		errno = 0;
+		raw_dev = udev_monitor_receive_device(hotplug_monitor);
+		if (!raw_dev)
+			break;
+
+		const char *action = udev_device_get_action(raw_dev);
+		if (action && strcmp(action, "remove") == 0) {
+			entry = detach_device_info_entry(&hotplug_devices, udev_device_get_syspath(raw_dev));
+			if (entry) {
+				call_hotplug_callbacks(entry->devs, HID_API_HOTPLUG_EVENT_DEVICE_LEFT);
+				free_device_info_entry(entry);
+			}
+		}
+		else if (action && strcmp(action, "add") == 0) {
+			/* A node found by the initial scan may still be
+			   reported by the monitor */
+			int known = 0;
+			entry = detach_device_info_entry(&hotplug_devices, udev_device_get_syspath(raw_dev));
+			if (entry) {
+				known = 1;
+				free_device_info_entry(entry);
+			}
+			entry = add_device_info_entry(&hotplug_devices, raw_dev);
+			if (entry && !known)
+				call_hotplug_callbacks(entry->devs, HID_API_HOTPLUG_EVENT_DEVICE_ARRIVED);
+		}
+		else {
+			/* Only keep the records up to date */
+			add_device_info_entry(&hotplug_devices, raw_dev);
+		}
+
+		udev_device_unref(raw_dev);
+	}
+
+	/* Events were lost if the socket buffer overflowed. */
+	if (errno == ENOBUFS)
+		rescan_hotplug_devices();
+}
+
+static void *hotplug_thread_func(void *param)
+{
+	struct pollfd fds[2];
+	(void) param;
+
+	fds[0].fd = udev_monitor_get_fd(hotplug_monitor);
+	fds[0].events = POLLIN;
+	fds[1].fd = hotplug_wakeup_fd;
+	fds[1].events = POLLIN;
+
+	for (;;) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (fds[1].revents)
+			break; /* Stopped by hid_exit() */
+
+		process_hotplug_events();
+	}
+
+	/* Free the error message left by the enumeration on this thread */
+	register_global_error(NULL);
+
+	return NULL;
+}
+
+static void free_hotplug_resources(void)
+{
+	free_device_info_list(&hotplug_devices);
+	if (hotplug_monitor) {
+		udev_monitor_unref(hotplug_monitor);
+		hotplug_monitor = NULL;
+	}
+	if (hotplug_udev) {
+		udev_unref(hotplug_udev);
+		hotplug_udev = NULL;
+	}
+	if (hotplug_wakeup_fd >= 0) {
+		close(hotplug_wakeup_fd);
+		hotplug_wakeup_fd = -1;
+	}
+}
+
+/* Called with the hotplug_mutex held */
+static int start_hotplug_thread(void)
+{
+	int res;
+
+	hotplug_udev = udev_new();
+	if (!hotplug_udev) {
+		register_global_error("Couldn't create udev context");
+		goto err;
+	}
+
+	/* Start listening before the scan, so that no device which
+	   appears in between is missed. */
+	hotplug_monitor = new_hidraw_monitor(hotplug_udev);
+	if (!hotplug_monitor) {
+		register_global_error("Couldn't create udev monitor");
+		goto err;
+	}
+
+	if (scan_device_info_list(hotplug_udev, &hotplug_devices) < 0) {
+		register_global_error("Couldn't create udev enumerate");
+		goto err;
+	}
+
+	hotplug_wakeup_fd = eventfd(0, EFD_CLOEXEC);
+	if (hotplug_wakeup_fd < 0) {
+		register_global_error(strerror(errno));
+		goto err;
+	}
+
+	res = pthread_create(&hotplug_thread, NULL, hotplug_thread_func, NULL);
+	if (res != 0) {
+		register_global_error(strerror(res));
+		goto err;
+	}
+
+	return 0;
+
+err:
+	free_hotplug_resources();
+	return -1;
+}
+
+static void stop_hotplug_thread(void)
+{
+	struct hotplug_callback *cb;
+	uint64_t value = 1;
+
+	pthread_mutex_lock(&hotplug_mutex);
+	if (hotplug_wakeup_fd < 0) {
+		pthread_mutex_unlock(&hotplug_mutex);
+		return;
+	}
+
+	/* The thread may be waiting for the mutex */
+	pthread_mutex_unlock(&hotplug_mutex);
+	while (write(hotplug_wakeup_fd, &value, sizeof(value)) < 0 && errno == EINTR)
+		;
+	pthread_join(hotplug_thread, NULL);
+
+	pthread_mutex_lock(&hotplug_mutex);
+	while ((cb = hotplug_callbacks) != NULL) {
+		hotplug_callbacks = cb->next;
+		free(cb);
+	}
+	free_hotplug_resources();
+	pthread_mutex_unlock(&hotplug_mutex);
+}
+
+int HID_API_EXPORT hid_hotplug_register_callback(unsigned short vendor_id, unsigned short product_id, int events, hid_hotplug_callback_fn callback, void *user_data, hid_hotplug_callback_handle *callback_handle)
+{
+	struct hotplug_callback *cb, **last;
+
+	/* Set global error to none */
+	register_global_error(NULL);
+
+	if (!callback || !(events & (HID_API_HOTPLUG_EVENT_DEVICE_ARRIVED | HID_API_HOTPLUG_EVENT_DEVICE_LEFT))) {
+		errno = EINVAL;
+		register_global_error(strerror(errno));
+		return -1;
+	}
+
+	cb = (struct hotplug_callback *) calloc(1, sizeof(struct hotplug_callback));
+	if (!cb) {
+		register_global_error("Couldn't allocate memory");
+		return -1;
+	}
+	cb->vendor_id = vendor_id;
+	cb->product_id = product_id;
+	cb->events = events;
+	cb->callback = callback;
+	cb->user_data = user_data;
+
+	pthread_mutex_lock(&hotplug_mutex);
+
+	if (hotplug_wakeup_fd < 0 && start_hotplug_thread() < 0) {
+		pthread_mutex_unlock(&hotplug_mutex);
+		free(cb);
+		return -1;
+	}
+
+	cb->handle = next_hotplug_handle++;
+	for (last = &hotplug_callbacks; *last; last = &(*last)->next)
+		;
+	*last = cb;
+	if (callback_handle)
+		*callback_handle = cb->handle;
+
+	pthread_mutex_unlock(&hotplug_mutex);
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_hotplug_deregister_callback(hid_hotplug_callback_handle callback_handle)
+{
+	int res;
+
+	pthread_mutex_lock(&hotplug_mutex);
+	res = remove_hotplug_callback(callback_handle);
+	/* The callback may be running on the hotplug thread. Wait for it
+	   to return, unless this is the hotplug thread itself (a callback
+	   deregistering itself or another one). */
+	while (res == 0 && hotplug_dispatching && !pthread_equal(pthread_self(), hotplug_thread))
+		pthread_cond_wait(&hotplug_dispatch_done, &hotplug_mutex);
+	pthread_mutex_unlock(&hotplug_mutex);
+
+	return res;
+}
+
+/* Whether the hidraw node raw_dev has the given VID/PID and, unless
+   serial_number is NULL, serial number. Only its uevent is read. */
+static int device_matches(struct udev_device *raw_dev, unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+{
+	struct udev_device *hid_dev;
+	unsigned short dev_vid;
+	unsigned short dev_pid;
+	unsigned bus_type;
+	char *serial_number_utf8 = NULL;
+	char *product_name_utf8 = NULL;
+	int matches = 0;
+
+	hid_dev = udev_device_get_parent_with_subsystem_devtype(
+		raw_dev,
+		"hid",
+		NULL);
+	if (!hid_dev)
+		return 0;
+
+	if (!parse_uevent_info(
+		udev_device_get_sysattr_value(hid_dev, "uevent"),
+		&bus_type,
+		&dev_vid,
+		&dev_pid,
+		&serial_number_utf8,
+		&product_name_utf8))
+		goto end;
+
+	/* Same devices as hid_enumerate() */
+	if (bus_type != BUS_USB && bus_type != BUS_BLUETOOTH && bus_type != BUS_I2C)
+		goto end;
+
+	if (dev_vid != vendor_id || dev_pid != product_id)
+		goto end;
+
+	if (serial_number) {
+		wchar_t *serial = utf8_to_wchar_t(serial_number_utf8);
+		matches = serial && wcscmp(serial_number, serial) == 0;
+		free(serial);
+	}
+	else
+		matches = 1;
+
+end:
+	free(serial_number_utf8);
+	free(product_name_utf8);
+
+	return matches;
+}
+
+/* Find the path of the first device hid_enumerate() would return for
+   the given VID/PID and, unless serial_number is NULL, serial number,
+   without creating the records of the devices. The caller must free
+   the returned path with free(). */
+static char *find_device_path(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+{
+	struct udev *udev;
+	struct udev_enumerate *enumerate;
+	struct udev_list_entry *devices, *dev_list_entry;
+	char *path = NULL;
+
+	/* The enumeration cache has the records already */
+	pthread_mutex_lock(&enumeration_cache_mutex);
+	if (enumeration_cache_udev) {
+		struct device_info_entry *entry;
+
+		update_enumeration_cache();
+		for (entry = enumeration_cache; entry && !path; entry = entry->next) {
+			struct hid_device_info *info = entry->devs;
+			if (info && info->vendor_id == vendor_id && info->product_id == product_id &&
+			    (!serial_number ||
+			     (info->serial_number && wcscmp(serial_number, info->serial_number) == 0)))
+				path = info->path? strdup(info->path): NULL;
+		}
+		pthread_mutex_unlock(&enumeration_cache_mutex);
+		return path;
+	}
+	pthread_mutex_unlock(&enumeration_cache_mutex);
+
+	udev = udev_new();
+	if (!udev) {
+		register_global_error("Couldn't create udev context");
+		return NULL;
+	}
+
+	enumerate = udev_enumerate_new(udev);
+	udev_enumerate_add_match_subsystem(enumerate, "hidraw");
+	udev_enumerate_scan_devices(enumerate);
+	devices = udev_enumerate_get_list_entry(enumerate);
+	udev_list_entry_foreach(dev_list_entry, devices) {
+		struct udev_device *raw_dev;
+
+		raw_dev = udev_device_new_from_syspath(udev, udev_list_entry_get_name(dev_list_entry));
+		if (!raw_dev)
+			continue;
+
+		if (device_matches(raw_dev, vendor_id, product_id, serial_number)) {
+			const char *dev_path = udev_device_get_devnode(raw_dev);
+			path = dev_path? strdup(dev_path): NULL;
+		}
+
+		udev_device_unref(raw_dev);
+		if (path)
+			break;
+	}
+	udev_enumerate_unref(enumerate);
+	udev_unref(udev);
+
+	return path;
+}
+
+hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
+{
+	/* Set global error to none */
+	register_global_error(NULL);
+
+	char *path_to_open;
+	hid_device *handle = NULL;
+
+	hid_init();
+
+	path_to_open = find_device_path(vendor_id, product_id, serial_number);
+	if (path_to_open) {
+		/* Open the device */
+		handle = hid_open_path(path_to_open);
+		free(path_to_open);
+	} else {
+		register_global_error("No such device");
+	}
+
+	return handle;
+}
+
+hid_device * HID_API_EXPORT hid_open_path(const char *path)
+{
+	/* Set global error to none */
+	register_global_error(NULL);
+
+	hid_device *dev = NULL;
+
+	hid_init();
+
+	dev = new_hid_device();
+
+	/* OPEN HERE. The descriptor is non-blocking, so that
+	   hid_read_batch() can drain the queued reports; waiting for a
+	   report is always done with poll(), and hid_write() waits with
+	   poll() too, so that it still blocks. */
+	dev->device_handle = open(path, O_RDWR | O_NONBLOCK);
+
+	/* If we have a good handle, return it. */
+	if (dev->device_handle >= 0) {
+		/* Set device error to none */
+		register_device_error(dev, NULL);
+
+		/* Get the report descriptor */
+		int res, desc_size = 0;
+		struct hidraw_report_descriptor rpt_desc;
+
+		memset(&rpt_desc, 0x0, sizeof(rpt_desc));
+
+		/* Get Report Descriptor Size */
+		res = ioctl(dev->device_handle, HIDIOCGRDESCSIZE, &desc_size);
+		if (res < 0)
+			register_device_error_format(dev, "ioctl (GRDESCSIZE): %s", strerror(errno));
+
+		/* Get Report Descriptor */
+		rpt_desc.size = desc_size;
+		res = ioctl(dev->device_handle, HIDIOCGRDESC, &rpt_desc);
+		if (res < 0) {
+			register_device_error_format(dev, "ioctl (GRDESC): %s", strerror(errno));
+		} else {
+			/* Determine if this device uses numbered reports. */
+			dev->uses_numbered_reports =
+				uses_numbered_reports(rpt_desc.value,
+				                      rpt_desc.size);
+
+			/* Keep it for later */
+			dev->report_descriptor = (__u8*) malloc(rpt_desc.size ? rpt_desc.size : 1);
+			if (dev->report_descriptor) {
+				memcpy(dev->report_descriptor, rpt_desc.value, rpt_desc.size);
+				dev->report_descriptor_size = rpt_desc.size;
+			}
+		}
+
+		/* Get the strings, so that the getters don't have to */
+		load_device_strings(dev);
+
+		return dev;
+	}
+	else {
+		/* Unable to open any devices. */
+		register_global_error(strerror(errno));
+		free(dev);
+		return NULL;
+	}
+}
+
+
+/* Writes to the device node, which is non-blocking (see
+   hid_open_path()). hid_write() has always blocked until the report
+   was taken, so wait for the node to be writable on EAGAIN instead of
+   failing. */
+static ssize_t write_blocking(int fd, const unsigned char *data, size_t length)
+{
+	for (;;) {
+		ssize_t res = write(fd, data, length);
+		struct pollfd fds;
+
+		if (res >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			return res;
+
+		fds.fd = fd;
+		fds.events = POLLOUT;
+		fds.revents = 0;
+		if (poll(&fds, 1, -1) < 0 && errno != EINTR)
+			return -1;
+		if (fds.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+			/* The device is gone */
+			errno = ENODEV;
+			return -1;
+		}
+	}
+}
+
+int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length)
+{
+	int bytes_written;
+	uint64_t start;
 
 	if (!data || (length == 0)) {
 		errno = EINVAL;
@@ -975,67 +1920,641 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
 		return -1;
 	}
 
-	bytes_written = write(dev->device_handle, data, length);
+	start = monotonic_time_ns();
+	bytes_written = (int) write_blocking(dev->device_handle, data, length);
+
+	register_device_error(dev, (bytes_written == -1)? strerror(errno): NULL);
+
+	if (bytes_written < 0) {
+		stats_add(&dev->stats.output_errors, 1);
+	}
+	else {
+		stats_add(&dev->stats.output_reports, 1);
+		stats_add(&dev->stats.output_bytes, (size_t) bytes_written);
+		stats_add_latency(dev->stats.write_latency, monotonic_time_ns() - start);
+	}
+
+	return bytes_written;
+}
+
+
+/* Waits for an input report to arrive, for up to milliseconds, or for
+   ever if milliseconds is -1. Returns 1 if a report can be read, 0 on
+   timeout and -1 on error or disconnection. */
+static int wait_for_input_report(hid_device *dev, int milliseconds)
+{
+	/* Don't rely on read() to block (or to fail) instead of calling
+	   poll(), since some kernels don't seem to properly report device
+	   disconnection through read() when in non-blocking mode. */
+	int ret;
+	struct pollfd fds;
+
+	fds.fd = dev->device_handle;
+	fds.events = POLLIN;
+	fds.revents = 0;
+	ret = poll(&fds, 1, milliseconds);
+	if (ret == 0) {
+		/* Timeout */
+		return ret;
+	}
+	if (ret == -1) {
+		/* Error */
+		register_device_error(dev, strerror(errno));
+		return ret;
+	}
+
+	/* Check for errors on the file descriptor. This will
+	   indicate a device disconnection. */
+	if (fds.revents & (POLLERR | POLLHUP | POLLNVAL))
+		// We cannot use strerror() here as no -1 was returned from poll().
+		return -1;
+
+	return 1;
+}
+
+/* Returns 1 if a report is dropped by the filter of
+   hid_set_input_change_filter(), and counts it. */
+static int suppress_input_report(hid_device *dev, const unsigned char *data, size_t len)
+{
+	int res = 0;
+
+	if (!__atomic_load_n(&dev->input_filter, __ATOMIC_RELAXED))
+		return 0;
+
+	pthread_mutex_lock(&dev->input_filter_mutex);
+	if (dev->input_filter &&
+	    filter_input_report(dev->input_filter, dev->uses_numbered_reports, data, len)) {
+		dev->input_reports_suppressed++;
+		res = 1;
+	}
+	pthread_mutex_unlock(&dev->input_filter_mutex);
+
+	return res;
+}
+
+/* Counts a report read from the device node, whether it is dropped
+   by the filter or not. */
+static void count_input_report(hid_device *dev, size_t len)
+{
+	stats_add(&dev->stats.input_reports, 1);
+	stats_add(&dev->stats.input_bytes, len);
+}
+
+/* Returns the CLOCK_MONOTONIC time in milliseconds. */
+static int64_t monotonic_time_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Gets what is left of a timeout which ends at deadline (in
+   monotonic_time_ms()), for the reads which go on waiting after a
+   report was dropped by the filter. A blocking wait stays blocking. */
+static int get_remaining_timeout(int milliseconds, int64_t deadline)
+{
+	int64_t remaining;
+
+	if (milliseconds <= 0)
+		return milliseconds;
+
+	remaining = deadline - monotonic_time_ms();
+	return remaining > 0 ? (int) remaining : 0;
+}
+
+int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+{
+	/* Set device error to none */
+	register_device_error(dev, NULL);
+
+	int bytes_read;
+	int64_t deadline = milliseconds > 0 ? monotonic_time_ms() + milliseconds : 0;
+
+	for (;;) {
+		int ret = wait_for_input_report(dev, milliseconds);
+		if (ret <= 0)
+			return ret;
+
+		bytes_read = read(dev->device_handle, data, length);
+
+		/* Another reader may have taken the report in the
+		   meantime. Keep waiting if this is a blocking read. */
+		if (bytes_read < 0 && errno == EAGAIN && milliseconds == -1)
+			continue;
+
+		if (bytes_read > 0)
+			count_input_report(dev, (size_t) bytes_read);
+
+		/* Keep waiting for a changed report, within the timeout */
+		if (bytes_read > 0 && suppress_input_report(dev, data, (size_t) bytes_read)) {
+			milliseconds = get_remaining_timeout(milliseconds, deadline);
+			continue;
+		}
+
+		break;
+	}
+
+	if (bytes_read < 0) {
+		if (errno == EAGAIN || errno == EINPROGRESS)
+			bytes_read = 0;
+		else {
+			register_device_error(dev, strerror(errno));
+			stats_add(&dev->stats.input_errors, 1);
+		}
+	}
+
+	return bytes_read;
+}
+
+int HID_API_EXPORT hid_read_timestamped(hid_device *dev, unsigned char *data, size_t length, uint64_t *timestamp_ns, int milliseconds)
+{
+	int bytes_read;
+	struct timespec ts;
+
+	if (!timestamp_ns) {
+		errno = EINVAL;
+		register_device_error(dev, strerror(errno));
+		return -1;
+	}
+
+	bytes_read = hid_read_timeout(dev, data, length, milliseconds);
 
-	register_device_error(dev, (bytes_written == -1)? strerror(errno): NULL);
+	/* hidraw doesn't keep the arrival time of the reports, so take
+	   it right after read() returned. */
+	if (bytes_read > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		*timestamp_ns = (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+	}
 
-	return bytes_written;
+	return bytes_read;
 }
 
+int HID_API_EXPORT hid_read_batch(hid_device *dev, unsigned char *data, size_t stride, size_t max_reports, size_t *lengths, int milliseconds)
+{
+	/* Set device error to none */
+	register_device_error(dev, NULL);
+
+	size_t reports_read = 0;
+	size_t reports_suppressed = 0;
+	int64_t deadline = milliseconds > 0 ? monotonic_time_ms() + milliseconds : 0;
 
-int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+	if (!data || !lengths || max_reports == 0) {
+		errno = EINVAL;
+		register_device_error(dev, strerror(errno));
+		return -1;
+	}
+
+	if (max_reports > INT_MAX)
+		max_reports = INT_MAX;
+
+	do {
+		int ret = wait_for_input_report(dev, milliseconds);
+		if (ret <= 0)
+			return ret;
+
+		/* Drain the reports queued by the kernel, until read()
+		   would block. */
+		while (reports_read < max_reports) {
+			ssize_t bytes_read = read(dev->device_handle, data + reports_read * stride, stride);
+			if (bytes_read < 0) {
+				if (errno == EAGAIN || errno == EINPROGRESS)
+					break;
+				if (reports_read > 0) {
+					/* Return what was read so far. The error
+					   comes up again on the next call. */
+					break;
+				}
+				register_device_error(dev, strerror(errno));
+				stats_add(&dev->stats.input_errors, 1);
+				return -1;
+			}
+			count_input_report(dev, (size_t) bytes_read);
+			if (suppress_input_report(dev, data + reports_read * stride, (size_t) bytes_read)) {
+				/* Read the next one into the same slot */
+				reports_suppressed++;
+				continue;
+			}
+			lengths[reports_read++] = (size_t) bytes_read;
+		}
+
+		/* Keep waiting for a changed report, within the timeout */
+		if (reports_read == 0 && reports_suppressed > 0)
+			milliseconds = get_remaining_timeout(milliseconds, deadline);
+	} while (reports_read == 0 && (milliseconds == -1 || reports_suppressed > 0));
+
+	return (int) reports_read;
+}
+
+int HID_API_EXPORT hid_read_acquire(hid_device *dev, const unsigned char **data, size_t *length, int milliseconds)
 {
 	/* Set device error to none */
 	register_device_error(dev, NULL);
 
 	int bytes_read;
 
-	if (milliseconds >= 0) {
-		/* Milliseconds is either 0 (non-blocking) or > 0 (contains
-		   a valid timeout). In both cases we want to call poll()
-		   and wait for data to arrive.  Don't rely on non-blocking
-		   operation (O_NONBLOCK) since some kernels don't seem to
-		   properly report device disconnection through read() when
-		   in non-blocking mode.  */
-		int ret;
-		struct pollfd fds;
+	if (!data || !length) {
+		errno = EINVAL;
+		register_device_error(dev, strerror(errno));
+		return -1;
+	}
 
-		fds.fd = dev->device_handle;
-		fds.events = POLLIN;
-		fds.revents = 0;
-		ret = poll(&fds, 1, milliseconds);
-		if (ret == 0) {
-			/* Timeout */
-			return ret;
+	if (dev->report_lent) {
+		register_device_error(dev, "The previous report was not released");
+		return -1;
+	}
+
+	/* The kernel copies each report out to user space anyway, so
+	   read into a buffer of the device and lend that one. */
+	if (!dev->report_buffer) {
+		dev->report_buffer = (unsigned char *) malloc(HIDRAW_MAX_REPORT_SIZE);
+		if (!dev->report_buffer) {
+			register_device_error(dev, "Couldn't allocate memory");
+			return -1;
 		}
-		if (ret == -1) {
-			/* Error */
-			register_device_error(dev, strerror(errno));
-			return ret;
+	}
+
+	bytes_read = hid_read_timeout(dev, dev->report_buffer, HIDRAW_MAX_REPORT_SIZE, milliseconds);
+	if (bytes_read <= 0)
+		return bytes_read;
+
+	dev->report_lent = 1;
+	*data = dev->report_buffer;
+	*length = (size_t) bytes_read;
+
+	return 1;
+}
+
+int HID_API_EXPORT hid_read_release(hid_device *dev, const unsigned char *data)
+{
+	if (!dev->report_lent || data != dev->report_buffer) {
+		register_device_error(dev, "No such report was acquired");
+		return -1;
+	}
+
+	dev->report_lent = 0;
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
+{
+	return hid_read_timeout(dev, data, length, (dev->blocking)? -1: 0);
+}
+
+int HID_API_EXPORT hid_get_poll_fd(hid_device *dev)
+{
+	/* The hidraw node itself becomes readable when a report arrives,
+	   and reports POLLERR/POLLHUP on disconnection. */
+	return dev->device_handle;
+}
+
+int HID_API_EXPORT hid_poll(hid_device **devs, int n, int *ready, int timeout_ms)
+{
+	const char *error;
+	int res;
+
+	/* Set global error to none */
+	register_global_error(NULL);
+
+	res = poll_devices(devs, n, ready, timeout_ms, &error);
+	if (res < 0 && error)
+		register_global_error(error);
+
+	return res;
+}
+
+static void *input_callback_thread(void *param)
+{
+	hid_device *dev = (hid_device *) param;
+	struct pollfd fds[2];
+	unsigned char *buf;
+	ssize_t bytes_read;
+	uint64_t timestamp;
+	int stopped = 0;
+
+	buf = (unsigned char *) malloc(HIDRAW_MAX_REPORT_SIZE);
+	if (!buf)
+		return NULL;
+
+	fds[0].fd = dev->device_handle;
+	fds[0].events = POLLIN;
+	fds[1].fd = dev->callback_wakeup_fd;
+	fds[1].events = POLLIN;
+
+	for (;;) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
 		}
-		else {
-			/* Check for errors on the file descriptor. This will
-			   indicate a device disconnection. */
-			if (fds.revents & (POLLERR | POLLHUP | POLLNVAL))
-				// We cannot use strerror() here as no -1 was returned from poll().
-				return -1;
+		if (fds[1].revents) {
+			stopped = 1; /* By hid_set_input_callback() or hid_close() */
+			break;
+		}
+		if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL))
+			break; /* Device disconnected */
+
+		bytes_read = read(dev->device_handle, buf, HIDRAW_MAX_REPORT_SIZE);
+		if (bytes_read < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			stats_add(&dev->stats.input_errors, 1);
+			break;
 		}
+		timestamp = monotonic_time_ns();
+		count_input_report(dev, (size_t) bytes_read);
+
+		if (suppress_input_report(dev, buf, (size_t) bytes_read))
+			continue;
+
+		pthread_mutex_lock(&dev->callback_mutex);
+		if (dev->input_callback)
+			dev->input_callback(dev, buf, (size_t) bytes_read, dev->input_callback_data);
+		else if (dev->latest_report_mode)
+			store_latest_report(dev->latest_reports, dev->uses_numbered_reports, buf, (size_t) bytes_read);
+		else if (dev->report_id_mode)
+			queue_report_id_report(dev->report_id_queues, dev->uses_numbered_reports, buf, (size_t) bytes_read, timestamp, &dev->stats);
+		pthread_mutex_unlock(&dev->callback_mutex);
 	}
 
-	bytes_read = read(dev->device_handle, data, length);
-	if (bytes_read < 0) {
-		if (errno == EAGAIN || errno == EINPROGRESS)
-			bytes_read = 0;
-		else
+	if (!stopped) {
+		/* The device is gone, wake up the readers */
+		pthread_mutex_lock(&dev->callback_mutex);
+		dev->callback_thread_device_gone = 1;
+		if (dev->report_id_queues)
+			shutdown_report_id_queues(dev->report_id_queues);
+		pthread_mutex_unlock(&dev->callback_mutex);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static void stop_input_callback_thread(hid_device *dev)
+{
+	uint64_t value = 1;
+
+	if (!dev->callback_thread_running)
+		return;
+
+	/* Neither can fail: the eventfd counter is only ever 0 or 1. */
+	while (write(dev->callback_wakeup_fd, &value, sizeof(value)) < 0 && errno == EINTR)
+		;
+	pthread_join(dev->callback_thread, NULL);
+	while (read(dev->callback_wakeup_fd, &value, sizeof(value)) < 0 && errno == EINTR)
+		;
+	dev->callback_thread_running = 0;
+}
+
+static int start_input_callback_thread(hid_device *dev)
+{
+	int res;
+
+	if (dev->callback_thread_running)
+		return 0;
+
+	if (dev->callback_wakeup_fd < 0) {
+		dev->callback_wakeup_fd = eventfd(0, EFD_CLOEXEC);
+		if (dev->callback_wakeup_fd < 0) {
 			register_device_error(dev, strerror(errno));
+			return -1;
+		}
 	}
 
-	return bytes_read;
+	res = pthread_create(&dev->callback_thread, NULL, input_callback_thread, dev);
+	if (res != 0) {
+		register_device_error(dev, strerror(res));
+		return -1;
+	}
+	dev->callback_thread_running = 1;
+
+	return 0;
 }
 
-int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
+int HID_API_EXPORT hid_set_input_callback(hid_device *dev, hid_input_callback callback, void *user_data)
 {
-	return hid_read_timeout(dev, data, length, (dev->blocking)? -1: 0);
+	int needs_thread;
+
+	/* Set device error to none */
+	register_device_error(dev, NULL);
+
+	/* The callback thread calls the callback with the mutex held, so
+	   once it is taken here the previous one has returned. */
+	pthread_mutex_lock(&dev->callback_mutex);
+	dev->input_callback = callback;
+	dev->input_callback_data = user_data;
+	needs_thread = callback || dev->latest_report_mode || dev->report_id_mode;
+	pthread_mutex_unlock(&dev->callback_mutex);
+
+	if (!needs_thread) {
+		stop_input_callback_thread(dev);
+		return 0;
+	}
+
+	if (start_input_callback_thread(dev) < 0)
+		goto err;
+
+	return 0;
+
+err:
+	pthread_mutex_lock(&dev->callback_mutex);
+	dev->input_callback = NULL;
+	dev->input_callback_data = NULL;
+	pthread_mutex_unlock(&dev->callback_mutex);
+	return -1;
+}
+
+/* Gets the sizes of the Input reports of a device from its report
+   descriptor. */
+static int get_device_input_report_sizes(hid_device *dev, size_t *sizes)
+{
+	const struct hid_report_field *fields;
+	int num_fields;
+
+	num_fields = hid_get_report_fields(dev, &fields);
+	if (num_fields < 0)
+		return -1;
+
+	/* Numbered reports are told apart by uses_numbered_reports() */
+	get_input_report_sizes(fields, num_fields, sizes);
+	return 0;
+}
+
+int HID_API_EXPORT hid_set_latest_report_mode(hid_device *dev, int enable)
+{
+	int needs_thread;
+
+	/* Set device error to none */
+	register_device_error(dev, NULL);
+
+	if (enable && !dev->latest_reports) {
+		size_t sizes[256];
+		struct latest_report *reports;
+		unsigned char *buffer;
+
+		if (get_device_input_report_sizes(dev, sizes) < 0)
+			return -1;
+		if (alloc_latest_reports(sizes, &reports, &buffer) < 0) {
+			register_device_error(dev, "Couldn't allocate memory");
+			return -1;
+		}
+		dev->latest_report_buffer = buffer;
+		__atomic_store_n(&dev->latest_reports, reports, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_lock(&dev->callback_mutex);
+	dev->latest_report_mode = enable ? 1 : 0;
+	needs_thread = enable || dev->input_callback || dev->report_id_mode;
+	pthread_mutex_unlock(&dev->callback_mutex);
+
+	if (!needs_thread) {
+		stop_input_callback_thread(dev);
+		return 0;
+	}
+
+	if (start_input_callback_thread(dev) < 0) {
+		pthread_mutex_lock(&dev->callback_mutex);
+		dev->latest_report_mode = 0;
+		pthread_mutex_unlock(&dev->callback_mutex);
+		return -1;
+	}
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_get_latest_report(hid_device *dev, unsigned char report_id, unsigned char *data, size_t length, size_t *sequence)
+{
+	struct latest_report *reports = __atomic_load_n(&dev->latest_reports, __ATOMIC_ACQUIRE);
+
+	/* The device error is left alone on success, so that this can be
+	   called from several threads at once */
+	if (!reports) {
+		register_device_error(dev, "The latest report mode is not enabled");
+		return -1;
+	}
+	if (!data || reports[report_id].size == 0) {
+		register_device_error(dev, "Invalid argument");
+		return -1;
+	}
+
+	return read_latest_report(&reports[report_id], data, length, sequence);
+}
+
+int HID_API_EXPORT hid_set_report_id_queues(hid_device *dev, int enable)
+{
+	int needs_thread;
+
+	/* Set device error to none */
+	register_device_error(dev, NULL);
+
+	if (enable && !dev->report_id_queues) {
+		size_t sizes[256];
+		struct report_id_queue **queues;
+
+		if (get_device_input_report_sizes(dev, sizes) < 0)
+			return -1;
+		queues = alloc_report_id_queues(sizes);
+		if (!queues) {
+			register_device_error(dev, "Couldn't allocate memory");
+			return -1;
+		}
+		__atomic_store_n(&dev->report_id_queues, queues, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_lock(&dev->callback_mutex);
+	dev->report_id_mode = enable ? 1 : 0;
+	if (enable && dev->callback_thread_device_gone)
+		shutdown_report_id_queues(dev->report_id_queues);
+	needs_thread = enable || dev->input_callback || dev->latest_report_mode;
+	pthread_mutex_unlock(&dev->callback_mutex);
+
+	if (!needs_thread) {
+		stop_input_callback_thread(dev);
+		return 0;
+	}
+
+	if (start_input_callback_thread(dev) < 0) {
+		pthread_mutex_lock(&dev->callback_mutex);
+		dev->report_id_mode = 0;
+		pthread_mutex_unlock(&dev->callback_mutex);
+		return -1;
+	}
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_read_report_id(hid_device *dev, unsigned char report_id, unsigned char *data, size_t length, int milliseconds)
+{
+	struct report_id_queue **queues = __atomic_load_n(&dev->report_id_queues, __ATOMIC_ACQUIRE);
+
+	/* Like hid_get_latest_report(), for several readers at once */
+	if (!queues) {
+		register_device_error(dev, "The report ID queues are not enabled");
+		return -1;
+	}
+	if (!data || !queues[report_id]) {
+		register_device_error(dev, "Invalid argument");
+		return -1;
+	}
+
+	return read_report_id_queue(queues[report_id], data, length, milliseconds, &dev->stats);
+}
+
+int HID_API_EXPORT hid_set_input_change_filter(hid_device *dev, int enable, const unsigned char *mask, size_t mask_length)
+{
+	struct input_filter *filter = NULL;
+
+	/* Set device error to none */
+	register_device_error(dev, NULL);
+
+	if (enable) {
+		size_t sizes[256];
+
+		if (get_device_input_report_sizes(dev, sizes) < 0)
+			return -1;
+		filter = alloc_input_filter(sizes, mask, mask_length);
+		if (!filter) {
+			register_device_error(dev, "Couldn't allocate memory");
+			return -1;
+		}
+	}
+
+	pthread_mutex_lock(&dev->input_filter_mutex);
+	free(dev->input_filter);
+	__atomic_store_n(&dev->input_filter, filter, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&dev->input_filter_mutex);
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_get_input_reports_suppressed(hid_device *dev, size_t *suppressed)
+{
+	if (!suppressed) {
+		register_device_error(dev, "Invalid argument");
+		return -1;
+	}
+
+	pthread_mutex_lock(&dev->input_filter_mutex);
+	*suppressed = dev->input_reports_suppressed;
+	pthread_mutex_unlock(&dev->input_filter_mutex);
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_get_stats(hid_device *dev, struct hid_stats *stats)
+{
+	if (!stats) {
+		register_device_error(dev, "Invalid argument");
+		return -1;
+	}
+
+	read_device_stats(&dev->stats, stats);
+
+	pthread_mutex_lock(&dev->input_filter_mutex);
+	stats->input_reports_suppressed = dev->input_reports_suppressed;
+	pthread_mutex_unlock(&dev->input_filter_mutex);
+
+	return 0;
 }
 
 int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
@@ -1087,6 +2606,12 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 	if (!dev)
 		return;
 
+	stop_input_callback_thread(dev);
+	if (dev->callback_wakeup_fd >= 0)
+		close(dev->callback_wakeup_fd);
+	pthread_mutex_destroy(&dev->callback_mutex);
+	pthread_mutex_destroy(&dev->input_filter_mutex);
+
 	int ret = close(dev->device_handle);
 
 	register_global_error((ret == -1)? strerror(errno): NULL);
@@ -1094,6 +2619,15 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 	/* Free the device error message */
 	register_device_error(dev, NULL);
 
+	for (int i = 0; i < DEVICE_STRING_COUNT; i++)
+		free(dev->strings[i]);
+	free(dev->report_descriptor);
+	free(dev->report_fields);
+	free(dev->latest_reports);
+	free(dev->latest_report_buffer);
+	free_report_id_queues(dev->report_id_queues);
+	free(dev->input_filter);
+	free(dev->report_buffer);
 	free(dev);
 }
 
@@ -1122,6 +2656,30 @@ int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index
 	return -1;
 }
 
+int HID_API_EXPORT_CALL hid_get_report_fields(hid_device *dev, const struct hid_report_field **fields)
+{
+	register_device_error(dev, NULL);
+
+	if (!fields) {
+		register_device_error(dev, "Invalid argument");
+		return -1;
+	}
+
+	if (dev->num_report_fields < 0) {
+		if (!dev->report_descriptor) {
+			register_device_error(dev, "The report descriptor could not be read");
+			return -1;
+		}
+		dev->num_report_fields = compile_report_descriptor(dev->report_descriptor, dev->report_descriptor_size, &dev->report_fields);
+		if (dev->num_report_fields < 0) {
+			register_device_error(dev, "Couldn't compile the report descriptor");
+			return -1;
+		}
+	}
+
+	*fields = dev->report_fields;
+	return dev->num_report_fields;
+}
 
 /* Passing in NULL means asking for the last global error message. */
 HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
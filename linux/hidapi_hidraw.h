@@ -0,0 +1,61 @@
+/*******************************************************
+ HIDAPI - Multi-Platform library for
+ communication with HID devices.
+
+ libusb/hidapi Team
+
+ Copyright 2022, All Rights Reserved.
+
+ At the discretion of the user of this library,
+ this software may be licensed under the terms of the
+ GNU General Public License v3, a BSD-Style license, or the
+ original HIDAPI license as outlined in the LICENSE.txt,
+ LICENSE-gpl3.txt, LICENSE-bsd.txt, and LICENSE-orig.txt
+ files located at the root of the source distribution.
+ These files may also be found in the public source
+ code repository located at:
+        https://github.com/libusb/hidapi .
+********************************************************/
+
+/** @file
+ * @defgroup API hidapi API
+ */
+
+#ifndef HIDAPI_HIDRAW_H__
+#define HIDAPI_HIDRAW_H__
+
+#include "hidapi.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+		/** @brief Keep the result of hid_enumerate() in memory.
+
+			By default each hid_enumerate() (and hid_open(), which
+			enumerates the devices to find the one to open) scans
+			the whole hidraw subsystem, and reads the report
+			descriptor of every node from sysfs.
+
+			With the cache enabled, the nodes are scanned once, and a
+			udev monitor records the nodes which are added or removed
+			afterwards. hid_enumerate() then only applies the changes
+			recorded since the previous call, and returns a copy of
+			the cached records.
+
+			The cache is disabled by hid_exit().
+
+			@ingroup API
+			@param enable 1 to enable the cache, 0 to disable it and
+				free its memory.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT_CALL hid_hidraw_set_enumeration_cache(int enable);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -29,13 +29,22 @@
 #include <CoreFoundation/CoreFoundation.h>
 #include <wchar.h>
 #include <locale.h>
+#include <limits.h>
 #include <pthread.h>
 #include <sys/time.h>
 #include <unistd.h>
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <mach/mach_time.h>
 
 #include "hidapi_darwin.h"
 
+/* hid_enumerate_ex() and hid_poll() helpers of hid_report.c */
+#define HID_REPORT_ENUM_HELPERS
+#define HID_REPORT_POLL_HELPERS
+#include "hid_report.c"
+
 /* As defined in AppKit.h, but we don't need the entire AppKit for a single constant. */
 extern const double NSAppKitVersionNumber;
 
@@ -99,12 +108,13 @@ static int pthread_barrier_wait(pthread_barrier_t *barrier)
 	}
 }
 
-static int return_data(hid_device *dev, unsigned char *data, size_t length);
+static int return_data(hid_device *dev, unsigned char *data, size_t length, uint64_t *timestamp);
 
 /* Linked List of input reports received from the device. */
 struct input_report {
 	uint8_t *data;
 	size_t len;
+	uint64_t timestamp; /* mach_absolute_time(), in nanoseconds */
 	struct input_report *next;
 };
 
@@ -132,6 +142,23 @@ struct hid_device_ {
 	uint8_t *input_report_buf;
 	CFIndex max_input_report_len;
 	struct input_report *input_reports;
+	struct input_report *lent_report; /* See hid_read_acquire() */
+
+	/* Pipe of hid_get_poll_fd(), -1 until it is first called.
+	   Protected by the mutex. */
+	int poll_fds[2];
+	int poll_fd_signaled;
+
+	/* See hid_set_input_callback(). hid_report_callback() calls
+	   input_callback with callback_mutex held. */
+	pthread_mutex_t callback_mutex;
+	hid_input_callback input_callback;
+	void *input_callback_data;
+
+	/* See hid_get_report_fields(). Compiled from the report descriptor
+	   on first use; num_report_fields is -1 until then. */
+	struct hid_report_field *report_fields;
+	int num_report_fields;
 
 	pthread_t thread;
 	pthread_mutex_t mutex; /* Protects input_reports */
@@ -155,9 +182,14 @@ static hid_device *new_hid_device(void)
 	dev->input_report_buf = NULL;
 	dev->input_reports = NULL;
 	dev->shutdown_thread = 0;
+	dev->poll_fds[0] = -1;
+	dev->poll_fds[1] = -1;
+	dev->report_fields = NULL;
+	dev->num_report_fields = -1;
 
 	/* Thread objects */
 	pthread_mutex_init(&dev->mutex, NULL);
+	pthread_mutex_init(&dev->callback_mutex, NULL);
 	pthread_cond_init(&dev->condition, NULL);
 	pthread_barrier_init(&dev->barrier, NULL, 2);
 	pthread_barrier_init(&dev->shutdown_barrier, NULL, 2);
@@ -178,6 +210,10 @@ static void free_hid_device(hid_device *dev)
 		free(rpt);
 		rpt = next;
 	}
+	if (dev->lent_report) {
+		free(dev->lent_report->data);
+		free(dev->lent_report);
+	}
 
 	/* Free the string and the report buffer. The check for NULL
 	   is necessary here as CFRelease() doesn't handle NULL like
@@ -187,11 +223,19 @@ static void free_hid_device(hid_device *dev)
 	if (dev->source)
 		CFRelease(dev->source);
 	free(dev->input_report_buf);
+	free(dev->report_fields);
+
+	/* Close the pipe of hid_get_poll_fd() */
+	if (dev->poll_fds[0] >= 0) {
+		close(dev->poll_fds[0]);
+		close(dev->poll_fds[1]);
+	}
 
 	/* Clean up the thread objects */
 	pthread_barrier_destroy(&dev->shutdown_barrier);
 	pthread_barrier_destroy(&dev->barrier);
 	pthread_cond_destroy(&dev->condition);
+	pthread_mutex_destroy(&dev->callback_mutex);
 	pthread_mutex_destroy(&dev->mutex);
 
 	/* Free the structure itself. */
@@ -238,6 +282,26 @@ static unsigned short get_product_id(IOHIDDeviceRef device)
 	return get_int_property(device, CFSTR(kIOHIDProductIDKey));
 }
 
+static hid_bus_type get_bus_type(IOHIDDeviceRef device)
+{
+	CFTypeRef transport = IOHIDDeviceGetProperty(device, CFSTR(kIOHIDTransportKey));
+
+	if (transport == NULL || CFGetTypeID(transport) != CFStringGetTypeID())
+		return HID_API_BUS_UNKNOWN;
+
+	/* Bluetooth LE devices report "Bluetooth Low Energy" */
+	if (CFStringCompare((CFStringRef) transport, CFSTR("USB"), 0) == kCFCompareEqualTo)
+		return HID_API_BUS_USB;
+	if (CFStringHasPrefix((CFStringRef) transport, CFSTR("Bluetooth")))
+		return HID_API_BUS_BLUETOOTH;
+	if (CFStringCompare((CFStringRef) transport, CFSTR("I2C"), 0) == kCFCompareEqualTo)
+		return HID_API_BUS_I2C;
+	if (CFStringCompare((CFStringRef) transport, CFSTR("SPI"), 0) == kCFCompareEqualTo)
+		return HID_API_BUS_SPI;
+
+	return HID_API_BUS_UNKNOWN;
+}
+
 static int32_t get_max_report_length(IOHIDDeviceRef device)
 {
 	return get_int_property(device, CFSTR(kIOHIDMaxInputReportSizeKey));
@@ -441,6 +505,9 @@ static struct hid_device_info *create_device_info_with_usage(IOHIDDeviceRef dev,
 	/* Release Number */
 	cur_dev->release_number = get_int_property(dev, CFSTR(kIOHIDVersionNumberKey));
 
+	/* Bus Type */
+	cur_dev->bus_type = get_bus_type(dev);
+
 	/* Interface Number */
 	/* We can only retrieve the interface number for USB HID devices.
 	 * IOKit always seems to return 0 when querying a standard USB device
@@ -597,6 +664,25 @@ void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
 	}
 }
 
+int HID_API_EXPORT hid_hotplug_register_callback(unsigned short vendor_id, unsigned short product_id, int events, hid_hotplug_callback_fn callback, void *user_data, hid_hotplug_callback_handle *callback_handle)
+{
+	(void) vendor_id;
+	(void) product_id;
+	(void) events;
+	(void) callback;
+	(void) user_data;
+	(void) callback_handle;
+
+	/* Not implemented on macOS yet */
+	return -1;
+}
+
+int HID_API_EXPORT hid_hotplug_deregister_callback(hid_hotplug_callback_handle callback_handle)
+{
+	(void) callback_handle;
+	return -1;
+}
+
 hid_device * HID_API_EXPORT hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
 {
 	/* This function is identical to the Linux version. Platform independent. */
@@ -646,6 +732,39 @@ static void hid_device_removal_callback(void *context, IOReturn result,
 	CFRunLoopStop(d->run_loop);
 }
 
+/* Makes the fd returned by hid_get_poll_fd() readable if there is an
+   input report to read or the device is gone, and not readable
+   otherwise. This should be called with dev->mutex locked, whenever
+   either may have changed. */
+static void update_poll_fd(hid_device *dev)
+{
+	int ready;
+
+	if (dev->poll_fds[0] < 0)
+		return;
+
+	ready = dev->input_reports || dev->disconnected || dev->shutdown_thread;
+	if (ready && !dev->poll_fd_signaled) {
+		char c = 0;
+		if (write(dev->poll_fds[1], &c, 1) < 0)
+			ready = 0;
+	}
+	else if (!ready && dev->poll_fd_signaled) {
+		char c;
+		if (read(dev->poll_fds[0], &c, 1) < 0)
+			ready = 1;
+	}
+	dev->poll_fd_signaled = ready;
+}
+
+/* Returns mach_absolute_time() in nanoseconds. */
+static uint64_t monotonic_time_ns(void)
+{
+	mach_timebase_info_data_t timebase;
+	mach_timebase_info(&timebase);
+	return mach_absolute_time() * timebase.numer / timebase.denom;
+}
+
 /* The Run Loop calls this function for each input report received.
    This function puts the data into a linked list to be picked up by
    hid_read(). */
@@ -661,11 +780,21 @@ static void hid_report_callback(void *context, IOReturn result, void *sender,
 	struct input_report *rpt;
 	hid_device *dev = (hid_device*) context;
 
+	/* Hand the report straight to the callback, if there is one. */
+	pthread_mutex_lock(&dev->callback_mutex);
+	if (dev->input_callback) {
+		dev->input_callback(dev, report, (size_t) report_length, dev->input_callback_data);
+		pthread_mutex_unlock(&dev->callback_mutex);
+		return;
+	}
+	pthread_mutex_unlock(&dev->callback_mutex);
+
 	/* Make a new Input Report object */
 	rpt = (struct input_report*) calloc(1, sizeof(struct input_report));
 	rpt->data = (uint8_t*) calloc(1, report_length);
 	memcpy(rpt->data, report, report_length);
 	rpt->len = report_length;
+	rpt->timestamp = monotonic_time_ns();
 	rpt->next = NULL;
 
 	/* Lock this section */
@@ -690,12 +819,13 @@ static void hid_report_callback(void *context, IOReturn result, void *sender,
 		   way we don't grow forever if the user never reads
 		   anything from the device. */
 		if (num_queued > 30) {
-			return_data(dev, NULL, 0);
+			return_data(dev, NULL, 0, NULL);
 		}
 	}
 
 	/* Signal a waiting thread that there is data. */
 	pthread_cond_signal(&dev->condition);
+	update_poll_fd(dev);
 
 	/* Unlock */
 	pthread_mutex_unlock(&dev->mutex);
@@ -764,6 +894,7 @@ static void *read_thread(void *param)
 	   signaled. */
 	pthread_mutex_lock(&dev->mutex);
 	pthread_cond_broadcast(&dev->condition);
+	update_poll_fd(dev);
 	pthread_mutex_unlock(&dev->mutex);
 
 	/* Wait here until hid_close() is called and makes it past
@@ -949,13 +1080,15 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
 }
 
 /* Helper function, so that this isn't duplicated in hid_read(). */
-static int return_data(hid_device *dev, unsigned char *data, size_t length)
+static int return_data(hid_device *dev, unsigned char *data, size_t length, uint64_t *timestamp)
 {
 	/* Copy the data out of the linked list item (rpt) into the
 	   return buffer (data), and delete the liked list item. */
 	struct input_report *rpt = dev->input_reports;
 	size_t len = (length < rpt->len)? length: rpt->len;
 	memcpy(data, rpt->data, len);
+	if (timestamp)
+		*timestamp = rpt->timestamp;
 	dev->input_reports = rpt->next;
 	free(rpt->data);
 	free(rpt);
@@ -1003,32 +1136,25 @@ static int cond_timedwait(const hid_device *dev, pthread_cond_t *cond, pthread_m
 
 }
 
-int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+/* Waits for an input report to be queued up, for up to milliseconds,
+   or for ever if milliseconds is -1. Returns 1 if there is a report
+   to return, 0 on timeout and -1 on error or disconnection.
+   This should be called with dev->mutex locked. */
+static int wait_for_input_reports(hid_device *dev, int milliseconds)
 {
-	int bytes_read = -1;
-
-	/* Lock the access to the report list. */
-	pthread_mutex_lock(&dev->mutex);
-
-	/* There's an input report queued up. Return it. */
-	if (dev->input_reports) {
-		/* Return the first one */
-		bytes_read = return_data(dev, data, length);
-		goto ret;
-	}
+	/* There's an input report queued up. */
+	if (dev->input_reports)
+		return 1;
 
 	/* Return if the device has been disconnected. */
-	if (dev->disconnected) {
-		bytes_read = -1;
-		goto ret;
-	}
+	if (dev->disconnected)
+		return -1;
 
 	if (dev->shutdown_thread) {
 		/* This means the device has been closed (or there
 		   has been an error. An error code of -1 should
 		   be returned. */
-		bytes_read = -1;
-		goto ret;
+		return -1;
 	}
 
 	/* There is no data. Go to sleep and wait for data. */
@@ -1038,11 +1164,10 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 		int res;
 		res = cond_wait(dev, &dev->condition, &dev->mutex);
 		if (res == 0)
-			bytes_read = return_data(dev, data, length);
-		else {
-			/* There was an error, or a device disconnection. */
-			bytes_read = -1;
-		}
+			return 1;
+
+		/* There was an error, or a device disconnection. */
+		return -1;
 	}
 	else if (milliseconds > 0) {
 		/* Non-blocking, but called with timeout. */
@@ -1060,28 +1185,255 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 
 		res = cond_timedwait(dev, &dev->condition, &dev->mutex, &ts);
 		if (res == 0)
-			bytes_read = return_data(dev, data, length);
+			return 1;
 		else if (res == ETIMEDOUT)
-			bytes_read = 0;
+			return 0;
 		else
-			bytes_read = -1;
+			return -1;
 	}
-	else {
-		/* Purely non-blocking */
-		bytes_read = 0;
+
+	/* Purely non-blocking */
+	return 0;
+}
+
+/* Implements hid_read_timeout() and hid_read_timestamped(). The
+   timestamp is only returned if it's not NULL. */
+static int read_timeout(hid_device *dev, unsigned char *data, size_t length, uint64_t *timestamp, int milliseconds)
+{
+	int bytes_read = -1;
+
+	/* Lock the access to the report list. */
+	pthread_mutex_lock(&dev->mutex);
+
+	bytes_read = wait_for_input_reports(dev, milliseconds);
+	if (bytes_read > 0) {
+		/* Return the first one */
+		bytes_read = return_data(dev, data, length, timestamp);
 	}
 
-ret:
+	update_poll_fd(dev);
+
 	/* Unlock */
 	pthread_mutex_unlock(&dev->mutex);
 	return bytes_read;
 }
 
+int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+{
+	return read_timeout(dev, data, length, NULL, milliseconds);
+}
+
+int HID_API_EXPORT hid_read_timestamped(hid_device *dev, unsigned char *data, size_t length, uint64_t *timestamp_ns, int milliseconds)
+{
+	if (!timestamp_ns)
+		return -1;
+
+	return read_timeout(dev, data, length, timestamp_ns, milliseconds);
+}
+
 int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
 {
 	return hid_read_timeout(dev, data, length, (dev->blocking)? -1: 0);
 }
 
+int HID_API_EXPORT hid_read_batch(hid_device *dev, unsigned char *data, size_t stride, size_t max_reports, size_t *lengths, int milliseconds)
+{
+	int reports_read = -1;
+
+	if (!data || !lengths || max_reports == 0)
+		return -1;
+
+	if (max_reports > INT_MAX)
+		max_reports = INT_MAX;
+
+	/* Lock the access to the report list. */
+	pthread_mutex_lock(&dev->mutex);
+
+	/* Wait once, then take every report which is queued up. */
+	reports_read = wait_for_input_reports(dev, milliseconds);
+	if (reports_read > 0) {
+		reports_read = 0;
+		while (dev->input_reports && (size_t) reports_read < max_reports) {
+			lengths[reports_read] = return_data(dev, data + reports_read * stride, stride, NULL);
+			reports_read++;
+		}
+	}
+
+	update_poll_fd(dev);
+
+	/* Unlock */
+	pthread_mutex_unlock(&dev->mutex);
+	return reports_read;
+}
+
+int HID_API_EXPORT hid_read_acquire(hid_device *dev, const unsigned char **data, size_t *length, int milliseconds)
+{
+	int res = -1;
+
+	if (!data || !length)
+		return -1;
+
+	/* Lock the access to the report list. */
+	pthread_mutex_lock(&dev->mutex);
+
+	if (!dev->lent_report)
+		res = wait_for_input_reports(dev, milliseconds);
+	if (res > 0) {
+		/* Unlink the first report and lend its data out, until
+		   hid_read_release() frees it. */
+		struct input_report *rpt = dev->input_reports;
+		dev->input_reports = rpt->next;
+		dev->lent_report = rpt;
+		*data = rpt->data;
+		*length = rpt->len;
+	}
+
+	update_poll_fd(dev);
+
+	/* Unlock */
+	pthread_mutex_unlock(&dev->mutex);
+	return res;
+}
+
+int HID_API_EXPORT hid_read_release(hid_device *dev, const unsigned char *data)
+{
+	struct input_report *rpt;
+
+	pthread_mutex_lock(&dev->mutex);
+	rpt = dev->lent_report;
+	if (!rpt || data != rpt->data) {
+		pthread_mutex_unlock(&dev->mutex);
+		return -1;
+	}
+	dev->lent_report = NULL;
+	pthread_mutex_unlock(&dev->mutex);
+
+	free(rpt->data);
+	free(rpt);
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_get_poll_fd(hid_device *dev)
+{
+	int fd;
+
+	pthread_mutex_lock(&dev->mutex);
+
+	if (dev->poll_fds[0] < 0) {
+		if (pipe(dev->poll_fds) == 0) {
+			fcntl(dev->poll_fds[0], F_SETFL, O_NONBLOCK);
+			fcntl(dev->poll_fds[1], F_SETFL, O_NONBLOCK);
+			fcntl(dev->poll_fds[0], F_SETFD, FD_CLOEXEC);
+			fcntl(dev->poll_fds[1], F_SETFD, FD_CLOEXEC);
+
+			/* Reports may be queued already. */
+			dev->poll_fd_signaled = 0;
+			update_poll_fd(dev);
+		}
+		else {
+			dev->poll_fds[0] = -1;
+			dev->poll_fds[1] = -1;
+		}
+	}
+	fd = dev->poll_fds[0];
+
+	pthread_mutex_unlock(&dev->mutex);
+
+	return fd;
+}
+
+int HID_API_EXPORT hid_poll(hid_device **devs, int n, int *ready, int timeout_ms)
+{
+	const char *error;
+
+	return poll_devices(devs, n, ready, timeout_ms, &error);
+}
+
+int HID_API_EXPORT hid_set_input_callback(hid_device *dev, hid_input_callback callback, void *user_data)
+{
+	/* hid_report_callback() calls the callback with the mutex held,
+	   so once it is taken here the previous one has returned. */
+	pthread_mutex_lock(&dev->callback_mutex);
+	dev->input_callback = callback;
+	dev->input_callback_data = user_data;
+	pthread_mutex_unlock(&dev->callback_mutex);
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_set_latest_report_mode(hid_device *dev, int enable)
+{
+	(void) dev;
+	(void) enable;
+
+	/* Not implemented on macOS: hid_report_callback() queues the
+	   reports itself, without the Input report helpers of hid_report.c */
+	return -1;
+}
+
+int HID_API_EXPORT hid_get_latest_report(hid_device *dev, unsigned char report_id, unsigned char *data, size_t length, size_t *sequence)
+{
+	(void) dev;
+	(void) report_id;
+	(void) data;
+	(void) length;
+	(void) sequence;
+
+	/* Not implemented on macOS */
+	return -1;
+}
+
+int HID_API_EXPORT hid_set_report_id_queues(hid_device *dev, int enable)
+{
+	(void) dev;
+	(void) enable;
+
+	/* Not implemented on macOS, like hid_set_latest_report_mode() */
+	return -1;
+}
+
+int HID_API_EXPORT hid_read_report_id(hid_device *dev, unsigned char report_id, unsigned char *data, size_t length, int milliseconds)
+{
+	(void) dev;
+	(void) report_id;
+	(void) data;
+	(void) length;
+	(void) milliseconds;
+
+	/* Not implemented on macOS */
+	return -1;
+}
+
+int HID_API_EXPORT hid_set_input_change_filter(hid_device *dev, int enable, const unsigned char *mask, size_t mask_length)
+{
+	(void) dev;
+	(void) enable;
+	(void) mask;
+	(void) mask_length;
+
+	/* Not implemented on macOS, like hid_set_latest_report_mode() */
+	return -1;
+}
+
+int HID_API_EXPORT hid_get_input_reports_suppressed(hid_device *dev, size_t *suppressed)
+{
+	(void) dev;
+	(void) suppressed;
+
+	/* Not implemented on macOS */
+	return -1;
+}
+
+int HID_API_EXPORT hid_get_stats(hid_device *dev, struct hid_stats *stats)
+{
+	(void) dev;
+	(void) stats;
+
+	/* Not implemented on macOS */
+	return -1;
+}
+
 int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
 {
 	/* All Nonblocking operation is handled by the library. */
@@ -1151,7 +1503,7 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 	/* Clear out the queue of received reports. */
 	pthread_mutex_lock(&dev->mutex);
 	while (dev->input_reports) {
-		return_data(dev, NULL, 0);
+		return_data(dev, NULL, 0, NULL);
 	}
 	pthread_mutex_unlock(&dev->mutex);
 	CFRelease(dev->device_handle);
@@ -1215,6 +1567,24 @@ int HID_API_EXPORT_CALL hid_darwin_is_device_open_exclusive(hid_device *dev)
 	return (dev->open_options == kIOHIDOptionsTypeSeizeDevice) ? 1 : 0;
 }
 
+int HID_API_EXPORT_CALL hid_get_report_fields(hid_device *dev, const struct hid_report_field **fields)
+{
+	if (!fields)
+		return -1;
+
+	if (dev->num_report_fields < 0) {
+		CFTypeRef ref = IOHIDDeviceGetProperty(dev->device_handle, CFSTR(kIOHIDReportDescriptorKey));
+		if (ref == NULL || CFGetTypeID(ref) != CFDataGetTypeID())
+			return -1;
+		dev->num_report_fields = compile_report_descriptor(CFDataGetBytePtr((CFDataRef) ref), (size_t) CFDataGetLength((CFDataRef) ref), &dev->report_fields);
+		if (dev->num_report_fields < 0)
+			return -1;
+	}
+
+	*fields = dev->report_fields;
+	return dev->num_report_fields;
+}
+
 HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
 {
 	(void) dev;
@@ -60,6 +60,11 @@ typedef LONG NTSTATUS;
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+
+/* hid_enumerate_ex() of hid_report.c */
+#define HID_REPORT_ENUM_HELPERS
+#include "hid_report.c"
 
 #ifdef MIN
 #undef MIN
@@ -181,6 +186,8 @@ struct hid_device_ {
 		wchar_t *last_error_str;
 		BOOL read_pending;
 		char *read_buf;
+		unsigned char *acquired_buf; /* See hid_read_acquire() */
+		BOOL acquired;
 		OVERLAPPED ol;
 		OVERLAPPED write_ol;
 		struct hid_device_info* device_info;
@@ -218,6 +225,7 @@ static void free_hid_device(hid_device *dev)
 	free(dev->write_buf);
 	free(dev->feature_buf);
 	free(dev->read_buf);
+	free(dev->acquired_buf);
 	hid_free_enumeration(dev->device_info);
 	free(dev);
 }
@@ -705,6 +713,25 @@ void  HID_API_EXPORT HID_API_CALL hid_free_enumeration(struct hid_device_info *d
 	}
 }
 
+int HID_API_EXPORT HID_API_CALL hid_hotplug_register_callback(unsigned short vendor_id, unsigned short product_id, int events, hid_hotplug_callback_fn callback, void *user_data, hid_hotplug_callback_handle *callback_handle)
+{
+	(void) vendor_id;
+	(void) product_id;
+	(void) events;
+	(void) callback;
+	(void) user_data;
+	(void) callback_handle;
+
+	/* Not implemented on Windows yet */
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_hotplug_deregister_callback(hid_hotplug_callback_handle callback_handle)
+{
+	(void) callback_handle;
+	return -1;
+}
+
 HID_API_EXPORT hid_device * HID_API_CALL hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
 {
 	/* TODO: Merge this functions with the Linux version. This function should be platform independent. */
@@ -965,6 +992,241 @@ int HID_API_EXPORT HID_API_CALL hid_read(hid_device *dev, unsigned char *data, s
 	return hid_read_timeout(dev, data, length, (dev->blocking)? -1: 0);
 }
 
+int HID_API_EXPORT HID_API_CALL hid_read_timestamped(hid_device *dev, unsigned char *data, size_t length, uint64_t *timestamp_ns, int milliseconds)
+{
+	int bytes_read;
+	LARGE_INTEGER counter, frequency;
+
+	if (!timestamp_ns) {
+		register_string_error(dev, L"Invalid timestamp pointer");
+		return -1;
+	}
+
+	bytes_read = hid_read_timeout(dev, data, length, milliseconds);
+
+	/* Windows doesn't tell when the report arrived, so take the time
+	   right after the read completed. */
+	if (bytes_read > 0) {
+		QueryPerformanceCounter(&counter);
+		QueryPerformanceFrequency(&frequency);
+		*timestamp_ns = (uint64_t) (counter.QuadPart / frequency.QuadPart) * 1000000000u +
+		                (uint64_t) (counter.QuadPart % frequency.QuadPart) * 1000000000u / (uint64_t) frequency.QuadPart;
+	}
+
+	return bytes_read;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_read_acquire(hid_device *dev, const unsigned char **data, size_t *length, int milliseconds)
+{
+	int bytes_read;
+
+	if (!data || !length) {
+		register_string_error(dev, L"Invalid report pointer");
+		return -1;
+	}
+
+	if (dev->acquired) {
+		register_string_error(dev, L"The previous report was not released");
+		return -1;
+	}
+
+	/* The report has to be copied out of read_buf anyway, as the
+	   next overlapped read reuses it. Copy it into a buffer which
+	   is only lent out. */
+	if (!dev->acquired_buf) {
+		dev->acquired_buf = (unsigned char*) malloc(dev->input_report_length? dev->input_report_length: 1);
+		if (!dev->acquired_buf) {
+			register_string_error(dev, L"Failed to allocate memory");
+			return -1;
+		}
+	}
+
+	bytes_read = hid_read_timeout(dev, dev->acquired_buf, dev->input_report_length, milliseconds);
+	if (bytes_read <= 0)
+		return bytes_read;
+
+	dev->acquired = TRUE;
+	*data = dev->acquired_buf;
+	*length = (size_t) bytes_read;
+
+	return 1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_read_release(hid_device *dev, const unsigned char *data)
+{
+	if (!dev->acquired || data != dev->acquired_buf) {
+		register_string_error(dev, L"No such report was acquired");
+		return -1;
+	}
+
+	dev->acquired = FALSE;
+
+	return 0;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_read_batch(hid_device *dev, unsigned char *data, size_t stride, size_t max_reports, size_t *lengths, int milliseconds)
+{
+	int bytes_read;
+	size_t reports_read = 0;
+
+	if (!data || !lengths || max_reports == 0) {
+		register_string_error(dev, L"Invalid batch buffer");
+		return -1;
+	}
+
+	if (max_reports > INT_MAX)
+		max_reports = INT_MAX;
+
+	/* Wait for the first report only. The following reads complete
+	   right away if the HID class driver has more reports buffered. */
+	while (reports_read < max_reports) {
+		bytes_read = hid_read_timeout(dev, data + reports_read * stride, stride, reports_read == 0? milliseconds: 0);
+		if (bytes_read < 0 && reports_read == 0)
+			return -1;
+		if (bytes_read <= 0)
+			break;
+		lengths[reports_read++] = (size_t) bytes_read;
+	}
+
+	return (int) reports_read;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_get_poll_fd(hid_device *dev)
+{
+	/* There is no file descriptor to wait on with Windows handles. */
+	register_string_error(dev, L"hid_get_poll_fd is not supported on Windows");
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_poll(hid_device **devs, int n, int *ready, int timeout_ms)
+{
+	HANDLE events[MAXIMUM_WAIT_OBJECTS];
+	DWORD wait_res;
+	int i, num_ready = 0, failed = 0;
+
+	if (!devs || !ready || n <= 0 || n > MAXIMUM_WAIT_OBJECTS)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		hid_device *dev = devs[i];
+
+		ready[i] = 0;
+		if (!dev->read_pending) {
+			/* Start the Overlapped I/O read hid_read_timeout()
+			   would start, so that there is an event to wait on.
+			   The next hid_read_timeout() completes it. */
+			DWORD bytes_read = 0;
+			dev->read_pending = TRUE;
+			memset(dev->read_buf, 0, dev->input_report_length);
+			ResetEvent(dev->ol.hEvent);
+			if (!ReadFile(dev->device_handle, dev->read_buf, (DWORD) dev->input_report_length, &bytes_read, &dev->ol) &&
+			    GetLastError() != ERROR_IO_PENDING) {
+				/* hid_read_timeout() starts the read again and
+				   reports the error, so the device is ready. */
+				CancelIo(dev->device_handle);
+				dev->read_pending = FALSE;
+				ready[i] = 1;
+				failed = 1;
+			}
+		}
+		events[i] = dev->ol.hEvent;
+	}
+
+	if (!failed) {
+		wait_res = WaitForMultipleObjects((DWORD) n, events, FALSE, timeout_ms < 0? INFINITE: (DWORD) timeout_ms);
+		if (wait_res == WAIT_FAILED)
+			return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (!ready[i])
+			ready[i] = WaitForSingleObject(events[i], 0) == WAIT_OBJECT_0;
+		if (ready[i])
+			num_ready++;
+	}
+
+	return num_ready;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_set_input_callback(hid_device *dev, hid_input_callback callback, void *user_data)
+{
+	(void) callback;
+	(void) user_data;
+
+	/* Reports are only read by the application's own ReadFile() calls,
+	   there is no thread of the library to call the callback from. */
+	register_string_error(dev, L"hid_set_input_callback is not supported on Windows");
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_set_latest_report_mode(hid_device *dev, int enable)
+{
+	(void) enable;
+
+	/* Like hid_set_input_callback(), this needs a reading thread */
+	register_string_error(dev, L"hid_set_latest_report_mode is not supported on Windows");
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_get_latest_report(hid_device *dev, unsigned char report_id, unsigned char *data, size_t length, size_t *sequence)
+{
+	(void) report_id;
+	(void) data;
+	(void) length;
+	(void) sequence;
+
+	register_string_error(dev, L"hid_get_latest_report is not supported on Windows");
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_set_report_id_queues(hid_device *dev, int enable)
+{
+	(void) enable;
+
+	/* Like hid_set_input_callback(), this needs a reading thread */
+	register_string_error(dev, L"hid_set_report_id_queues is not supported on Windows");
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_read_report_id(hid_device *dev, unsigned char report_id, unsigned char *data, size_t length, int milliseconds)
+{
+	(void) report_id;
+	(void) data;
+	(void) length;
+	(void) milliseconds;
+
+	register_string_error(dev, L"hid_read_report_id is not supported on Windows");
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_set_input_change_filter(hid_device *dev, int enable, const unsigned char *mask, size_t mask_length)
+{
+	(void) enable;
+	(void) mask;
+	(void) mask_length;
+
+	/* The previous reports are sized from the report descriptor,
+	   which Windows does not give */
+	register_string_error(dev, L"hid_set_input_change_filter is not supported on Windows");
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_get_input_reports_suppressed(hid_device *dev, size_t *suppressed)
+{
+	(void) suppressed;
+
+	register_string_error(dev, L"hid_get_input_reports_suppressed is not supported on Windows");
+	return -1;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_get_stats(hid_device *dev, struct hid_stats *stats)
+{
+	(void) stats;
+
+	register_string_error(dev, L"hid_get_stats is not supported on Windows");
+	return -1;
+}
+
 int HID_API_EXPORT HID_API_CALL hid_set_nonblocking(hid_device *dev, int nonblock)
 {
 	dev->blocking = !nonblock;
@@ -1141,6 +1403,15 @@ int HID_API_EXPORT_CALL HID_API_CALL hid_get_indexed_string(hid_device *dev, int
 	return 0;
 }
 
+int HID_API_EXPORT_CALL hid_get_report_fields(hid_device *dev, const struct hid_report_field **fields)
+{
+	(void) fields;
+
+	/* Windows only gives the preparsed data, not the descriptor */
+	register_string_error(dev, L"hid_get_report_fields is not supported on Windows");
+	return -1;
+}
+
 int HID_API_EXPORT_CALL hid_winapi_get_container_id(hid_device *dev, GUID *container_id)
 {
 	wchar_t *interface_path = NULL, *device_id = NULL;